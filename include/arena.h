@@ -0,0 +1,58 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Scratch memory for the request being served. Bodies and packed responses
+ * are bumped out of one block that is kept from request to request, so a
+ * connection in its steady state doesn't touch the heap at all. Whatever
+ * doesn't fit the block is allocated on its own and, once the request is
+ * done, the block grows to hold it next time.
+ */
+
+/* The size of the first block, which holds any request without a batch */
+#define ARENA_BLOCK_SIZE 16384
+
+/* A block never grows past this, larger requests keep allocating on their own */
+#define ARENA_MAX_BLOCK_SIZE (1u << 21)
+
+typedef struct arena_t {
+    char *block;
+    size_t used, capacity;
+    /* Allocations that didn't fit the block, and how many bytes they took */
+    void *overflow;
+    size_t overflow_bytes;
+} arena_t;
+
+/*
+ * Initializes an empty arena. Its block is only allocated when it is first used.
+ *
+ * @param arena The arena to initialize.
+ */
+void arena_init(arena_t *arena);
+
+/*
+ * Allocates memory that lives until the arena is reset.
+ *
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes needed.
+ * @return 16-byte aligned memory, or NULL if malloc(3) failed.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * Frees everything allocated from the arena at once, keeping its block for the next request.
+ *
+ * @param arena The arena to reset.
+ */
+void arena_reset(arena_t *arena);
+
+/*
+ * Frees the arena's block and every allocation from it.
+ *
+ * @param arena The arena to destroy.
+ */
+void arena_destroy(arena_t *arena);
+
+#endif
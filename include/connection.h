@@ -0,0 +1,110 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "cream.h"
+#include "arena.h"
+
+#define CONN_BUFFER_SIZE 16384
+
+typedef enum conn_state_t { READ_HEADER, READ_BODY } conn_state_t;
+
+typedef struct conn_t {
+    int fd;
+    conn_state_t state;
+    request_header_t request_header;
+    size_t body_size;
+    char *in;
+    size_t in_start, in_end, in_cap;
+    char *out;
+    size_t out_start, out_end, out_cap;
+    /* Holds the packed responses of batch requests until they were queued */
+    arena_t arena;
+    bool closing;
+    time_t last_active;
+    struct conn_t *prev, *next;
+} conn_t;
+
+typedef struct conn_list_t {
+    conn_t *head, *tail;
+} conn_list_t;
+
+/*
+ * Creates the state for a newly accepted connection.
+ *
+ * @param fd The socket connected to the client.
+ * @return A pointer to the new connection, or NULL if calloc(3) failed.
+ */
+conn_t *create_conn(int fd);
+
+/*
+ * Frees a connection and its buffers. The socket is not closed.
+ *
+ * @param conn The connection to free.
+ */
+void destroy_conn(conn_t *conn);
+
+/*
+ * Makes room at the end of the input buffer for the next receive.
+ *
+ * @param conn The connection to receive into.
+ * @return The number of bytes that can be received at conn->in + conn->in_end.
+ */
+size_t conn_input_space(conn_t *conn);
+
+/*
+ * Parses every complete request in the input buffer, fulfills it and
+ * appends its response to the output buffer. Partial requests are left
+ * in the input buffer until the rest of their bytes arrive.
+ *
+ * @param conn The connection whose input should be processed.
+ * @return false if a response could not be queued, true otherwise.
+ */
+bool conn_process(conn_t *conn);
+
+/*
+ * Parses and fulfills requests from bytes that were received into a buffer
+ * other than the connection's own, such as a registered io_uring buffer.
+ * Only an incomplete trailing request is copied into the input buffer.
+ *
+ * @param conn The connection the bytes were received on.
+ * @param data The received bytes.
+ * @param length The number of received bytes.
+ * @return false if the bytes could not be buffered or a response could not be queued.
+ */
+bool conn_feed(conn_t *conn, char *data, size_t length);
+
+/*
+ * @param conn The connection to check.
+ * @return The number of response bytes waiting to be sent.
+ */
+size_t conn_pending_output(conn_t *conn);
+
+/*
+ * Drops bytes from the front of the output buffer after they were sent.
+ *
+ * @param conn The connection that sent the bytes.
+ * @param sent The number of bytes sent.
+ */
+void conn_consume_output(conn_t *conn, size_t sent);
+
+/*
+ * Marks a connection as active now by moving it to the tail of a list that
+ * is ordered from least to most recently active. Adds it if it isn't linked.
+ *
+ * @param list The list of an event loop's connections.
+ * @param conn The connection that was active.
+ */
+void touch_conn(conn_list_t *list, conn_t *conn);
+
+/*
+ * Removes a connection from its event loop's list.
+ *
+ * @param list The list the connection is linked in.
+ * @param conn The connection to remove.
+ */
+void unlink_conn(conn_list_t *list, conn_t *conn);
+
+#endif
@@ -8,13 +8,70 @@
 #define MIN_VALUE_SIZE 1
 #define MAX_VALUE_SIZE 4096
 
+#define MAX_BATCH_KEYS 256
+
 typedef struct request_header_t {
     uint8_t request_code;
     uint32_t key_size;
     uint32_t value_size;
 } __attribute__((packed)) request_header_t;
 
-typedef enum request_codes { PUT = 0x01, GET = 0x02, EVICT = 0x04, CLEAR = 0x08 } request_codes;
+typedef enum request_codes { PUT = 0x01, GET = 0x02, EVICT = 0x04, CLEAR = 0x08, MGET = 0x10, MPUT = 0x20, STATS = 0x40, PUT_TTL = 0x80 } request_codes;
+
+/*
+ * A PUT_TTL request is framed like a PUT, but its value is followed by a
+ * ttl_trailer_t. The pair expires that many milliseconds after it is stored,
+ * or never if the TTL is 0, while a plain PUT uses the server's default TTL.
+ */
+typedef struct ttl_trailer_t {
+    uint32_t ttl;
+} __attribute__((packed)) ttl_trailer_t;
+
+/*
+ * Batch requests (MGET, MPUT) set key_size in their request_header_t to the number
+ * of entries and value_size to the length of the body that follows. Every
+ * entry in the body is a batch_entry_header_t followed by the key and, for
+ * an MPUT, the value. MGET entries have a value_size of 0.
+ *
+ * The body of an MGET response holds one response_header_t per key, in
+ * request order, each followed by the value if the response code is OK.
+ * Keys that are missing get a NOT_FOUND header with a value_size of 0.
+ * An MPUT is answered with a single OK once every pair was stored.
+ */
+typedef struct batch_entry_header_t {
+    uint32_t key_size;
+    uint32_t value_size;
+} __attribute__((packed)) batch_entry_header_t;
+
+/*
+ * An MPUT is not all-or-nothing. When the store can't take every pair of a
+ * well formed MPUT, the pairs it took stay stored and the request is answered
+ * with BAD_REQUEST and an mput_response_t body. Which pairs those are isn't
+ * said, but storing a pair again only replaces it, so the whole MPUT can be
+ * sent again. A malformed MPUT stores nothing and gets a BAD_REQUEST without
+ * a body.
+ */
+typedef struct mput_response_t {
+    uint32_t num_stored;
+} __attribute__((packed)) mput_response_t;
+
+/*
+ * A STATS request is a bare header, like CLEAR. It is answered with OK and
+ * a stats_response_t body describing how far stored keys sit from their home
+ * position, so probe lengths can be watched over the server's uptime, and
+ * how much of the store huge pages back.
+ */
+typedef struct stats_response_t {
+    uint32_t num_entries;
+    uint32_t max_probe;
+    /* the mean probe length times 1000 */
+    uint32_t mean_probe_milli;
+    /* the bytes of tables and slabs on hugetlb pages, and on memory transparent huge pages were asked for */
+    uint64_t hugetlb_bytes;
+    uint64_t transparent_bytes;
+    /* the bytes of the process the kernel actually put on transparent huge pages */
+    uint64_t transparent_huge_bytes;
+} __attribute__((packed)) stats_response_t;
 
 typedef struct response_header_t {
     uint32_t response_code;
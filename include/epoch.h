@@ -0,0 +1,40 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Epoch-based reclamation. Readers bracket every access to shared nodes
+ * with epoch_enter() and epoch_exit(), which only write a record owned by
+ * the calling thread. Writers unlink a node, tag it with epoch_retire_tag()
+ * and free it once epoch_reclaimable() says no reader can still see it.
+ */
+
+/*
+ * Marks the calling thread as reading shared memory. Calls may nest, only
+ * the outermost pair announces anything.
+ */
+void epoch_enter(void);
+
+/*
+ * Ends the read section started by the matching epoch_enter().
+ */
+void epoch_exit(void);
+
+/*
+ * Must be called after a node was unlinked and before it is queued for freeing.
+ *
+ * @return The epoch to tag the unlinked node with.
+ */
+uint64_t epoch_retire_tag(void);
+
+/*
+ * Advances the global epoch if every reader has caught up with it.
+ *
+ * @param tag The tag of a retired node.
+ * @return true if no reader can still hold a pointer to a node retired with tag.
+ */
+bool epoch_reclaimable(uint64_t tag);
+
+#endif
@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include "hugepage.h"
 
 typedef struct map_key_t {
     void *key_base;
@@ -19,6 +20,45 @@ typedef struct map_val_t {
 
 typedef uint32_t (*hash_func_f)(map_key_t);
 typedef void (*destructor_f)(map_key_t, map_val_t);
+typedef size_t (*size_func_f)(map_key_t, map_val_t);
+
+/*
+ * Owns a stored key/value pair. The map holds one reference while the pair
+ * is in the map and every map_ref_t handed out holds another. The pair is
+ * destroyed when the last reference is released.
+ */
+typedef struct map_entry_t {
+    uint32_t refs;
+    /* added to by lookups, taken from whenever the eviction clock passes the entry */
+    uint8_t hits;
+    map_key_t key;
+    map_val_t val;
+    destructor_f destroy_function;
+    /* the map_clock() millisecond at which the pair expires, 0 if it never does */
+    uint64_t expires;
+    /* the bytes the pair counts against the map's memory limit */
+    size_t charge;
+    /* the timing wheel bucket of an expiring pair */
+    struct map_entry_t *wheel_next;
+    struct map_entry_t **wheel_pprev;
+} map_entry_t;
+
+/* Slots per control group, one SSE2 register of control bytes */
+#define MAP_GROUP_SIZE 16
+
+/* The most hits an entry collects, so a key read often survives that many passes of the eviction clock */
+#define MAP_CLOCK_HITS 3
+
+/* Keys up to this long are kept in the slot and compared without following a pointer */
+#define MAP_INLINE_KEY_SIZE 32
+
+/*
+ * How a map places keys. GROUP_PROBING scans whole 16-slot groups of control
+ * bytes at a time. ROBIN_HOOD_PROBING walks single slots, lets keys that are
+ * further from their home slot take the place of closer ones and shifts
+ * keys back on delete, which keeps probes short under constant churn.
+ */
+typedef enum probe_modes { GROUP_PROBING, ROBIN_HOOD_PROBING } probe_modes;
 
 typedef struct map_node_t {
     map_key_t key;
@@ -26,20 +66,126 @@ typedef struct map_node_t {
     bool tombstone;
 } map_node_t;
 
+/*
+ * A value together with the reference that keeps it alive.
+ */
+typedef struct map_ref_t {
+    map_val_t val;
+    map_entry_t *entry;
+} map_ref_t;
+
+/*
+ * An entry that was removed from the map but may still be read by a
+ * lock-free get(). The map drops its reference once no reader can see it.
+ */
+typedef struct retired_node_t {
+    map_entry_t *entry;
+    uint64_t epoch;
+} retired_node_t;
+
+/*
+ * Probe lengths of the keys in a map. A key's probe length is the number of
+ * groups, or of slots for ROBIN_HOOD_PROBING, a lookup of it visits.
+ */
+typedef struct probe_stats_t {
+    uint32_t num_entries;
+    uint32_t max_probe;
+    uint64_t total_probe;
+} probe_stats_t;
+
+/*
+ * Where a map stores a pair, one cache line per slot. Everything a lookup
+ * needs for a hit on a short key is in the slot itself. Longer keys are
+ * compared through the entry.
+ */
+typedef struct map_slot_t {
+    uint32_t hash;
+    uint32_t key_len;
+    map_entry_t *entry;
+    map_val_t val;
+    union {
+        uint8_t key_inline[MAP_INLINE_KEY_SIZE];
+        uint64_t key_words[MAP_INLINE_KEY_SIZE / sizeof(uint64_t)];
+    };
+} map_slot_t;
+
+/*
+ * The slots of a map. The number of groups is a power of two, so probes
+ * wrap with a mask.
+ */
+typedef struct map_table_t {
+    uint32_t num_groups;
+    map_slot_t *slots;
+    /* one control byte per slot: empty, deleted, or the low 7 bits of the key's hash */
+    uint8_t *ctrl;
+    /* set when the slots were mapped by huge_alloc(), which says what backs them */
+    bool huge;
+    page_sizes slot_pages;
+    /* set when the table was mapped fresh for a NUMA node instead of taken from the heap */
+    bool mapped;
+} map_table_t;
+
+/* Each level of a timing wheel has 64 buckets, and every bucket of a level spans one lap of the level below */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1u << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+/* Milliseconds per bucket of the lowest level, so the top level reaches past a day and a half */
+#define WHEEL_TICK_MS 8
+
+/*
+ * The expiring entries of a map, hashed by expiry tick into buckets. An entry
+ * far from expiring sits in a coarse bucket of a higher level and moves down
+ * whenever the wheel below completes a lap, so expiring a tick only ever
+ * touches the entries that are due.
+ */
+typedef struct timing_wheel_t {
+    /* the next tick that has not been expired */
+    uint64_t tick;
+    uint32_t count;
+    map_entry_t *buckets[WHEEL_LEVELS][WHEEL_SIZE];
+} timing_wheel_t;
+
 typedef struct hashmap_t {
     uint32_t capacity;
     uint32_t size;
-    map_node_t *nodes;
+    /* the table grows by doubling up to max_groups, enough to keep capacity entries at 7/8 load */
+    map_table_t *table;
+    uint32_t max_groups;
+    /* while growing, the previous table, whose slots below migrated were moved to table */
+    map_table_t *old_table;
+    uint32_t migrated;
+    /* the next slot the eviction clock looks at when a full map needs room */
+    uint32_t clock_hand;
+    /* milliseconds until pairs put without a TTL of their own expire, 0 if they never do */
+    uint32_t ttl;
+    /* the bytes charged for the stored pairs, which eviction keeps below max_bytes unless it is 0 */
+    uint64_t bytes;
+    uint64_t max_bytes;
+    size_func_f size_function;
+    timing_wheel_t wheel;
+    /* a table that was replaced but may still be probed by a lock-free get() */
+    map_table_t *retired_table;
+    uint64_t retired_table_epoch;
     hash_func_f hash_function;
     destructor_f destroy_function;
-    int num_readers;
     pthread_mutex_t write_lock;
-    pthread_mutex_t fields_lock;
+    /* the NUMA node new tables are placed on, or -1 for wherever they are first touched */
+    int numa_node;
+    /* set when one thread does all reads and writes, which then skip the lock and sequence number */
+    bool single_owner;
     bool invalid;
+    probe_modes probing;
+    /* odd while a writer is changing nodes, readers retry if it moved */
+    uint32_t seq;
+    uint32_t write_depth;
+    retired_node_t *retired;
+    size_t num_retired;
+    size_t retired_cap;
 } hashmap_t;
 
 /*
- * Create a new hash map.
+ * Create a new hash map. Its table starts small and grows while entries are
+ * added, moving a few slots to the larger table on every write.
  *
  * @param capacity The number of elements the map can hold.
  * @param hash_function The function to be used to hash keys.
@@ -49,12 +195,25 @@ typedef struct hashmap_t {
  */
 hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function);
 
+/*
+ * Create a new hash map that places keys with the given probing mode.
+ * create_map() uses GROUP_PROBING.
+ *
+ * @param capacity The number of elements the map can hold.
+ * @param hash_function The function to be used to hash keys.
+ * @param destroy_function The function to be used to destroy elements
+ *                         when the map is destroyed.
+ * @param probing How keys are placed.
+ * @return A pointer to the new hashmap_t instance.
+ */
+hashmap_t *create_probing_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function, probe_modes probing);
+
 /*
  * Insert a new key/value pair into the map.
  * If the key already exists, the corresponding value is overwritten.
  * If the map is full and force is false, nothing is inserted.
- * If the map is full and force is true, the entry at the index computed by
- * get_index() is overwritten.
+ * If the map is full and force is true, an entry the eviction clock picks
+ * is evicted. The pair expires after the map's default TTL.
  *
  * @param self The hash map to use
  * @param key The key to insert
@@ -65,7 +224,55 @@ hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f
 bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force);
 
 /*
- * Retrieve the value associated with a key.
+ * The variants of the map operations ending in _hashed take the hash of each
+ * key, computed with the map's hash function, from a caller that needed it
+ * anyway, such as a sharded map picking the shard. They behave exactly like
+ * the operations they are named after.
+ */
+bool put_hashed(hashmap_t *self, map_key_t key, map_val_t val, uint32_t hash, bool force);
+
+/*
+ * Insert a new key/value pair as put() would, but with a TTL of its own.
+ *
+ * @param self The hash map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param ttl The milliseconds until the pair expires, or 0 if it never does.
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return true if the insertion was sucessful, false otherwise.
+ */
+bool put_ttl(hashmap_t *self, map_key_t key, map_val_t val, uint32_t ttl, bool force);
+bool put_ttl_hashed(hashmap_t *self, map_key_t key, map_val_t val, uint32_t hash, uint32_t ttl, bool force);
+
+/*
+ * Set the TTL of the pairs put() and put_batch() insert from now on.
+ *
+ * @param self The hash map to use
+ * @param ttl The milliseconds until those pairs expire, or 0 if they never do.
+ */
+void set_default_ttl(hashmap_t *self, uint32_t ttl);
+
+/*
+ * Insert many key/value pairs into the map while taking the write lock
+ * once for the whole batch. Each pair is inserted as if by put().
+ *
+ * @param self The hash map to use
+ * @param keys The keys to insert
+ * @param vals The values to insert, in the same order as the keys.
+ * @param num_pairs The number of pairs to insert.
+ * @param force Whether or not entries should be overwritten if the map is full.
+ * @return The number of pairs that were inserted. Insertion stops at the first pair that is
+ *         invalid or doesn't fit, so these are the first pairs.
+ */
+size_t put_batch(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t num_pairs, bool force);
+/* hashes may be NULL, which hashes the keys as put_batch() does */
+size_t put_batch_hashed(hashmap_t *self, map_key_t *keys, map_val_t *vals, const uint32_t *hashes, size_t num_pairs, bool force);
+
+/*
+ * Retrieve the value associated with a key without taking any lock.
+ * The value stays valid until the calling thread leaves the epoch it was
+ * in when get() was called, so callers that use it afterwards must wrap
+ * the lookup and the use in epoch_enter() and epoch_exit().
  *
  * @param self The hash map to use
  * @param key The key to search for
@@ -73,15 +280,54 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force);
  *         pointer and a value length of 0 if the key is not found.
  */
 map_val_t get(hashmap_t *self, map_key_t key);
+map_val_t get_hashed(hashmap_t *self, map_key_t key, uint32_t hash);
+
+/*
+ * Retrieve the value associated with a key and take a reference on it.
+ * The value stays valid after the entry is overwritten, deleted or cleared
+ * until the reference is released, so it can be sent straight from the map.
+ *
+ * @param self The hash map to use
+ * @param key The key to search for
+ * @return The corresponding value and its reference, or a map_ref_t with a
+ *         null value pointer and a null entry if the key is not found.
+ */
+map_ref_t get_ref(hashmap_t *self, map_key_t key);
+map_ref_t get_ref_hashed(hashmap_t *self, map_key_t key, uint32_t hash);
+
+/*
+ * Release a reference taken by get_ref(). Releasing a reference with a
+ * null entry does nothing.
+ *
+ * @param ref The reference to release.
+ */
+void release_ref(map_ref_t ref);
+
+/*
+ * Retrieve the values associated with many keys without taking any lock.
+ * The values stay valid as described for get().
+ *
+ * @param self The hash map to use
+ * @param keys The keys to search for
+ * @param vals Filled with the value of each key, or a map_val_t instance
+ *             with a null pointer and a value length of 0 if it is not found.
+ * @param num_keys The number of keys to search for.
+ * @return The number of keys that were found.
+ */
+size_t get_batch(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t num_keys);
+/* hashes may be NULL, which hashes the keys as get_batch() does */
+size_t get_batch_hashed(hashmap_t *self, map_key_t *keys, const uint32_t *hashes, map_val_t *vals, size_t num_keys);
 
 /*
- * Remove the entry associated with a key.
+ * Remove the entry associated with a key. The map destroys the removed
+ * key and value once no reader can see them and no reference is held.
  *
  * @param self The hash map to use
  * @param key The key to remove.
  * @return The removed map_node_t instance.
  */
 map_node_t delete(hashmap_t *self, map_key_t key);
+map_node_t delete_hashed(hashmap_t *self, map_key_t key, uint32_t hash);
 
 /*
  * Clears and destroys all entries in the map.
@@ -92,8 +338,59 @@ map_node_t delete(hashmap_t *self, map_key_t key);
 bool clear_map(hashmap_t *self);
 
 /*
- * Invalidate a hash map and its elements using the destructor function in the
- * map.
+ * Limit the memory the pairs in the map take up. Each pair is charged what
+ * size_function says, plus the map's own bookkeeping for it. Inserting a pair
+ * evicts entries until the charges fit, or fails if force is false.
+ *
+ * @param self The hash map to use
+ * @param max_bytes The most bytes the pairs may be charged, or 0 for no limit.
+ * @param size_function What a pair takes up, or NULL to charge the lengths of its key and value.
+ */
+void set_memory_limit(hashmap_t *self, uint64_t max_bytes, size_func_f size_function);
+
+/*
+ * Place the tables the map grows into on a NUMA node, for the threads that
+ * use the map most to find them in their own socket's memory.
+ *
+ * @param self The hash map to use
+ * @param node The node, or -1 to leave placement to the kernel.
+ */
+void set_numa_node(hashmap_t *self, int node);
+
+/*
+ * Hand the map to one thread for good. No other thread may use it
+ * afterwards, and in exchange no operation takes a lock or enters an epoch anymore.
+ *
+ * @param self The hash map to use
+ */
+void set_single_owner(hashmap_t *self);
+
+/*
+ * Remove every entry whose TTL ran out. Lookups already miss expired entries,
+ * this frees their memory and makes room for live ones.
+ *
+ * @param self The hash map to expire.
+ * @return The number of entries that were removed.
+ */
+size_t expire_map(hashmap_t *self);
+
+/*
+ * The clock TTLs are measured against, in milliseconds.
+ */
+uint64_t map_clock(void);
+
+/*
+ * Measure how far the keys in the map are from their home position.
+ *
+ * @param self The hash map to measure.
+ * @return The probe lengths of the map's keys, all zero if self is invalid.
+ */
+probe_stats_t map_probe_stats(hashmap_t *self);
+
+/*
+ * Invalidate a hash map and drop its references to its elements. Elements
+ * without outstanding map_ref_t references are destroyed right away using the
+ * destructor function in the map. No other thread may be reading the map anymore.
  *
  * @param self The hash map to invalidate.
  * @return true if the operation was successful.
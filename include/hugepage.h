@@ -0,0 +1,83 @@
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory backed by 2MB pages, for the large arrays that are probed at random.
+ * One TLB entry then covers 512 times as much of them as with 4K pages. Pages
+ * are taken from the hugetlb pool the administrator reserved, and when it has
+ * none left the kernel is asked to back the memory with transparent huge
+ * pages instead.
+ */
+
+#define HUGE_PAGE_SIZE (1u << 21)
+
+/* What actually backs a mapping from huge_alloc() */
+typedef enum page_sizes { SMALL_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB_PAGES } page_sizes;
+
+/*
+ * The bytes currently mapped by huge_alloc(), by what backs them. Memory on
+ * transparent huge pages is only counted as asked for, the kernel decides
+ * page by page when it is touched, see transparent_huge_page_bytes().
+ */
+typedef struct huge_page_stats_t {
+    uint64_t hugetlb_bytes;
+    uint64_t transparent_bytes;
+    uint64_t small_bytes;
+} huge_page_stats_t;
+
+/*
+ * Turns huge pages on or off for the allocations that check huge_pages_enabled().
+ *
+ * @param enabled Whether they should be used.
+ */
+void set_huge_pages(bool enabled);
+
+/*
+ * @return Whether large allocations should use huge_alloc().
+ */
+bool huge_pages_enabled(void);
+
+/*
+ * Maps memory aligned to HUGE_PAGE_SIZE, backed by huge pages if the kernel has any to give.
+ *
+ * @param size The number of bytes needed, rounded up to HUGE_PAGE_SIZE.
+ * @param pages Set to what backs the memory.
+ * @return The zeroed memory, or NULL if it could not be mapped.
+ */
+void *huge_alloc(size_t size, page_sizes *pages);
+
+/*
+ * Unmaps memory from huge_alloc().
+ *
+ * @param ptr The memory.
+ * @param size The size it was allocated with.
+ * @param pages What huge_alloc() said backs it.
+ */
+void huge_free(void *ptr, size_t size, page_sizes pages);
+
+/*
+ * @return The bytes mapped by huge_alloc() so far and not unmapped, by what backs them.
+ */
+huge_page_stats_t huge_page_stats(void);
+
+/*
+ * @return The bytes of the process the kernel actually backs with transparent
+ *         huge pages, or 0 if it doesn't say.
+ */
+uint64_t transparent_huge_page_bytes(void);
+
+/*
+ * @return The number of free pages in the hugetlb pool, or 0 if the kernel doesn't say.
+ */
+long free_hugetlb_pages(void);
+
+/*
+ * @return Whether the kernel backs memory with transparent huge pages when asked to.
+ */
+bool transparent_huge_pages_available(void);
+
+#endif
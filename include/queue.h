@@ -2,35 +2,57 @@
 #define QUEUE_H
 
 #include <pthread.h>
-#include <semaphore.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-typedef struct queue_node_t {
+/* The number of items a queue holds before enqueue() waits for room, a power of two */
+#define QUEUE_CAPACITY 1024
+
+#define QUEUE_CACHE_LINE_SIZE 64
+
+/* The most items schedule_batch() hands one worker's queue in a single enqueue_batch() */
+#define QUEUE_BATCH_SIZE 64
+
+/*
+ * A cell of the ring. Its sequence tells producers and consumers whose turn it
+ * is: it equals the position a producer may fill, and that position plus one
+ * once the item can be taken.
+ */
+typedef struct queue_cell_t {
+    size_t sequence;
     void *item;
-    struct queue_node_t *next;
-} queue_node_t;
+} queue_cell_t;
 
+/*
+ * A bounded multi-producer multi-consumer ring. Producers and consumers claim
+ * positions with a compare-and-swap on their own cache line, so a handoff takes
+ * no lock and no allocation. A consumer that finds the ring empty sleeps on a
+ * futex, which producers only wake when somebody sleeps.
+ */
 typedef struct queue_t {
-    queue_node_t *front, *rear;
-    sem_t items;
-    pthread_mutex_t lock;
+    size_t enqueue_pos __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)));
+    size_t dequeue_pos __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)));
+    /* Bumped by every enqueue that finds sleepers, consumers wait for it to change */
+    uint32_t wakeups __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)));
+    uint32_t sleepers;
     bool invalid;
+    queue_cell_t cells[QUEUE_CAPACITY] __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)));
 } queue_t;
 
 typedef void (*item_destructor_f)(void *);
 
 /*
  * Creates and returns an instance of a queue
- * and initializes all locks
+ * with every cell free
  *
  * @return A pointer to a queue on the heap
  */
 queue_t *create_queue(void);
 
 /*
- * Invalidates a queue from memory and calls destroy_function on all
- * items in the queue
+ * Invalidates a queue and calls destroy_function on all
+ * items in the queue. Sleeping consumers wake up and get NULL.
  *
  * @param self The pointer to the queue
  * @param destroy_function The function to call on each item to clean it up
@@ -39,7 +61,7 @@ queue_t *create_queue(void);
 bool invalidate_queue(queue_t *self, item_destructor_f destroy_function);
 
 /*
- * Inserts a pointer to an item at the tail of the queue
+ * Inserts a pointer to an item at the tail of the queue, waiting for room if it is full
  *
  * @param self The pointer to the queue
  * @param item The pointer to insert into the queue
@@ -48,13 +70,115 @@ bool invalidate_queue(queue_t *self, item_destructor_f destroy_function);
 bool enqueue(queue_t *self, void *item);
 
 /*
- * Removes and returns the item at the head of the queue
+ * Inserts many items at the tail of the queue in order, claiming the free
+ * cells for several at once and waking sleeping consumers only once
+ *
+ * @param self The pointer to the queue
+ * @param items The pointers to insert into the queue
+ * @param num_items The number of items
+ * @return true if the insertion was successful, false otherwise
+ */
+bool enqueue_batch(queue_t *self, void **items, size_t num_items);
+
+/*
+ * Removes and returns the item at the head of the queue, waiting for one if it is empty
  *
  * @param self The pointer to the queue
  *
- * @return The item in the node at the head of the queue,
- *         or NULL if the queue was empty
+ * @return The item at the head of the queue,
+ *         or NULL if the queue was invalidated
  */
 void *dequeue(queue_t *self);
 
+/*
+ * Removes every item at the head of the queue that is ready, up to max,
+ * waiting for one if it is empty
+ *
+ * @param self The pointer to the queue
+ * @param items Filled with the items, in order
+ * @param max The most items to remove
+ *
+ * @return The number of items removed, or 0 if the queue was invalidated
+ */
+size_t dequeue_batch(queue_t *self, void **items, size_t max);
+
+/*
+ * Hands items to a fixed set of workers. Every worker owns a queue that it
+ * takes its items from, and an idle worker steals from the queues of its
+ * peers before it goes to sleep. Workers sleep on one futex, so an item
+ * left behind a busy worker still wakes an idle one.
+ */
+typedef struct scheduler_t {
+    uint32_t num_workers;
+    queue_t **queues;
+    /* The worker whose queue gets the next item */
+    uint32_t next_worker;
+    /* Bumped by every schedule() that finds sleepers, idle workers wait for it to change */
+    uint32_t wakeups __attribute__((aligned(QUEUE_CACHE_LINE_SIZE)));
+    uint32_t sleepers;
+    bool invalid;
+} scheduler_t;
+
+/*
+ * Creates a scheduler with an empty queue for every worker
+ *
+ * @param num_workers The number of workers
+ * @return A pointer to a scheduler on the heap, or NULL
+ */
+scheduler_t *create_scheduler(uint32_t num_workers);
+
+/*
+ * Invalidates a scheduler and calls destroy_function on all items
+ * in its queues. Sleeping workers wake up and get NULL.
+ *
+ * @param self The pointer to the scheduler
+ * @param destroy_function The function to call on each item to clean it up
+ * @return true if the scheduler was successfully invalidated, false otherwise
+ */
+bool invalidate_scheduler(scheduler_t *self, item_destructor_f destroy_function);
+
+/*
+ * Inserts an item into the queue of the next worker in round-robin order
+ *
+ * @param self The pointer to the scheduler
+ * @param item The pointer to insert
+ * @return true if the insertion was successful, false otherwise
+ */
+bool schedule(scheduler_t *self, void *item);
+
+/*
+ * Deals many items round-robin to the queues of the workers, adding all items
+ * of one queue at once and waking idle workers only once
+ *
+ * @param self The pointer to the scheduler
+ * @param items The pointers to insert
+ * @param num_items The number of items
+ * @return true if the insertion was successful, false otherwise
+ */
+bool schedule_batch(scheduler_t *self, void **items, size_t num_items);
+
+/*
+ * Takes the next item for a worker from its own queue, or steals one from
+ * a peer, waiting for one if all queues are empty
+ *
+ * @param self The pointer to the scheduler
+ * @param worker The index of the worker, below num_workers
+ *
+ * @return The item, or NULL if the scheduler was invalidated
+ */
+void *next_item(scheduler_t *self, uint32_t worker);
+
+/*
+ * Takes up to max items for a worker from its own queue, or steals them from
+ * a peer, waiting for one if all queues are empty
+ *
+ * @param self The pointer to the scheduler
+ * @param worker The index of the worker, below num_workers
+ * @param items Filled with the items
+ * @param max The most items to take
+ *
+ * @return The number of items taken, or 0 if the scheduler was invalidated
+ */
+size_t next_items(scheduler_t *self, uint32_t worker, void **items, size_t max);
+
 #endif
@@ -0,0 +1,28 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "server.h"
+
+/*
+ * Serves clients from NUM_WORKERS edge-triggered epoll event loops that
+ * share the listening sockets. Every loop multiplexes its own connections
+ * and never blocks on a single client.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @param listenfds The listening sockets to accept connections from.
+ * @param num_listeners The number of listening sockets.
+ */
+void run_reactor(args_struct *args, int *listenfds, int num_listeners);
+
+/*
+ * Serves clients from NUM_WORKERS event loops that share nothing. Loop i
+ * listens on its own port, PORT_NUMBER + i, and is the only thread that
+ * touches its partition of the data, which therefore takes no locks.
+ * Clients pick the port of a key themselves, like a pool of servers.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @param listenfds The listening socket of every loop, NUM_WORKERS of them.
+ */
+void run_cores(args_struct *args, int *listenfds);
+
+#endif
@@ -5,22 +5,92 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "queue.h"
+#include "sharded_map.h"
 #include "utils.h"
 #include "cream.h"
+#include "slab.h"
+#include "arena.h"
+#include "topology.h"
+#include "hugepage.h"
+
+typedef enum io_engines { THREADS_ENGINE, EPOLL_ENGINE, URING_ENGINE, CORES_ENGINE } io_engines;
 
 typedef struct args_struct{
 int NUM_WORKERS;
 char *PORT_NUMBER;
 int MAX_ENTRIES;
+int KEEP_ALIVE;
+io_engines ENGINE;
+int LISTENERS;
+int SHARDS;
+probe_modes PROBING;
+hash_func_f HASH_FUNCTION;
+int DEFAULT_TTL;
+uint64_t MAX_MEMORY;
+/* The CPUs worker i is pinned to CPUS[i % NUM_CPUS], none if NUM_CPUS is 0 */
+int NUM_CPUS;
+int CPUS[MAX_CPUS];
+bool HUGE_PAGES;
 } args_struct;
 
+typedef struct listener_group_t {
+    int listenfd;
+    scheduler_t *scheduler;
+    pthread_t acceptor;
+} listener_group_t;
+
+/* A worker of the threads engine and the scheduler it takes connections from */
+typedef struct worker_t {
+    scheduler_t *scheduler;
+    uint32_t index;
+    pthread_t thread;
+} worker_t;
+
+#define READ_BUFFER_SIZE 16384
+/* The most connections an acceptor schedules at once, and a worker without keep-alive takes at once */
+#define ACCEPT_BATCH 64
+#define WORKER_BATCH 16
+#define MIN_SHARD_ENTRIES 64
+/* How often the expiry thread removes the entries whose TTL ran out */
+#define EXPIRY_INTERVAL_MS 100
+
+/* Accepted connections travel through the schedulers as their descriptor, offset by one so none is NULL */
+#define FD_TO_ITEM(fd) ((void *) (intptr_t) ((fd) + 1))
+#define ITEM_TO_FD(item) ((int) (intptr_t) (item) - 1)
+
+/* Bytes received from a client that haven't been handed to a request yet */
+typedef struct read_buffer_t {
+    char data[READ_BUFFER_SIZE];
+    int start, end;
+} read_buffer_t;
+
 #define USAGE(prog_name, exitcode)                                                       \
   do {                                                                         \
     fprintf(stderr,                                                            \
-            "\n%s [-h] NUM_WORKERS PORT_NUMBER MAX_ENTTRIES \n"                \
+            "\n%s [-h] [-k SECONDS] [-e ENGINE] [-l LISTENERS] [-s SHARDS] [-p PROBING] [-H HASH] [-t SECONDS] [-m BYTES] [-c CPUS] [-L] NUM_WORKERS PORT_NUMBER MAX_ENTTRIES \n" \
             "\n"                                                               \
             "-h                 Displays this help menu and returns EXIT_SUCCESS.\n"                          \
+            "-k, --keep-alive   Keep connections open for many requests, closing them after SECONDS idle.\n"   \
+            "-e, --engine       `threads` hands each connection to a worker (default), `epoll` multiplexes\n" \
+            "                   connections over NUM_WORKERS event loops, `uring` does the same with io_uring\n" \
+            "                   and falls back to `threads` when the kernel lacks it. `cores` gives every event\n" \
+            "                   loop its own port from PORT_NUMBER up and its own lock-free partition.\n"     \
+            "-l, --listeners    Open LISTENERS SO_REUSEPORT sockets, each with its own acceptor and workers.\n" \
+            "-s, --shards       Split the data store into SHARDS independently locked segments, rounded up\n" \
+            "                   to a power of two. Defaults to a few per worker.\n"                              \
+            "-p, --probing      `groups` scans 16 slots of hash tags at a time (default), `robin-hood` keeps\n" \
+            "                   probes short under heavy delete and insert churn.\n"                          \
+            "-H, --hash         `wyhash` (default), `siphash` or `jenkins`. The first two are keyed with a\n" \
+            "                   random seed at startup.\n"                                                    \
+            "-t, --ttl          Pairs stored by PUT and MPUT expire after SECONDS. Defaults to never.\n"     \
+            "-m, --max-memory   Evict pairs to keep the stored keys and values within BYTES, which may end\n" \
+            "                   in K, M or G. This counts the slab chunks in use, partly used slab pages\n" \
+            "                   and the tables come on top of it.\n"                                        \
+            "-c, --cpus         Pin worker i to the i-th CPU of a list such as 0-3,8-11, going round it, and\n" \
+            "                   place the data store on the NUMA nodes of those CPUs.\n"                     \
+            "-L, --huge-pages   Back the tables and slabs of the data store with 2MB pages.\n"               \
             "NUM_WORKERS        The number of worker threads used to service requests.\n"              \
             "PORT_NUMBER        Port number to listen on for incoming connections.\n"                                   \
             "MAX_ENTRIES        The maximum number of entries that can be stored in `cream`'s underlying data store.\n", \
@@ -30,14 +100,26 @@ int MAX_ENTRIES;
 
 args_struct *parse_args(int argc, char *argv[]);
 void start_server(args_struct *args);
-queue_t *server_queue;
-hashmap_t *server_hashmap;
+extern sharded_map_t *server_map;
+sharded_map_t *create_server_map(args_struct *args, uint32_t capacity, uint32_t num_shards, uint64_t max_memory);
+void set_request_map(sharded_map_t *map);
+int worker_cpu(args_struct *args, int worker);
 void destroy_hash_function(map_key_t key, map_val_t val);
+size_t pair_size_function(map_key_t key, map_val_t val);
 void destroy_queue_function(void* queue);
-void *worker_function();
+bool frame_request(request_header_t request_header, response_header_t *response_header, size_t *body_size);
+map_ref_t execute_request(request_header_t request_header, void *key, void *value, arena_t *arena, response_header_t *response_header);
+bool handle_request(int client_fd, read_buffer_t *buffer, arena_t *arena);
+int open_reuseport_listenfd(char *port);
+void *acceptor_function(void *arg);
+void *worker_function(void *arg);
+void *expiry_function(void *arg);
 int readNBytes(int client_fd, void* myBuffer, int bytesToRead);
 int writeNBytes(int client_fd, void* myBuffer, int bytesToRead);
+int readBufferedNBytes(int client_fd, read_buffer_t *buffer, void* myBuffer, int bytesToRead);
+int sendvNBytes(int client_fd, struct iovec *iov, int iovcnt);
 bool isKeyValid(request_header_t request_header, response_header_t *response_header);
 bool isValValid(request_header_t request_header, response_header_t *response_header);
+bool isBatchValid(request_header_t request_header, response_header_t *response_header);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#ifndef SHARDED_MAP_H
+#define SHARDED_MAP_H
+
+#include "hashmap.h"
+
+/*
+ * A map split into independently locked hashmap_t segments. Every key
+ * belongs to exactly one shard, so operations on keys of different shards
+ * never contend for the same locks.
+ */
+typedef struct sharded_map_t {
+    uint32_t num_shards;
+    uint32_t shard_bits;
+    hashmap_t **shards;
+    hash_func_f hash_function;
+} sharded_map_t;
+
+/*
+ * Create a new sharded map.
+ *
+ * @param capacity The number of elements the map can hold, split evenly over the shards.
+ * @param num_shards The number of shards, rounded up to a power of two.
+ * @param hash_function The function to be used to hash keys.
+ * @param destroy_function The function to be used to destroy elements
+ *                         when the map is destroyed.
+ * @param probing How every shard places its keys.
+ * @return A pointer to the new sharded_map_t instance.
+ */
+sharded_map_t *create_sharded_map(uint32_t capacity, uint32_t num_shards, hash_func_f hash_function, destructor_f destroy_function,
+                                  probe_modes probing);
+
+/*
+ * Insert a new key/value pair into the shard that owns the key, as put() would.
+ * A full shard evicts or refuses entries even if other shards have room.
+ *
+ * @param self The sharded map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param force Whether or not an entry should be evicted if the shard is full.
+ * @return true if the insertion was sucessful, false otherwise.
+ */
+bool sharded_put(sharded_map_t *self, map_key_t key, map_val_t val, bool force);
+
+/*
+ * Insert a new key/value pair with a TTL of its own, as put_ttl() would.
+ *
+ * @param self The sharded map to use
+ * @param key The key to insert
+ * @param val The value to insert
+ * @param ttl The milliseconds until the pair expires, or 0 if it never does.
+ * @param force Whether or not an entry should be evicted if the shard is full.
+ * @return true if the insertion was sucessful, false otherwise.
+ */
+bool sharded_put_ttl(sharded_map_t *self, map_key_t key, map_val_t val, uint32_t ttl, bool force);
+
+/*
+ * Set the TTL of the pairs sharded_put() and sharded_put_batch() insert from now on.
+ *
+ * @param self The sharded map to use
+ * @param ttl The milliseconds until those pairs expire, or 0 if they never do.
+ */
+void sharded_set_default_ttl(sharded_map_t *self, uint32_t ttl);
+
+/*
+ * Insert many key/value pairs, taking the write lock of each shard once.
+ * The pairs are reordered so that the ones that were inserted come first.
+ *
+ * @param self The sharded map to use
+ * @param keys The keys to insert
+ * @param vals The values to insert, in the same order as the keys.
+ * @param num_pairs The number of pairs to insert.
+ * @param force Whether or not entries should be evicted if a shard is full.
+ * @return The number of pairs that were inserted.
+ */
+size_t sharded_put_batch(sharded_map_t *self, map_key_t *keys, map_val_t *vals, size_t num_pairs, bool force);
+
+/*
+ * Retrieve the value associated with a key.
+ *
+ * @param self The sharded map to use
+ * @param key The key to search for
+ * @return The corresponding value, or a map_val_t instance with a null
+ *         pointer and a value length of 0 if the key is not found.
+ */
+map_val_t sharded_get(sharded_map_t *self, map_key_t key);
+
+/*
+ * Retrieve the value associated with a key and take a reference on it,
+ * as get_ref() would. Release it with release_ref().
+ *
+ * @param self The sharded map to use
+ * @param key The key to search for
+ * @return The corresponding value and its reference, or a map_ref_t with a
+ *         null value pointer and a null entry if the key is not found.
+ */
+map_ref_t sharded_get_ref(sharded_map_t *self, map_key_t key);
+
+/*
+ * Retrieve the values associated with many keys under a single read
+ * acquisition of each shard they belong to.
+ *
+ * @param self The sharded map to use
+ * @param keys The keys to search for
+ * @param vals Filled with the value of each key, or a map_val_t instance
+ *             with a null pointer and a value length of 0 if it is not found.
+ * @param num_keys The number of keys to search for.
+ * @return The number of keys that were found.
+ */
+size_t sharded_get_batch(sharded_map_t *self, map_key_t *keys, map_val_t *vals, size_t num_keys);
+
+/*
+ * Remove the entry associated with a key.
+ *
+ * @param self The sharded map to use
+ * @param key The key to remove.
+ * @return The removed map_node_t instance.
+ */
+map_node_t sharded_delete(sharded_map_t *self, map_key_t key);
+
+/*
+ * Clears and destroys all entries in every shard.
+ *
+ * @param self The sharded map to clear.
+ * @return true if the operation was successful, false otherwise
+ */
+bool clear_sharded_map(sharded_map_t *self);
+
+/*
+ * Limit the memory the pairs take up, as set_memory_limit() would. Every
+ * shard gets an equal share and evicts within it.
+ *
+ * @param self The sharded map to use
+ * @param max_bytes The most bytes the pairs may be charged, or 0 for no limit.
+ * @param size_function What a pair takes up, or NULL to charge the lengths of its key and value.
+ */
+void sharded_set_memory_limit(sharded_map_t *self, uint64_t max_bytes, size_func_f size_function);
+
+/*
+ * Hand every shard to one thread for good, as set_single_owner() would.
+ *
+ * @param self The sharded map to use
+ */
+void sharded_set_single_owner(sharded_map_t *self);
+
+/*
+ * Place the shards on NUMA nodes, as set_numa_node() would, going round the nodes given.
+ *
+ * @param self The sharded map to use
+ * @param nodes The node of every shard in turn.
+ * @param num_nodes The number of nodes given.
+ */
+void sharded_set_numa_nodes(sharded_map_t *self, const int *nodes, uint32_t num_nodes);
+
+/*
+ * Remove the expired entries of every shard.
+ *
+ * @param self The sharded map to expire.
+ * @return The number of entries that were removed.
+ */
+size_t sharded_expire(sharded_map_t *self);
+
+/*
+ * Measure the probe lengths of the keys in every shard.
+ *
+ * @param self The sharded map to measure.
+ * @return The probe lengths of all keys, as map_probe_stats() reports them.
+ */
+probe_stats_t sharded_probe_stats(sharded_map_t *self);
+
+/*
+ * Invalidate every shard and free the map.
+ *
+ * @param self The sharded map to invalidate.
+ * @return true if the operation was successful.
+ */
+bool invalidate_sharded_map(sharded_map_t *self);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A slab allocator for the keys and values the server stores. Memory is taken
+ * from the system in SLAB_PAGE_SIZE pages, cut out of huge pages when those
+ * are enabled, and every page is cut into chunks of a single size class. A
+ * freed chunk is only reused for its own class, so long-running churn of
+ * mixed sizes can't fragment the heap. Once none of a page's chunks is in
+ * use, the page is free for any class to take, so the pages of a size that
+ * went out of use serve the sizes stored now. Every class keeps one empty
+ * page for itself, and a few more empty pages stay resident in between.
+ *
+ * A thread that owns its data can have a cache of size classes to itself,
+ * which it allocates from without locks. Such threads only meet the others
+ * when a class takes or gives up a whole page.
+ */
+
+typedef struct slab_cache_t slab_cache_t;
+
+/* Pages are aligned to their size, so a chunk finds its page by masking its address */
+#define SLAB_PAGE_SIZE (1u << 20)
+
+/* The smallest chunk, and the factor between neighbouring size classes in percent */
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH_PERCENT 125
+
+/*
+ * Allocates a chunk from the smallest size class that fits.
+ *
+ * @param size The number of bytes needed.
+ * @return The chunk, or NULL if size is larger than the largest class or no page could be allocated.
+ */
+void *slab_alloc(size_t size);
+
+/*
+ * Returns a chunk to its size class. A chunk from a thread's own cache must
+ * be freed by that thread, or once it stopped allocating.
+ *
+ * @param ptr A chunk returned by slab_alloc(), or NULL.
+ */
+void slab_free(void *ptr);
+
+/*
+ * Creates size classes for the calling thread alone, which it uses without locks.
+ *
+ * @return The cache, or NULL if it could not be allocated.
+ */
+slab_cache_t *slab_create_cache(void);
+
+/*
+ * Makes slab_alloc() on the calling thread allocate from cache.
+ *
+ * @param cache A cache from slab_create_cache(), or NULL for the classes all threads share.
+ */
+void slab_use_cache(slab_cache_t *cache);
+
+/*
+ * @param ptr A chunk returned by slab_alloc().
+ * @return The size of the chunk, which is how much memory it takes up.
+ */
+size_t slab_size(void *ptr);
+
+/*
+ * @return The largest size slab_alloc() can serve.
+ */
+size_t slab_max_size(void);
+
+/*
+ * @return The bytes of the pages the size classes hold, which are the pages with
+ *         chunks in use and at most one empty page per class. Pages given up by
+ *         their class aren't counted, and beyond the few the pool keeps resident
+ *         their memory goes back to the system, unless it is part of a huge page.
+ */
+uint64_t slab_footprint(void);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Where threads run and where memory lives. Workers can be pinned to CPUs,
+ * and memory can be bound to the NUMA node of the CPU that uses it, so that
+ * on a host with several sockets a worker's loads stay on its own socket.
+ * Everything degrades to the kernel's default placement when the host has
+ * no NUMA information.
+ */
+
+/* The most CPUs a list may name, and the highest NUMA node memory can be bound to */
+#define MAX_CPUS 1024
+#define MAX_NUMA_NODES 64
+
+/*
+ * Parses a list of CPUs such as "0-3,8,10-11".
+ *
+ * @param list The list, of single CPUs and inclusive ranges separated by commas.
+ * @param cpus Filled with the CPUs in the order they are listed.
+ * @param max_cpus The most CPUs cpus can hold.
+ * @return The number of CPUs, or -1 with errno set to EINVAL if the list is malformed or too long.
+ */
+int parse_cpu_list(const char *list, int *cpus, int max_cpus);
+
+/*
+ * @param cpu A CPU number.
+ * @return Whether the process may run on the CPU.
+ */
+bool cpu_allowed(int cpu);
+
+/*
+ * @param cpu A CPU number.
+ * @return The NUMA node the CPU belongs to, or -1 if the kernel doesn't say.
+ */
+int cpu_node(int cpu);
+
+/*
+ * @return The number of NUMA nodes of the host, at least 1.
+ */
+int num_numa_nodes(void);
+
+/*
+ * Starts a thread that only ever runs on one CPU, from its first instruction on.
+ *
+ * @param thread Set to the new thread.
+ * @param cpu The CPU to run on, or -1 to let the scheduler place the thread.
+ * @param start_routine The function the thread runs.
+ * @param arg The argument to start_routine.
+ * @return 0, or the error number pthread_create(3) returned.
+ */
+int create_pinned_thread(pthread_t *thread, int cpu, void *(*start_routine)(void *), void *arg);
+
+/*
+ * Makes the pages of a range that haven't been touched yet come from a NUMA node.
+ *
+ * @param addr The start of the range, aligned to a page.
+ * @param length The length of the range.
+ * @param node The node the pages should come from.
+ * @return true if the kernel accepted the policy, false with errno set otherwise.
+ */
+bool bind_memory(void *addr, size_t length, int node);
+
+#endif
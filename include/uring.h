@@ -0,0 +1,21 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include "server.h"
+
+/*
+ * Serves clients from NUM_WORKERS io_uring completion loops that share the
+ * listening sockets. Each loop batches its accept, receive and send
+ * submissions into a single io_uring_enter(2) call and receives into
+ * registered buffers.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @param listenfds The listening sockets to accept connections from.
+ * @param num_listeners The number of listening sockets.
+ * @return false without serving anything if the kernel does not support
+ *         io_uring, otherwise it never returns.
+ */
+bool run_uring(args_struct *args, int *listenfds, int num_listeners);
+
+#endif
@@ -6,8 +6,14 @@
 #define MAP_KEY(base, len) (map_key_t) {.key_base = base, .key_len = len}
 #define MAP_VAL(base, len) (map_val_t) {.val_base = base, .val_len = len}
 #define MAP_NODE(key_arg, val_arg, tombstone_arg) (map_node_t) {.key = key_arg, .val = val_arg, .tombstone = tombstone_arg}
+#define MAP_REF(val_arg, entry_arg) (map_ref_t) {.val = val_arg, .entry = entry_arg}
 
 uint32_t jenkins_one_at_a_time_hash(map_key_t map_key);
+uint32_t wyhash_hash(map_key_t map_key);
+uint32_t siphash_hash(map_key_t map_key);
+hash_func_f hash_function_by_name(const char *name);
+void seed_hash_functions(uint64_t k0, uint64_t k1);
+void random_seed_hash_functions(void);
 int get_index(hashmap_t *self, map_key_t key);
 
 #endif
@@ -0,0 +1,126 @@
+#include "arena.h"
+#include "debug.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Every allocation is rounded up to keep the next one aligned */
+#define ARENA_ALIGN 16
+
+/* An allocation that didn't fit the block is preceded by the link to the previous one */
+typedef struct arena_overflow_t {
+    struct arena_overflow_t *next;
+    char pad[ARENA_ALIGN - sizeof(void *)];
+} arena_overflow_t;
+
+static size_t align_size(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+/*
+ * Frees every allocation that didn't fit the block.
+ */
+static void free_overflow(arena_t *arena) {
+    while (arena->overflow != NULL) {
+        arena_overflow_t *next = ((arena_overflow_t *) arena->overflow)->next;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+    arena->overflow_bytes = 0;
+}
+
+/*
+ * Replaces the block of an arena that has nothing allocated with one of at least size bytes.
+ *
+ * @return false if malloc(3) failed, in which case the arena has no block.
+ */
+static bool resize_block(arena_t *arena, size_t size) {
+    size_t capacity = ARENA_BLOCK_SIZE;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    free(arena->block);
+    arena->block = malloc(capacity);
+    arena->capacity = arena->block != NULL ? capacity : 0;
+    arena->used = 0;
+    debug("arena block of %zu bytes", arena->capacity);
+    return arena->block != NULL;
+}
+
+/*
+ * This function initializes an arena without any memory. The block is only
+ * malloc(3)ed by the first arena_alloc(), so idle connections cost nothing.
+ *
+ * @param arena A pointer to the arena.
+ */
+void arena_init(arena_t *arena) {
+    arena->block = NULL;
+    arena->used = 0;
+    arena->capacity = 0;
+    arena->overflow = NULL;
+    arena->overflow_bytes = 0;
+}
+
+/*
+ * This function bumps size bytes out of the arena's block. An empty arena
+ * replaces a block that is too small, anything else that doesn't fit is
+ * malloc(3)ed on its own until the next reset.
+ *
+ * @param arena A pointer to the arena.
+ * @param size The number of bytes needed.
+ *
+ * @return A pointer to the memory, or NULL.
+ *
+ * Error case: If malloc(3) is unsuccessful, return NULL.
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = align_size(size == 0 ? 1 : size);
+
+    if (arena->capacity - arena->used < size && arena->used == 0 && arena->overflow == NULL &&
+        size <= ARENA_MAX_BLOCK_SIZE) {
+        resize_block(arena, size);
+    }
+    if (arena->block != NULL && arena->capacity - arena->used >= size) {
+        void *ptr = arena->block + arena->used;
+        arena->used += size;
+        return ptr;
+    }
+
+    arena_overflow_t *overflow = malloc(sizeof(arena_overflow_t) + size);
+    if (overflow == NULL) {
+        return NULL;
+    }
+    overflow->next = arena->overflow;
+    arena->overflow = overflow;
+    arena->overflow_bytes += size;
+    return overflow + 1;
+}
+
+/*
+ * This function frees the allocations that didn't fit the block and grows the
+ * block to what the request needed in total, up to ARENA_MAX_BLOCK_SIZE, so the
+ * next request like it is served from the block alone.
+ *
+ * @param arena A pointer to the arena.
+ */
+void arena_reset(arena_t *arena) {
+    size_t needed = arena->used + arena->overflow_bytes;
+    free_overflow(arena);
+    arena->used = 0;
+
+    if (needed > arena->capacity && needed <= ARENA_MAX_BLOCK_SIZE) {
+        resize_block(arena, needed);
+    }
+}
+
+/*
+ * This function will free(3) the block and every allocation of the arena,
+ * leaving it empty but still usable.
+ *
+ * @param arena A pointer to the arena.
+ */
+void arena_destroy(arena_t *arena) {
+    free_overflow(arena);
+    free(arena->block);
+    arena_init(arena);
+}
@@ -0,0 +1,268 @@
+#include "connection.h"
+#include "server.h"
+#include "debug.h"
+
+#include <string.h>
+
+/*
+ * This function will calloc(3) a new conn_t instance with empty buffers and an empty arena.
+ *
+ * @param fd The socket connected to the client.
+ *
+ * @return A valid pointer to a conn_t instance, or NULL.
+ *
+ * Error case: If calloc(3) or malloc(3) is unsuccessful, return NULL.
+ */
+conn_t *create_conn(int fd) {
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->in = malloc(CONN_BUFFER_SIZE);
+    conn->out = malloc(CONN_BUFFER_SIZE);
+    if (conn->in == NULL || conn->out == NULL) {
+        free(conn->in);
+        free(conn->out);
+        free(conn);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->state = READ_HEADER;
+    conn->in_cap = CONN_BUFFER_SIZE;
+    conn->out_cap = CONN_BUFFER_SIZE;
+    arena_init(&conn->arena);
+    return conn;
+}
+
+/*
+ * Frees the buffers and arena of a connection and the connection itself.
+ *
+ * @param conn A pointer to the connection.
+ */
+void destroy_conn(conn_t *conn) {
+    if (conn == NULL) {
+        return;
+    }
+    free(conn->in);
+    free(conn->out);
+    arena_destroy(&conn->arena);
+    free(conn);
+}
+
+/*
+ * Compacts or grows the input buffer so that the frame currently being
+ * parsed fits in it, and returns how many bytes can be received.
+ *
+ * @param conn A pointer to the connection.
+ *
+ * @return The free space after conn->in_end, or 0 if the buffer could not grow.
+ */
+size_t conn_input_space(conn_t *conn) {
+    size_t needed = conn->state == READ_BODY ? conn->body_size : sizeof(request_header_t);
+
+    // slide the unparsed bytes to the front before growing the buffer
+    if (conn->in_start > 0 && (conn->in_end == conn->in_cap || conn->in_cap - conn->in_start < needed)) {
+        memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+        conn->in_end -= conn->in_start;
+        conn->in_start = 0;
+    }
+
+    if (conn->in_cap < needed) {
+        char *in = realloc(conn->in, needed);
+        if (in == NULL) {
+            return 0;
+        }
+        conn->in = in;
+        conn->in_cap = needed;
+    }
+
+    return conn->in_cap - conn->in_end;
+}
+
+/*
+ * Appends a response header and its value to the output buffer.
+ *
+ * @return true if the response was queued, false if the buffer could not grow.
+ */
+static bool queue_response(conn_t *conn, response_header_t *response_header, map_val_t map_value) {
+    size_t length = sizeof(response_header_t) + (map_value.val_base != NULL ? map_value.val_len : 0);
+
+    if (conn->out_cap - conn->out_end < length) {
+        size_t capacity = conn->out_cap;
+        while (capacity - conn->out_end < length) {
+            capacity *= 2;
+        }
+        char *out = realloc(conn->out, capacity);
+        if (out == NULL) {
+            return false;
+        }
+        conn->out = out;
+        conn->out_cap = capacity;
+    }
+
+    memcpy(conn->out + conn->out_end, response_header, sizeof(response_header_t));
+    conn->out_end += sizeof(response_header_t);
+    if (map_value.val_base != NULL && map_value.val_len != 0) {
+        memcpy(conn->out + conn->out_end, map_value.val_base, map_value.val_len);
+        conn->out_end += map_value.val_len;
+    }
+    return true;
+}
+
+/*
+ * Fulfills the request whose body starts at the front of the input buffer.
+ */
+static bool execute_body(conn_t *conn, char *body) {
+    request_header_t request_header = conn->request_header;
+    response_header_t response_header = {0, 0};
+    void *value = NULL;
+
+    // a PUT copies what the map keeps, so its key and value are read right out of the input buffer
+    if (request_header.request_code == PUT || request_header.request_code == PUT_TTL) {
+        value = body + request_header.key_size;
+    }
+
+    map_ref_t map_value = execute_request(request_header, body, value, &conn->arena, &response_header);
+
+    // small values are copied next to the other pipelined responses, which lets the reference go right away
+    bool queued = queue_response(conn, &response_header, map_value.val);
+    release_ref(map_value);
+    arena_reset(&conn->arena);
+    return queued;
+}
+
+/*
+ * Runs the request state machine over data[*start, end), advancing *start
+ * past every frame it consumed.
+ */
+static bool process_frames(conn_t *conn, char *data, size_t *start, size_t end) {
+    while (!conn->closing) {
+        size_t available = end - *start;
+
+        if (conn->state == READ_HEADER) {
+            if (available < sizeof(request_header_t)) {
+                break;
+            }
+            memcpy(&conn->request_header, data + *start, sizeof(request_header_t));
+            *start += sizeof(request_header_t);
+
+            response_header_t response_header = {0, 0};
+            if (!frame_request(conn->request_header, &response_header, &conn->body_size)) {
+                // the body of a bad or unknown request can't be skipped reliably, so answer and hang up
+                conn->closing = true;
+                return queue_response(conn, &response_header, MAP_VAL(NULL, 0));
+            }
+            conn->state = READ_BODY;
+        } else {
+            if (available < conn->body_size) {
+                break;
+            }
+            if (!execute_body(conn, data + *start)) {
+                return false;
+            }
+            *start += conn->body_size;
+            conn->state = READ_HEADER;
+        }
+    }
+    return true;
+}
+
+/*
+ * Runs the request state machine over the bytes in the input buffer.
+ *
+ * @param conn A pointer to the connection.
+ *
+ * @return false if a response could not be queued, true otherwise.
+ */
+bool conn_process(conn_t *conn) {
+    if (!process_frames(conn, conn->in, &conn->in_start, conn->in_end)) {
+        return false;
+    }
+
+    if (conn->in_start == conn->in_end) {
+        conn->in_start = 0;
+        conn->in_end = 0;
+    }
+    return true;
+}
+
+/*
+ * Runs the request state machine over bytes received outside of the input
+ * buffer. Complete frames are parsed where they are, only a trailing
+ * partial frame is copied into the input buffer.
+ *
+ * @param conn A pointer to the connection.
+ * @param data The received bytes.
+ * @param length The number of received bytes.
+ *
+ * @return false if the input buffer could not grow or a response could not be queued.
+ */
+bool conn_feed(conn_t *conn, char *data, size_t length) {
+    size_t start = 0;
+
+    if (conn->in_start == conn->in_end && !process_frames(conn, data, &start, length)) {
+        return false;
+    }
+
+    while (start < length && !conn->closing) {
+        size_t space = conn_input_space(conn);
+        if (space == 0) {
+            return false;
+        }
+        if (space > length - start) {
+            space = length - start;
+        }
+        memcpy(conn->in + conn->in_end, data + start, space);
+        conn->in_end += space;
+        start += space;
+        if (!conn_process(conn)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t conn_pending_output(conn_t *conn) {
+    return conn->out_end - conn->out_start;
+}
+
+void conn_consume_output(conn_t *conn, size_t sent) {
+    conn->out_start += sent;
+    if (conn->out_start == conn->out_end) {
+        conn->out_start = 0;
+        conn->out_end = 0;
+    }
+}
+
+void touch_conn(conn_list_t *list, conn_t *conn) {
+    conn->last_active = time(NULL);
+    if (list->tail == conn) {
+        return;
+    }
+    if (conn->prev != NULL || list->head == conn) {
+        unlink_conn(list, conn);
+    }
+    conn->prev = list->tail;
+    conn->next = NULL;
+    if (list->tail != NULL) {
+        list->tail->next = conn;
+    } else {
+        list->head = conn;
+    }
+    list->tail = conn;
+}
+
+void unlink_conn(conn_list_t *list, conn_t *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        list->head = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    } else {
+        list->tail = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+}
@@ -0,0 +1,127 @@
+#include "epoch.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * What one thread announces to writers. Each record sits on its own cache
+ * line so that entering and leaving a read section never invalidates a
+ * line another thread is using.
+ */
+typedef struct epoch_record_t {
+    /* (epoch << 1) | 1 while reading, 0 otherwise */
+    uint64_t state;
+    bool in_use;
+    struct epoch_record_t *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) epoch_record_t;
+
+static uint64_t global_epoch __attribute__((aligned(CACHE_LINE_SIZE))) = 1;
+static epoch_record_t *records;
+
+static __thread epoch_record_t *local_record;
+static __thread unsigned local_nesting;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Hands the record of an exiting thread to the next thread that registers.
+ */
+static void release_record(void *record) {
+    __atomic_store_n(&((epoch_record_t *) record)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void create_record_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+/*
+ * Finds the calling thread a record, reusing one left by an exited thread
+ * before pushing a new one. Records are never freed, so writers can walk
+ * the list without a lock.
+ */
+static epoch_record_t *register_thread(void) {
+    pthread_once(&record_key_once, create_record_key);
+
+    epoch_record_t *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; record != NULL; record = record->next) {
+        bool expected = false;
+        if (!__atomic_load_n(&record->in_use, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&record->in_use, &expected, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (record == NULL) {
+        record = aligned_alloc(CACHE_LINE_SIZE, sizeof(epoch_record_t));
+        if (record == NULL) {
+            debug("Could not allocate an epoch record");
+            abort();
+        }
+        record->state = 0;
+        record->in_use = true;
+        record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &record->next, record, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(record_key, record);
+    return record;
+}
+
+void epoch_enter(void) {
+    if (local_nesting++ > 0) {
+        return;
+    }
+    if (local_record == NULL) {
+        local_record = register_thread();
+    }
+    // the announcement must be visible before any shared node is loaded
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&local_record->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    if (--local_nesting > 0) {
+        return;
+    }
+    __atomic_store_n(&local_record->state, 0, __ATOMIC_RELEASE);
+}
+
+uint64_t epoch_retire_tag(void) {
+    // order the unlink before reading the epoch, readers that see a later epoch can't find the node
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+}
+
+/*
+ * Moves the global epoch forward by one if every active reader entered
+ * during the current epoch.
+ *
+ * @return The global epoch after the attempt.
+ */
+static uint64_t try_advance(void) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (epoch_record_t *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record != NULL; record = record->next) {
+        uint64_t state = __atomic_load_n(&record->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch) {
+            return epoch;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * A node retired in epoch t may still be seen by readers that entered in
+ * epoch t. Once the epoch reached t + 2 every one of them has left.
+ */
+bool epoch_reclaimable(uint64_t tag) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    if (epoch >= tag + 2) {
+        return true;
+    }
+    return try_advance() >= tag + 2;
+}
@@ -1,156 +1,1402 @@
 #include "utils.h"
+#include "epoch.h"
 #include "errno.h"
 #include "debug.h"
+#include "topology.h"
+#include <sched.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include "csapp.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define MAP_KEY(base, len) (map_key_t) {.key_base = base, .key_len = len}
 #define MAP_VAL(base, len) (map_val_t) {.val_base = base, .val_len = len}
 #define MAP_NODE(key_arg, val_arg, tombstone_arg) (map_node_t) {.key = key_arg, .val = val_arg, .tombstone = tombstone_arg}
+#define MAP_REF(val_arg, entry_arg) (map_ref_t) {.val = val_arg, .entry = entry_arg}
+
+/* Retired pairs are first checked for reclamation once this many have piled up */
+#define RETIRED_BATCH 64
+
+/* Control bytes. A full slot holds the 7-bit tag of its key's hash, so the top bit marks free slots */
+#define CTRL_EMPTY ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+
+/* A new map starts with this many groups and doubles from there */
+#define INITIAL_GROUPS 1
+
+/* Largest table a map may grow to, so slot indices fit in 31 bits */
+#define MAX_GROUPS (1u << 26)
+
+/* Slots of the previous table moved on every write while the map grows */
+#define MIGRATE_SLOTS (2 * MAP_GROUP_SIZE)
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+/* Slots are allocated on cache line boundaries so that each one fills exactly one line */
+#define CACHE_LINE_SIZE 64
+
+_Static_assert(sizeof(map_slot_t) == CACHE_LINE_SIZE, "map_slot_t must fill one cache line");
+
+/* Bit i is set when slot i of a group matches */
+typedef uint32_t group_mask_t;
+
+typedef enum lookup_results { LOOKUP_MISSING, LOOKUP_FOUND, LOOKUP_RETRY } lookup_results;
+
+static size_t page_round(size_t size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+/*
+ * Allocates memory for a table. Memory for a node is mapped with mmap(2)
+ * rather than taken from the heap, whose pages may have been faulted in on
+ * another node already, and is bound to the node before it is first touched.
+ *
+ * @param node The NUMA node to place the memory on, or -1 to leave it to the kernel.
+ */
+static void *alloc_table_memory(size_t alignment, size_t size, int node) {
+    if (node < 0) {
+        return aligned_alloc(alignment, size);
+    }
+    size = page_round(size);
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    // the table works wherever its pages end up, so a failed bind only costs locality
+    bind_memory(memory, size, node);
+    return memory;
+}
+
+/*
+ * Frees memory from alloc_table_memory().
+ *
+ * @param mapped Whether the memory was allocated for a node.
+ */
+static void free_table_memory(void *memory, size_t size, bool mapped) {
+    if (!mapped) {
+        free(memory);
+    } else if (memory != NULL) {
+        munmap(memory, page_round(size));
+    }
+}
+
+/*
+ * Allocates the slots of a table. Slots that fill a huge page or more are
+ * mapped on huge pages when those are enabled, since probes land anywhere in
+ * them. Mapped slots are zeroed by the kernel and nothing has touched them yet.
+ * When no huge page mapping can be had, the slots are allocated like smaller ones.
+ *
+ * @param node The NUMA node to place the slots on, or -1 to leave it to the kernel.
+ */
+static void alloc_slots(map_table_t *table, size_t size, int node) {
+    table->huge = huge_pages_enabled() && size >= HUGE_PAGE_SIZE;
+    if (table->huge) {
+        table->slots = huge_alloc(size, &table->slot_pages);
+        if (table->slots != NULL) {
+            if (node >= 0) {
+                bind_memory(table->slots, size, node);
+            }
+            return;
+        }
+        debug("no huge page mapping for %zu bytes of slots", size);
+        table->huge = false;
+    }
+    table->slots = alloc_table_memory(CACHE_LINE_SIZE, size, node);
+    // memory mapped for a node comes zeroed
+    if (table->slots != NULL && node < 0) {
+        memset(table->slots, 0, size);
+    }
+}
+
+static void free_slots(map_table_t *table) {
+    size_t size = (size_t) table->num_groups * MAP_GROUP_SIZE * sizeof(map_slot_t);
+    if (table->huge) {
+        huge_free(table->slots, size, table->slot_pages);
+    } else {
+        free_table_memory(table->slots, size, table->mapped);
+    }
+}
+
+/*
+ * Allocates a table with every slot empty.
+ *
+ * @param node The NUMA node to place the slots on, or -1 to leave it to the kernel.
+ * @returns The table, or NULL if an allocation failed.
+ */
+static map_table_t *create_table(uint32_t num_groups, int node) {
+    map_table_t *table = malloc(sizeof(map_table_t));
+    if (table == NULL) {
+        return NULL;
+    }
+    size_t slots = (size_t) num_groups * MAP_GROUP_SIZE;
+    table->num_groups = num_groups;
+    table->mapped = node >= 0;
+    alloc_slots(table, slots * sizeof(map_slot_t), node);
+    // groups are loaded with aligned vector loads
+    table->ctrl = alloc_table_memory(MAP_GROUP_SIZE, slots, node);
+    if (table->slots == NULL || table->ctrl == NULL) {
+        free_slots(table);
+        free_table_memory(table->ctrl, slots, table->mapped);
+        free(table);
+        return NULL;
+    }
+    memset(table->ctrl, CTRL_EMPTY, slots);
+    return table;
+}
+
+static void free_table(map_table_t *table) {
+    free_slots(table);
+    free_table_memory(table->ctrl, (size_t) table->num_groups * MAP_GROUP_SIZE, table->mapped);
+    free(table);
+}
+
+/*
+ * This function will calloc(3) a new instance of hashmap_t
+ *      that manages a table of map_slot_t instances, grouped behind
+ *      control bytes, that grows until it has room for capacity of them
+ *
+ * @param capacity The maximum number of items that the map can hold.
+ * @param hash_function The hash function that the map uses to hash keys.
+ * @param destroy_function The destroyer function that the map uses to free keys and values when it is destroyed.
+ *
+ * @returns A valid pointer to a hashmap_t instance, or NULL.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return NULL.
+ * Error case: If calloc(3) is unsuccessful or any of the locks cannot be initialized, return NULL.
+ */
+hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
+    return create_probing_map(capacity, hash_function, destroy_function, GROUP_PROBING);
+}
+
+/*
+ * Like create_map, but keys are placed with the given probing mode.
+ *
+ * @param probing GROUP_PROBING or ROBIN_HOOD_PROBING.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return NULL.
+ */
+hashmap_t *create_probing_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function, probe_modes probing) {
+    if(hash_function == NULL || destroy_function == NULL || capacity == 0 ||
+        (probing != GROUP_PROBING && probing != ROBIN_HOOD_PROBING)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // leave an eighth of the slots free so that probes for missing keys end early
+    uint64_t slots = ((uint64_t) capacity * 8 + 6) / 7;
+    uint64_t max_groups = 1;
+    while (max_groups * MAP_GROUP_SIZE < slots) {
+        max_groups *= 2;
+    }
+    if (max_groups > MAX_GROUPS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // create hashmap and check if calloc failed
+    struct hashmap_t *hashmap = (struct hashmap_t*) calloc(1, sizeof(hashmap_t));
+    if(hashmap == NULL) {
+        return NULL;
+    }
+    hashmap->capacity = capacity;
+    hashmap->hash_function = hash_function;
+    hashmap->destroy_function = destroy_function;
+    hashmap->probing = probing;
+    hashmap->max_groups = max_groups;
+    hashmap->numa_node = -1;
+    hashmap->table = create_table(max_groups < INITIAL_GROUPS ? max_groups : INITIAL_GROUPS, hashmap->numa_node);
+    if (hashmap->table == NULL) {
+        free(hashmap);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&hashmap->write_lock, NULL) != 0) {
+        free_table(hashmap->table);
+        free(hashmap);
+        return NULL;
+    }
+
+    return hashmap;
+}
+
+/*
+ * The hash picks the group a probe starts at with its high bits and the tag
+ * stored in the control byte with its low 7 bits.
+ */
+static uint32_t hash_group(map_table_t *table, uint32_t hash) {
+    return (hash >> 7) & (table->num_groups - 1);
+}
+
+static uint8_t hash_tag(uint32_t hash) {
+    return hash & 0x7F;
+}
+
+static uint32_t next_group(map_table_t *table, uint32_t group) {
+    return (group + 1) & (table->num_groups - 1);
+}
+
+/*
+ * Robin Hood probing walks single slots from the home slot instead of groups.
+ */
+static uint32_t num_slots(map_table_t *table) {
+    return table->num_groups * MAP_GROUP_SIZE;
+}
+
+static uint32_t home_slot(map_table_t *table, uint32_t hash) {
+    return (hash >> 7) & (num_slots(table) - 1);
+}
+
+static uint32_t next_slot(map_table_t *table, uint32_t slot) {
+    return (slot + 1) & (num_slots(table) - 1);
+}
+
+/*
+ * @returns How many slots past its home slot a key with hash sits at slot.
+ */
+static uint32_t probe_distance(map_table_t *table, uint32_t hash, uint32_t slot) {
+    return (slot - home_slot(table, hash)) & (num_slots(table) - 1);
+}
+
+/*
+ * @returns The slots of the group whose control byte equals byte.
+ */
+static group_mask_t match_byte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *) group);
+    return (group_mask_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte)));
+#else
+    group_mask_t mask = 0;
+    for (int i = 0; i < MAP_GROUP_SIZE; i++) {
+        if (group[i] == byte) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+/*
+ * @returns The slots of the group that are empty or deleted.
+ */
+static group_mask_t match_free(const uint8_t *group) {
+#ifdef __SSE2__
+    return (group_mask_t) _mm_movemask_epi8(_mm_load_si128((const __m128i *) group));
+#else
+    group_mask_t mask = 0;
+    for (int i = 0; i < MAP_GROUP_SIZE; i++) {
+        if (group[i] & 0x80) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+/*
+ * Takes the write lock, unless a single thread owns the map and nobody else can write.
+ */
+static void lock_map(hashmap_t *self) {
+    if (!self->single_owner) {
+        pthread_mutex_lock(&self->write_lock);
+    }
+}
+
+static void unlock_map(hashmap_t *self) {
+    if (!self->single_owner) {
+        pthread_mutex_unlock(&self->write_lock);
+    }
+}
+
+/*
+ * Readers of a shared map stay in an epoch while they probe, so what they see
+ * isn't freed under them. The owner of a single-owner map never frees while
+ * it reads, so it skips the epoch and the global state behind it.
+ */
+static void read_enter(hashmap_t *self) {
+    if (!self->single_owner) {
+        epoch_enter();
+    }
+}
+
+static void read_exit(hashmap_t *self) {
+    if (!self->single_owner) {
+        epoch_exit();
+    }
+}
+
+/*
+ * Makes readers that overlap the following node stores retry. The caller must hold the write lock.
+ * Sections may nest, only the outermost one moves the sequence number. The
+ * owner of a single-owner map never reads while it writes, so its sequence never moves.
+ */
+static void write_begin(hashmap_t *self) {
+    if (self->single_owner || self->write_depth++ > 0) {
+        return;
+    }
+    __atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(hashmap_t *self) {
+    if (self->single_owner || --self->write_depth > 0) {
+        return;
+    }
+    __atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Builds the slot for a pair, copying the key into it when it is short enough.
+ */
+static map_slot_t make_slot(map_key_t key, map_val_t val, uint32_t hash, map_entry_t *entry) {
+    map_slot_t node = {.hash = hash, .key_len = key.key_len, .entry = entry, .val = val};
+    if (key.key_len <= MAP_INLINE_KEY_SIZE) {
+        memcpy(node.key_inline, key.key_base, key.key_len);
+    }
+    return node;
+}
+
+/*
+ * @returns true if node holds key. A long key is compared through the entry,
+ *          which a reader's epoch keeps alive.
+ */
+static bool slot_matches(const map_slot_t *node, map_key_t key, uint32_t hash) {
+    if (node->entry == NULL || node->hash != hash || node->key_len != key.key_len) {
+        return false;
+    }
+    const void *stored = key.key_len <= MAP_INLINE_KEY_SIZE ? node->key_inline : node->entry->key.key_base;
+    return memcmp(key.key_base, stored, key.key_len) == 0;
+}
+
+/*
+ * Overwrites a slot and its control byte. The caller must hold the write lock
+ * and be between write_begin and write_end.
+ */
+static void set_node(map_table_t *table, uint32_t slot, uint8_t ctrl, map_slot_t node) {
+    map_slot_t *myMapNode = &table->slots[slot];
+    __atomic_store_n(&table->ctrl[slot], ctrl, __ATOMIC_RELAXED);
+    __atomic_store_n(&myMapNode->hash, node.hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&myMapNode->key_len, node.key_len, __ATOMIC_RELAXED);
+    __atomic_store_n(&myMapNode->entry, node.entry, __ATOMIC_RELAXED);
+    __atomic_store_n(&myMapNode->val.val_base, node.val.val_base, __ATOMIC_RELAXED);
+    __atomic_store_n(&myMapNode->val.val_len, node.val.val_len, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < MAP_INLINE_KEY_SIZE / sizeof(uint64_t); i++) {
+        __atomic_store_n(&myMapNode->key_words[i], node.key_words[i], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Overwrites a slot and its control byte in a way lock-free readers notice. The caller must hold the write lock.
+ */
+static void store_node(hashmap_t *self, map_table_t *table, uint32_t slot, uint8_t ctrl, map_slot_t node) {
+    write_begin(self);
+    set_node(table, slot, ctrl, node);
+    write_end(self);
+}
+
+/*
+ * Drops one reference to an entry, destroying its pair when it was the last one.
+ */
+static void release_entry(map_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        entry->destroy_function(entry->key, entry->val);
+        free(entry);
+    }
+}
+
+/*
+ * Drops the map's reference to the oldest retired entries that no reader
+ * can see anymore. The caller must hold the write lock.
+ */
+static void reclaim_nodes(hashmap_t *self) {
+    size_t i = 0;
+    // entries are retired in epoch order, so the reclaimable ones form a prefix
+    while (i < self->num_retired && epoch_reclaimable(self->retired[i].epoch)) {
+        release_entry(self->retired[i].entry);
+        i++;
+    }
+    if (i == 0) {
+        // nothing was reclaimed, and nothing may have been retired yet either
+        return;
+    }
+    memmove(self->retired, self->retired + i, (self->num_retired - i) * sizeof(retired_node_t));
+    self->num_retired -= i;
+}
+
+/*
+ * @returns The time TTLs are measured against, from a clock that is cheap
+ *          enough to read on every lookup of an expiring entry.
+ */
+uint64_t map_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * @returns true if entry has an expiry time and now is past it.
+ */
+static bool is_expired(map_entry_t *entry, uint64_t now) {
+    uint64_t expires = entry->expires;
+    return expires != 0 && expires <= now;
+}
+
+/*
+ * Links an expiring entry into the bucket of the wheel that covers its expiry
+ * tick. An entry that is already due goes into the bucket of the next tick,
+ * one further away than the top level reaches goes into the top level's
+ * furthest bucket and is placed again when it moves down.
+ */
+static void wheel_place(timing_wheel_t *wheel, map_entry_t *entry) {
+    // round up so an entry is never expired before its time
+    uint64_t tick = (entry->expires + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (tick < wheel->tick) {
+        tick = wheel->tick;
+    }
+    uint64_t delta = tick - wheel->tick;
+    uint32_t level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ull << (WHEEL_BITS * WHEEL_LEVELS))) {
+        tick = wheel->tick + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+
+    map_entry_t **bucket = &wheel->buckets[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    entry->wheel_next = *bucket;
+    entry->wheel_pprev = bucket;
+    if (*bucket != NULL) {
+        (*bucket)->wheel_pprev = &entry->wheel_next;
+    }
+    *bucket = entry;
+}
+
+/*
+ * Starts tracking the expiry of an entry. The caller must hold the write lock.
+ */
+static void wheel_add(timing_wheel_t *wheel, map_entry_t *entry) {
+    if (entry->expires == 0) {
+        return;
+    }
+    // an empty wheel isn't advanced, so catch up before measuring from it
+    if (wheel->count == 0) {
+        wheel->tick = map_clock() / WHEEL_TICK_MS;
+    }
+    wheel_place(wheel, entry);
+    wheel->count++;
+}
+
+/*
+ * Stops tracking the expiry of an entry. The caller must hold the write lock.
+ */
+static void wheel_remove(timing_wheel_t *wheel, map_entry_t *entry) {
+    if (entry->wheel_pprev == NULL) {
+        return;
+    }
+    *entry->wheel_pprev = entry->wheel_next;
+    if (entry->wheel_next != NULL) {
+        entry->wheel_next->wheel_pprev = entry->wheel_pprev;
+    }
+    entry->wheel_next = NULL;
+    entry->wheel_pprev = NULL;
+    wheel->count--;
+}
+
+/*
+ * Moves the entries of a higher level bucket down to the levels below, now
+ * that the wheel has come close enough to their expiry.
+ *
+ * @returns The index of the bucket, so the caller knows whether the level
+ *          above completed a lap as well.
+ */
+static uint32_t wheel_cascade(timing_wheel_t *wheel, uint32_t level) {
+    uint32_t index = (wheel->tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    map_entry_t *entry = wheel->buckets[level][index];
+    wheel->buckets[level][index] = NULL;
+    while (entry != NULL) {
+        map_entry_t *next = entry->wheel_next;
+        wheel_place(wheel, entry);
+        entry = next;
+    }
+    return index;
+}
+
+/*
+ * Hands an entry that was just unlinked from the nodes over to the reclaimer
+ * instead of releasing it while a reader may still be comparing its key or
+ * taking a reference on it. The caller must hold the write lock.
+ */
+static void retire_node(hashmap_t *self, map_entry_t *entry) {
+    if (entry == NULL) {
+        return;
+    }
+    wheel_remove(&self->wheel, entry);
+    self->bytes -= entry->charge;
+    // no reader of a single-owner map can be looking, and references keep their own count
+    if (self->single_owner) {
+        release_entry(entry);
+        return;
+    }
+    uint64_t epoch = epoch_retire_tag();
+
+    if (self->num_retired == self->retired_cap) {
+        reclaim_nodes(self);
+    }
+    if (self->num_retired == self->retired_cap) {
+        size_t capacity = self->retired_cap == 0 ? RETIRED_BATCH : self->retired_cap * 2;
+        retired_node_t *retired = realloc(self->retired, capacity * sizeof(retired_node_t));
+        if (retired == NULL) {
+            // out of memory for the list, wait out the readers instead
+            while (!epoch_reclaimable(epoch)) {
+                sched_yield();
+            }
+            release_entry(entry);
+            return;
+        }
+        self->retired = retired;
+        self->retired_cap = capacity;
+    }
+
+    self->retired[self->num_retired].entry = entry;
+    self->retired[self->num_retired].epoch = epoch;
+    self->num_retired++;
+}
+
+/*
+ * Frees the table replaced by the last resize once no reader can still be
+ * probing it. The caller must hold the write lock.
+ *
+ * @param wait Whether to wait for the readers instead of giving up.
+ */
+static void reclaim_table(hashmap_t *self, bool wait) {
+    if (self->retired_table == NULL) {
+        return;
+    }
+    while (!epoch_reclaimable(self->retired_table_epoch)) {
+        if (!wait) {
+            return;
+        }
+        sched_yield();
+    }
+    free_table(self->retired_table);
+    self->retired_table = NULL;
+}
+
+/*
+ * Retires a table that was just unlinked from the map. A map only grows
+ * again long after its last resize finished, so there's room for one.
+ * The caller must hold the write lock but not be in a write section.
+ */
+static void retire_table(hashmap_t *self, map_table_t *table) {
+    if (self->single_owner) {
+        free_table(table);
+        return;
+    }
+    reclaim_table(self, true);
+    self->retired_table = table;
+    self->retired_table_epoch = epoch_retire_tag();
+}
+
+/*
+ * Probes a table for the slot holding key. The caller must hold the write lock.
+ * Only slots whose control byte carries the key's tag are compared, and a key
+ * is never stored past a group with an empty slot, so the probe stops there.
+ *
+ * @returns The index of the slot, or -1 if the key is not in the table.
+ */
+static int find_group_node(map_table_t *table, map_key_t key, uint32_t hash) {
+    uint32_t group = hash_group(table, hash);
+    debug("Group Index: %u", group);
+    for (uint32_t probed = 0; probed < table->num_groups; probed++) {
+        const uint8_t *ctrl = table->ctrl + group * MAP_GROUP_SIZE;
+        for (group_mask_t match = match_byte(ctrl, hash_tag(hash)); match != 0; match &= match - 1) {
+            uint32_t slot = group * MAP_GROUP_SIZE + __builtin_ctz(match);
+            // found!!!
+            if (slot_matches(&table->slots[slot], key, hash)) {
+                debug("KEY LEN: %d", (int)key.key_len);
+                return slot;
+            }
+        }
+        if (match_byte(ctrl, CTRL_EMPTY) != 0) {
+            break;
+        }
+        group = next_group(table, group);
+    }
+    return -1;
+}
+
+/*
+ * Probes a Robin Hood table for the slot holding key. The caller must hold the write lock.
+ * Keys along a probe are ordered by their distance from home, so the probe
+ * stops at the first key that is closer to its home than key would be.
+ * Slots that were moved out of a table being migrated stay behind as
+ * deleted slots that keep their hash, so they still end probes correctly.
+ *
+ * @returns The index of the slot, or -1 if the key is not in the table.
+ */
+static int find_robin_hood_node(map_table_t *table, map_key_t key, uint32_t hash) {
+    uint32_t slot = home_slot(table, hash);
+    debug("Home Index: %u", slot);
+    for (uint32_t distance = 0; distance < num_slots(table); distance++) {
+        map_slot_t *myMapNode = &table->slots[slot];
+        if (table->ctrl[slot] == CTRL_EMPTY || probe_distance(table, myMapNode->hash, slot) < distance) {
+            break;
+        }
+        // found!!!
+        if (table->ctrl[slot] != CTRL_DELETED && slot_matches(myMapNode, key, hash)) {
+            debug("KEY LEN: %d", (int)key.key_len);
+            return slot;
+        }
+        slot = next_slot(table, slot);
+    }
+    return -1;
+}
+
+/*
+ * Probes the current table and then, while the map grows, the previous one.
+ * The caller must hold the write lock.
+ *
+ * @param table Set to the table holding key.
+ * @returns The index of the slot, or -1 if the key is not in the map.
+ */
+static int find_node(hashmap_t *self, map_key_t key, uint32_t hash, map_table_t **table) {
+    map_table_t *tables[2] = {self->table, self->old_table};
+    for (int i = 0; i < 2 && tables[i] != NULL; i++) {
+        int slot = self->probing == ROBIN_HOOD_PROBING ? find_robin_hood_node(tables[i], key, hash)
+                                                       : find_group_node(tables[i], key, hash);
+        if (slot >= 0) {
+            *table = tables[i];
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/*
+ * @returns What a pair is charged against the memory limit, including the entry
+ *          that owns it.
+ */
+static size_t entry_charge(hashmap_t *self, map_key_t key, map_val_t val) {
+    size_t size = self->size_function != NULL ? self->size_function(key, val) : key.key_len + val.val_len;
+    return size + sizeof(map_entry_t);
+}
+
+/*
+ * @returns true if adding bytes to the charges of the map's pairs would exceed its memory limit.
+ */
+static bool over_budget(hashmap_t *self, uint64_t bytes) {
+    return self->max_bytes != 0 && self->bytes + bytes > self->max_bytes;
+}
+
+/*
+ * Picks the entry to evict with a CLOCK approximation of LRU. The hand sweeps
+ * the slots, takes a hit from every entry it passes, and stops at the first one
+ * without hits left. Lookups only add a hit to the entry, so they stay lock-free,
+ * and a sweep passes each slot at most MAP_CLOCK_HITS + 1 times. An expired entry
+ * is taken whatever its hits. While the map
+ * grows, the previous table holds the oldest entries and is swept first,
+ * from the migration cursor on, since the slots below it were emptied. The
+ * caller must hold the write lock.
+ *
+ * @param table Set to the table holding the victim.
+ * @returns The index of the slot, or -1 if the map is empty.
+ */
+static int find_victim(hashmap_t *self, map_table_t **table) {
+    map_table_t *tables[2] = {self->old_table, self->table};
+    uint64_t now = map_clock();
+    for (int t = 0; t < 2; t++) {
+        if (tables[t] == NULL) {
+            continue;
+        }
+        uint32_t mask = num_slots(tables[t]) - 1;
+        uint32_t first = tables[t] == self->old_table ? self->migrated : 0;
+        for (uint32_t swept = 0; swept < (MAP_CLOCK_HITS + 1) * (num_slots(tables[t]) - first); swept++) {
+            uint32_t slot = self->clock_hand & mask;
+            if (slot < first) {
+                self->clock_hand += first - slot;
+                slot = first;
+            }
+            self->clock_hand++;
+            if (tables[t]->ctrl[slot] & 0x80) {
+                continue;
+            }
+            map_entry_t *entry = tables[t]->slots[slot].entry;
+            uint8_t hits = __atomic_load_n(&entry->hits, __ATOMIC_RELAXED);
+            if (hits > 0 && !is_expired(entry, now)) {
+                __atomic_store_n(&entry->hits, hits - 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            *table = tables[t];
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Stores a node in the first free slot along its probe sequence. The caller
+ * must hold the write lock.
+ *
+ * @returns false if the table has no free slot.
+ */
+static bool insert_group_node(hashmap_t *self, map_table_t *table, map_slot_t node) {
+    uint32_t group = hash_group(table, node.hash);
+    for (uint32_t probed = 0; probed < table->num_groups; probed++) {
+        group_mask_t match = match_free(table->ctrl + group * MAP_GROUP_SIZE);
+        if (match != 0) {
+            // the entry of a deleted slot was retired when it was deleted
+            uint32_t slot = group * MAP_GROUP_SIZE + __builtin_ctz(match);
+            debug("PUT INDEX %u", slot);
+            store_node(self, table, slot, hash_tag(node.hash), node);
+            return true;
+        }
+        group = next_group(table, group);
+    }
+    return false;
+}
+
+/*
+ * Stores a node for a key that is not in a Robin Hood table yet. Every key it
+ * passes that sits closer to its home than the carried one gives up its slot
+ * and is carried on instead. The caller must hold the write lock.
+ *
+ * @returns false if the table has no free slot.
+ */
+static bool insert_robin_hood_node(hashmap_t *self, map_table_t *table, map_slot_t node) {
+    uint32_t slot = home_slot(table, node.hash);
+    uint32_t distance = 0;
+
+    // the chain of moves ends at the first empty slot along the probe
+    for (uint32_t probed = 0, free_slot = slot; table->ctrl[free_slot] != CTRL_EMPTY; probed++) {
+        if (probed == num_slots(table)) {
+            return false;
+        }
+        free_slot = next_slot(table, free_slot);
+    }
+
+    // readers retry across the whole chain of moves
+    write_begin(self);
+    while (table->ctrl[slot] != CTRL_EMPTY) {
+        uint32_t resident = probe_distance(table, table->slots[slot].hash, slot);
+        if (resident < distance) {
+            map_slot_t displaced = table->slots[slot];
+            set_node(table, slot, hash_tag(node.hash), node);
+            node = displaced;
+            distance = resident;
+        }
+        slot = next_slot(table, slot);
+        distance++;
+    }
+    set_node(table, slot, hash_tag(node.hash), node);
+    write_end(self);
+    return true;
+}
+
+static bool place_node(hashmap_t *self, map_table_t *table, map_slot_t node) {
+    if (self->probing == ROBIN_HOOD_PROBING) {
+        return insert_robin_hood_node(self, table, node);
+    }
+    return insert_group_node(self, table, node);
+}
+
+/*
+ * Empties a slot without touching its entry. Robin Hood tables shift the
+ * keys behind it back by one slot until one is at home or a slot is empty,
+ * so no deleted markers are left behind. A table being migrated never moves
+ * its keys, so the slot becomes a deleted marker that keeps its hash instead.
+ * The caller must hold the write lock.
+ */
+static void unlink_node(hashmap_t *self, map_table_t *table, uint32_t slot) {
+    map_slot_t empty = {0};
+
+    if (self->probing == ROBIN_HOOD_PROBING && table == self->old_table) {
+        empty.hash = table->slots[slot].hash;
+        store_node(self, table, slot, CTRL_DELETED, empty);
+    } else if (self->probing == ROBIN_HOOD_PROBING) {
+        write_begin(self);
+        uint32_t next = next_slot(table, slot);
+        while (table->ctrl[next] != CTRL_EMPTY && probe_distance(table, table->slots[next].hash, next) > 0) {
+            set_node(table, slot, table->ctrl[next], table->slots[next]);
+            slot = next;
+            next = next_slot(table, next);
+        }
+        set_node(table, slot, CTRL_EMPTY, empty);
+        write_end(self);
+    } else {
+        // a probe that reaches this group already stops at its empty slot, so the slot can be empty again
+        uint32_t group = slot / MAP_GROUP_SIZE;
+        uint8_t ctrl = match_byte(table->ctrl + group * MAP_GROUP_SIZE, CTRL_EMPTY) != 0 ? CTRL_EMPTY : CTRL_DELETED;
+        store_node(self, table, slot, ctrl, empty);
+    }
+}
+
+/*
+ * Removes the node at slot and retires its entry. The caller must hold the write lock.
+ */
+static void remove_node(hashmap_t *self, map_table_t *table, uint32_t slot) {
+    map_entry_t *entry = table->slots[slot].entry;
+    unlink_node(self, table, slot);
+    retire_node(self, entry);
+    self->size--;
+}
+
+/*
+ * Evicts the entry find_victim picks. The caller must hold the write lock.
+ *
+ * @returns false if the map is empty.
+ */
+static bool evict_node(hashmap_t *self) {
+    map_table_t *table = NULL;
+    int slot = find_victim(self, &table);
+    if (slot < 0) {
+        return false;
+    }
+    debug("EVICT INDEX %d", slot);
+    remove_node(self, table, slot);
+    return true;
+}
+
+/*
+ * Moves up to count slots of the previous table to the current one and
+ * retires the previous table once all of them were moved. Each key leaves
+ * the old table and lands in the new one within one write section, so
+ * readers never miss it. The caller must hold the write lock.
+ */
+static void migrate_nodes(hashmap_t *self, uint32_t count) {
+    map_table_t *old = self->old_table;
+    if (old == NULL) {
+        return;
+    }
+    uint32_t total = num_slots(old);
+    uint32_t end = total - self->migrated < count ? total : self->migrated + count;
+
+    write_begin(self);
+    for (; self->migrated < end; self->migrated++) {
+        uint32_t slot = self->migrated;
+        if (old->ctrl[slot] & 0x80) {
+            continue;
+        }
+        map_slot_t node = old->slots[slot];
+        unlink_node(self, old, slot);
+        // the new table is twice as large as the old one, so it has room
+        place_node(self, self->table, node);
+    }
+    bool finished = self->migrated == total;
+    if (finished) {
+        debug("Migrated %u slots", self->migrated);
+        __atomic_store_n(&self->old_table, NULL, __ATOMIC_RELAXED);
+    }
+    write_end(self);
+
+    // readers that wait for the write section can't leave their epoch, so never retire inside it
+    if (finished) {
+        retire_table(self, old);
+    }
+}
+
+/*
+ * Starts moving the map to a table twice the size when one more key would
+ * push the current table past 7/8 load. The move happens a few slots per
+ * write in migrate_nodes, so no single write pays for the whole table.
+ * The caller must hold the write lock.
+ */
+static void grow_table(hashmap_t *self) {
+    map_table_t *table = self->table;
+    if (table->num_groups >= self->max_groups || (uint64_t) (self->size + 1) * 8 <= (uint64_t) num_slots(table) * 7) {
+        return;
+    }
+    // the last move finishes long before the new table fills up, but never start two at once
+    migrate_nodes(self, UINT32_MAX);
+
+    map_table_t *grown = create_table(table->num_groups * 2, self->numa_node);
+    if (grown == NULL) {
+        // keep filling the current table, it still has an eighth of its slots free
+        return;
+    }
+    debug("Growing to %u groups", grown->num_groups);
+
+    write_begin(self);
+    __atomic_store_n(&self->old_table, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->table, grown, __ATOMIC_RELEASE);
+    self->migrated = 0;
+    write_end(self);
+}
+
+/*
+ * Inserts a key/value pair whose key hashes to hash, that expires after ttl
+ * milliseconds or never if ttl is 0. The caller must hold the write lock.
+ *
+ * @returns true if the pair was stored, false otherwise.
+ */
+static bool insert_node(hashmap_t *self, map_key_t key, map_val_t val, uint32_t hash, uint32_t ttl, bool force) {
+    debug("capacity %d", self->capacity);
+    debug("SIZE: %d", self->size);
+
+    migrate_nodes(self, MIGRATE_SLOTS);
+
+    // a pair that is larger than the whole memory limit can't be made room for
+    size_t charge = entry_charge(self, key, val);
+    if (self->max_bytes != 0 && charge > self->max_bytes) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    map_table_t *table = NULL;
+    int slot = find_node(self, key, hash, &table);
+    size_t replaced = slot >= 0 ? table->slots[slot].entry->charge : 0;
+    bool full = (slot < 0 && self->size >= self->capacity) || (charge > replaced && over_budget(self, charge - replaced));
+    if (full && force == false) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    map_entry_t *entry = malloc(sizeof(map_entry_t));
+    if (entry == NULL) {
+        return false;
+    }
+    entry->refs = 1;
+    // a new key survives one pass of the eviction clock even if nobody looks it up
+    entry->hits = 1;
+    entry->key = key;
+    entry->val = val;
+    entry->destroy_function = self->destroy_function;
+    entry->expires = ttl != 0 ? map_clock() + ttl : 0;
+    entry->wheel_next = NULL;
+    entry->wheel_pprev = NULL;
+    entry->charge = charge;
+
+    map_slot_t node = make_slot(key, val, hash, entry);
+
+    // if the key is already in the map, replace its value in place even when the map is full
+    if (slot >= 0) {
+        debug("@@@PUT INDEX %d", slot);
+        map_entry_t *old = table->slots[slot].entry;
+        store_node(self, table, slot, hash_tag(hash), node);
+        retire_node(self, old);
+        self->bytes += charge;
+        wheel_add(&self->wheel, entry);
+        // a larger value may push the map past its memory limit
+        while (over_budget(self, 0) && evict_node(self));
+        return true;
+    }
+
+    // otherwise make room by evicting entries that weren't looked up recently
+    while ((self->size >= self->capacity || over_budget(self, charge)) && evict_node(self));
+
+    grow_table(self);
+    if (place_node(self, self->table, node)) {
+        self->size++;
+        self->bytes += charge;
+        wheel_add(&self->wheel, entry);
+        return true;
+    }
+
+    debug("ERRORRRRR");
+    free(entry);
+
+    return false;
+}
+
+/*
+ * This will insert a key/value pair into the hashmap pointed to by self.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node
+ * @param val The value associated with the node
+ * @param force If the map is full and force is true, evict an entry that wasn't looked up recently and return true.
+ *
+ * @returns true if the operation was successful, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return NULL.
+ * Error case: If the map is full and force is set to false, set errno to ENOMEM and return false.
+ */
+bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    return put_hashed(self, key, val, self->hash_function(key), force);
+}
+
+/*
+ * This will insert a key/value pair as put() does, for a caller that has
+ * hashed the key with the map's hash function already.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node
+ * @param val The value associated with the node
+ * @param hash The hash of key.
+ * @param force If the map is full and force is true, evict an entry that wasn't looked up recently and return true.
+ *
+ * @returns true if the operation was successful, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return false.
+ * Error case: If the map is full and force is set to false, set errno to ENOMEM and return false.
+ */
+bool put_hashed(hashmap_t *self, map_key_t key, map_val_t val, uint32_t hash, bool force) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0 || val.val_base == NULL || val.val_len == 0 || self->invalid) {
+        errno = EINVAL;
+        return false;
+    }
+
+    lock_map(self);
+    bool inserted = insert_node(self, key, val, hash, self->ttl, force);
+    unlock_map(self);
+
+    return inserted;
+}
+
+/*
+ * This will insert a key/value pair into the hashmap pointed to by self that
+ * expires after its own TTL instead of the map's.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node
+ * @param val The value associated with the node
+ * @param ttl The milliseconds until the pair expires, or 0 if it never does.
+ * @param force If the map is full and force is true, evict an entry that wasn't looked up recently and return true.
+ *
+ * @returns true if the operation was successful, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return false.
+ * Error case: If the map is full and force is set to false, set errno to ENOMEM and return false.
+ */
+bool put_ttl(hashmap_t *self, map_key_t key, map_val_t val, uint32_t ttl, bool force) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    return put_ttl_hashed(self, key, val, self->hash_function(key), ttl, force);
+}
+
+/*
+ * This will insert a key/value pair with a TTL of its own as put_ttl() does,
+ * for a caller that has hashed the key with the map's hash function already.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node
+ * @param val The value associated with the node
+ * @param hash The hash of key.
+ * @param ttl The milliseconds until the pair expires, or 0 if it never does.
+ * @param force If the map is full and force is true, evict an entry that wasn't looked up recently and return true.
+ *
+ * @returns true if the operation was successful, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return false.
+ * Error case: If the map is full and force is set to false, set errno to ENOMEM and return false.
+ */
+bool put_ttl_hashed(hashmap_t *self, map_key_t key, map_val_t val, uint32_t hash, uint32_t ttl, bool force) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0 || val.val_base == NULL || val.val_len == 0 || self->invalid) {
+        errno = EINVAL;
+        return false;
+    }
+
+    lock_map(self);
+    bool inserted = insert_node(self, key, val, hash, ttl, force);
+    unlock_map(self);
+
+    return inserted;
+}
+
+/*
+ * Sets the TTL of the pairs put() and put_batch() insert from now on. Pairs
+ * already in the map keep theirs.
+ *
+ * @param self A pointer to the hashmap
+ * @param ttl The milliseconds until those pairs expire, or 0 if they never do.
+ */
+void set_default_ttl(hashmap_t *self, uint32_t ttl) {
+    if (self == NULL || self->invalid) {
+        errno = EINVAL;
+        return;
+    }
+    lock_map(self);
+    self->ttl = ttl;
+    unlock_map(self);
+}
 
 /*
- * This function will calloc(3) a new instance of hashmap_t
- *      that manages an array of capacity map_node_t instances
- *
- * @param capacity The maximum number of items that the map can hold.
- * @param hash_function The hash function that the map uses to hash keys.
- * @param destroy_function The destroyer function that the map uses to free keys and values when it is destroyed.
- *
- * @returns A valid pointer to a hashmap_t instance, or NULL.
+ * Limits the memory the pairs in the map take up. The pairs already in the
+ * map are evicted down to the limit on the next insert.
  *
- * Error case: If any parameters are invalid, set errno to EINVAL and return NULL.
- * Error case: If calloc(3) is unsuccessful or any of the locks cannot be initialized, return NULL.
+ * @param self A pointer to the hashmap
+ * @param max_bytes The most bytes the pairs may be charged, or 0 for no limit.
+ * @param size_function What a pair takes up, or NULL to charge the lengths of its key and value.
  */
-hashmap_t *create_map(uint32_t capacity, hash_func_f hash_function, destructor_f destroy_function) {
-    if(hash_function == NULL || destroy_function == NULL || capacity == 0) {
+void set_memory_limit(hashmap_t *self, uint64_t max_bytes, size_func_f size_function) {
+    if (self == NULL || self->invalid) {
         errno = EINVAL;
-        return NULL;
-    }
-    // create hashmap and check if calloc failed
-    struct hashmap_t *hashmap = (struct hashmap_t*) calloc(1, sizeof(hashmap_t));
-    if(hashmap == NULL) {
-        return NULL;
-    }
-    hashmap->capacity = capacity;
-    hashmap->hash_function = hash_function;
-    hashmap->destroy_function = destroy_function;
-    hashmap->nodes = (struct map_node_t*) calloc(hashmap->capacity, sizeof(map_node_t));
-    if (hashmap->nodes == NULL) {
-        free(hashmap);
-        return NULL;
+        return;
     }
+    lock_map(self);
+    self->max_bytes = max_bytes;
+    // pairs stored before keep the charge they had, so they are uncharged correctly
+    self->size_function = size_function;
+    unlock_map(self);
+}
 
-    int x = pthread_mutex_init(&hashmap->write_lock, NULL);
-    int y = pthread_mutex_init(&hashmap->fields_lock, NULL);
-    if (x != 0 || y != 0) {
-        free(hashmap);
-        return NULL;
+/*
+ * Places the tables the map grows into from now on on a NUMA node. The first
+ * table is too small to matter, every later one is bound to the node before
+ * any of its slots is written.
+ *
+ * @param self A pointer to the hashmap
+ * @param node The node, or -1 to let the kernel place tables where they are first touched.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL.
+ */
+void set_numa_node(hashmap_t *self, int node) {
+    if (self == NULL || self->invalid || node < -1 || node >= MAX_NUMA_NODES) {
+        errno = EINVAL;
+        return;
     }
+    lock_map(self);
+    self->numa_node = node;
+    unlock_map(self);
+}
 
-    int i = 0;
-    while(i < capacity) {
-        hashmap->nodes[i].tombstone = false;
-        i++;
+/*
+ * Hands the map to a single thread. The write lock, the sequence number
+ * readers validate against and the epochs are skipped from then on, so every
+ * operation runs without a lock or a store another thread reads. Removed
+ * entries and replaced tables are freed right away, and an entry a reference
+ * from get_ref() holds lives on until the reference is released.
+ *
+ * @param self A pointer to the hashmap
+ */
+void set_single_owner(hashmap_t *self) {
+    if (self == NULL || self->invalid) {
+        errno = EINVAL;
+        return;
     }
-
-    return hashmap;
+    pthread_mutex_lock(&self->write_lock);
+    self->single_owner = true;
+    pthread_mutex_unlock(&self->write_lock);
 }
 
 /*
- * This will insert a key/value pair into the hashmap pointed to by self.
+ * This will insert many key/value pairs into the hashmap pointed to by self
+ * while taking the write lock only once.
  *
  * @param self A pointer to the hashmap
- * @param key The key associated with the node
- * @param val The value associated with the node
- * @param force If the map is full and force is true, overwrite the entry at the index given by get_index and return true.
+ * @param keys The keys of the pairs
+ * @param vals The values of the pairs, in the same order as keys
+ * @param num_pairs The number of pairs to insert
+ * @param force If the map is full and force is true, every pair evicts an entry that wasn't looked up recently.
  *
- * @returns true if the operation was successful, false otherwise.
+ * @returns The number of pairs that were inserted, which are always the first ones. The map takes
+ *          ownership of those pairs only.
  *
- * Error case: If any parameters are invalid, set errno to EINVAL and return NULL.
- * Error case: If the map is full and force is set to false, set errno to ENOMEM and return false.
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ * Error case: If a pair is invalid, it and the remaining pairs are skipped and errno is set to EINVAL.
+ * Error case: If the map is full and force is set to false, the remaining pairs are skipped and errno is set to ENOMEM.
  */
-bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
+size_t put_batch(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t num_pairs, bool force) {
+    return put_batch_hashed(self, keys, vals, NULL, num_pairs, force);
+}
 
-    if (self == NULL || key.key_base == NULL || key.key_len == 0 || val.val_base == NULL || val.val_len == 0 || self->invalid) {
+/*
+ * This will insert many key/value pairs as put_batch() does, for a caller
+ * that has hashed the keys with the map's hash function already.
+ *
+ * @param self A pointer to the hashmap
+ * @param keys The keys of the pairs
+ * @param vals The values of the pairs, in the same order as keys
+ * @param hashes The hashes of the keys, in the same order, or NULL to hash them here.
+ * @param num_pairs The number of pairs to insert
+ * @param force If the map is full and force is true, every pair evicts an entry that wasn't looked up recently.
+ *
+ * @returns The number of pairs that were inserted, which are always the first ones. The map takes
+ *          ownership of those pairs only.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ * Error case: If a pair is invalid, it and the remaining pairs are skipped and errno is set to EINVAL.
+ * Error case: If the map is full and force is set to false, the remaining pairs are skipped and errno is set to ENOMEM.
+ */
+size_t put_batch_hashed(hashmap_t *self, map_key_t *keys, map_val_t *vals, const uint32_t *hashes, size_t num_pairs, bool force) {
+    if (self == NULL || keys == NULL || vals == NULL || self->invalid) {
         errno = EINVAL;
-        return false;
+        return 0;
     }
 
-    pthread_mutex_lock(&self->write_lock);
-    debug("capacity %d", self->capacity);
-    debug("SIZE: %d", self->size);
+    size_t inserted = 0;
+    lock_map(self);
+    for (size_t i = 0; i < num_pairs; i++) {
+        if (keys[i].key_base == NULL || keys[i].key_len == 0 || vals[i].val_base == NULL || vals[i].val_len == 0) {
+            errno = EINVAL;
+            break;
+        }
+        uint32_t hash = hashes != NULL ? hashes[i] : self->hash_function(keys[i]);
+        if (!insert_node(self, keys[i], vals[i], hash, self->ttl, force)) {
+            break;
+        }
+        inserted++;
+    }
+    unlock_map(self);
 
-    if (self->size >= self->capacity && force == false) {
-        errno = ENOMEM;
-        return false;
+    return inserted;
+}
+
+/*
+ * Waits until no writer is changing nodes.
+ *
+ * @returns The sequence number to validate the read against.
+ */
+static uint32_t read_begin(hashmap_t *self) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&self->seq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
     }
-    // set nodes at position get_index and return
-    if(self->size >= self->capacity && force == true) {
-        // LOCK HERE
-        int i = get_index(self, key);
-        debug("@@@PUT INDEX %d", i);
-        //self->destroy_function(self->nodes[get_index(self, key)].key, self->nodes[get_index(self, key)].val);
-        self->nodes[i].key.key_base = key.key_base;
-        self->nodes[i].key.key_len = key.key_len;
-        self->nodes[i].val.val_base = val.val_base;
-        self->nodes[i].val.val_len = val.val_len;
-        self->nodes[i].tombstone = false;
-        //UNLOCK HERE
-        pthread_mutex_unlock(&self->write_lock);
+    return seq;
+}
 
-        return true;
+/*
+ * @returns true if a writer changed nodes since read_begin returned seq.
+ */
+static bool read_retry(hashmap_t *self, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&self->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Copies a slot without writing anything shared. The copy is only
+ * consistent if read_retry says so afterwards. The inline key is only
+ * copied as far as the key reaches.
+ */
+static map_slot_t load_node(map_slot_t *myMapNode) {
+    map_slot_t node;
+    node.hash = __atomic_load_n(&myMapNode->hash, __ATOMIC_RELAXED);
+    node.key_len = __atomic_load_n(&myMapNode->key_len, __ATOMIC_RELAXED);
+    node.entry = __atomic_load_n(&myMapNode->entry, __ATOMIC_RELAXED);
+    node.val.val_base = __atomic_load_n(&myMapNode->val.val_base, __ATOMIC_RELAXED);
+    node.val.val_len = __atomic_load_n(&myMapNode->val.val_len, __ATOMIC_RELAXED);
+    uint32_t key_len = node.key_len <= MAP_INLINE_KEY_SIZE ? node.key_len : 0;
+    for (size_t i = 0; i * sizeof(uint64_t) < key_len; i++) {
+        node.key_words[i] = __atomic_load_n(&myMapNode->key_words[i], __ATOMIC_RELAXED);
     }
+    return node;
+}
+
+/*
+ * Probes a table for key like find_group_node, but without locking or writing anything shared. Each
+ * group of control bytes and each candidate slot is copied and then validated against the
+ * sequence number, so a key is only compared when its bytes, length and entry belong together,
+ * and the caller starts the whole probe over when a writer got in the way.
+ *
+ * @param found Set to the value and entry of the slot holding key.
+ * @returns LOOKUP_FOUND, LOOKUP_MISSING, or LOOKUP_RETRY if a writer changed nodes since seq.
+ */
+static lookup_results lookup_group_node(hashmap_t *self, map_table_t *table, map_key_t key, uint32_t hash,
+                                        uint32_t seq, map_ref_t *found) {
+    uint8_t tag = hash_tag(hash);
+    uint32_t group = hash_group(table, hash);
+    for (uint32_t probed = 0; probed < table->num_groups; probed++) {
+        const uint8_t *ctrl = table->ctrl + group * MAP_GROUP_SIZE;
+        group_mask_t match = match_byte(ctrl, tag);
+        group_mask_t empty = match_byte(ctrl, CTRL_EMPTY);
+        for (; match != 0; match &= match - 1) {
+            map_slot_t node = load_node(&table->slots[group * MAP_GROUP_SIZE + __builtin_ctz(match)]);
+            if (read_retry(self, seq)) {
+                return LOOKUP_RETRY;
+            }
 
+            if (slot_matches(&node, key, hash)) {
+                *found = MAP_REF(node.val, node.entry);
+                return LOOKUP_FOUND;
+            }
+        }
+        if (empty != 0) {
+            break;
+        }
+        group = next_group(table, group);
+    }
+    return LOOKUP_MISSING;
+}
 
-    // check if key is in hash map
-    // if it is, set the value
-    int nodeIndex = get_index(self, key);
-    int i = nodeIndex;
-    debug("PUT INDEX %d", i);
-    map_node_t *myMapNode;
-    while(i < self->capacity+nodeIndex) {
-        myMapNode = &self->nodes[i % self->capacity];
-        debug("Store: %d", i % self->capacity);
-        if(myMapNode == NULL || myMapNode->key.key_base == NULL || myMapNode->key.key_len == 0 || myMapNode->val.val_base == NULL
-            || myMapNode->val.val_len == 0) {
-            debug("here1");
-            myMapNode->key.key_base = key.key_base;
-            myMapNode->key.key_len = key.key_len;
-            myMapNode->val.val_base = val.val_base;
-            myMapNode->val.val_len = val.val_len;
-            myMapNode->tombstone = false;
-            self->size++;
-            pthread_mutex_unlock(&self->write_lock);
+/*
+ * Probes a Robin Hood table for key like find_robin_hood_node, validating every
+ * slot it reads the way lookup_group_node does.
+ *
+ * @param found Set to the value and entry of the slot holding key.
+ * @returns LOOKUP_FOUND, LOOKUP_MISSING, or LOOKUP_RETRY if a writer changed nodes since seq.
+ */
+static lookup_results lookup_robin_hood_node(hashmap_t *self, map_table_t *table, map_key_t key, uint32_t hash,
+                                             uint32_t seq, map_ref_t *found) {
+    uint32_t slot = home_slot(table, hash);
+    for (uint32_t distance = 0; distance < num_slots(table); distance++) {
+        map_slot_t *myMapNode = &table->slots[slot];
+        uint8_t ctrl = __atomic_load_n(&table->ctrl[slot], __ATOMIC_RELAXED);
+        uint32_t node_hash = __atomic_load_n(&myMapNode->hash, __ATOMIC_RELAXED);
+        if (ctrl == CTRL_EMPTY || probe_distance(table, node_hash, slot) < distance) {
+            break;
+        }
+        if (ctrl != CTRL_DELETED && node_hash == hash) {
+            map_slot_t node = load_node(myMapNode);
+            if (read_retry(self, seq)) {
+                return LOOKUP_RETRY;
+            }
 
-            return true;
-            // check if equal
-        } else if (myMapNode->tombstone == true || (key.key_len == myMapNode->key.key_len &&
-            memcmp(key.key_base, myMapNode->key.key_base, key.key_len) == 0) || (key.key_base == NULL && myMapNode == NULL)) {
-            debug("Here2");
-            if (!(myMapNode == NULL || myMapNode->key.key_base == NULL || myMapNode->key.key_len == 0 || myMapNode->val.val_base == NULL
-            || myMapNode->val.val_len == 0)) {
-                debug("equal but both null");
-                self->destroy_function(myMapNode->key, myMapNode->val);
-                myMapNode->key.key_base = key.key_base;
-                myMapNode->key.key_len = key.key_len;
-                myMapNode->val.val_base = val.val_base;
-                myMapNode->val.val_len = val.val_len;
-                myMapNode->tombstone = false;
-                self->size++;
-                pthread_mutex_unlock(&self->write_lock);
-                return true;
+            if (slot_matches(&node, key, hash)) {
+                *found = MAP_REF(node.val, node.entry);
+                return LOOKUP_FOUND;
             }
         }
-        i++;
+        slot = next_slot(table, slot);
     }
+    return LOOKUP_MISSING;
+}
 
-    debug("ERRORRRRR");
+/*
+ * Probes the current table and then, while the map grows, the previous one.
+ * A key being migrated leaves one table and enters the other within a
+ * single write section, so it is seen in exactly one of them or the probe
+ * starts over. The caller must be inside an epoch so the tables, key and
+ * value memory outlive the probe. The entry found gets a hit for the
+ * eviction clock, unless it expired, which makes it missing.
+ *
+ * @returns The value and entry of the slot holding key, without taking a reference,
+ *          or a NULL value pointer and no entry.
+ */
+static map_ref_t lookup_node(hashmap_t *self, map_key_t key, uint32_t hash) {
+    map_ref_t node;
 
-    return false;
+retry:;
+    uint32_t seq = read_begin(self);
+    map_table_t *tables[2] = {
+        __atomic_load_n(&self->table, __ATOMIC_ACQUIRE),
+        __atomic_load_n(&self->old_table, __ATOMIC_ACQUIRE),
+    };
+    for (int i = 0; i < 2 && tables[i] != NULL; i++) {
+        lookup_results result = self->probing == ROBIN_HOOD_PROBING ? lookup_robin_hood_node(self, tables[i], key, hash, seq, &node)
+                                                                    : lookup_group_node(self, tables[i], key, hash, seq, &node);
+        if (result == LOOKUP_RETRY) {
+            goto retry;
+        }
+        if (result == LOOKUP_FOUND) {
+            if (node.entry->expires != 0 && is_expired(node.entry, map_clock())) {
+                return MAP_REF(MAP_VAL(NULL, 0), NULL);
+            }
+            // racing lookups may lose a hit, but a hot key stops writing once it has them all
+            uint8_t hits = __atomic_load_n(&node.entry->hits, __ATOMIC_RELAXED);
+            if (hits < MAP_CLOCK_HITS) {
+                __atomic_store_n(&node.entry->hits, hits + 1, __ATOMIC_RELAXED);
+            }
+            return node;
+        }
+    }
+    // the slots that ended the probes must not have been torn by a writer
+    if (read_retry(self, seq)) {
+        goto retry;
+    }
+    return MAP_REF(MAP_VAL(NULL, 0), NULL);
 }
 
 /*
- * Retrieves the map_val_t corresponding to key
+ * Retrieves the map_val_t corresponding to key without taking any lock.
  *
  * @param self A pointer to the hashmap
  * @param key The key associated with the node.
@@ -162,57 +1408,157 @@ bool put(hashmap_t *self, map_key_t key, map_val_t val, bool force) {
  * Error case: The returned map_val_t instance should contain the same fields as tje case where key is not found
  */
 map_val_t get(hashmap_t *self, map_key_t key) {
+    if (self == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return MAP_VAL(NULL, 0);
+    }
+    return get_hashed(self, key, self->hash_function(key));
+}
+
+/*
+ * Retrieves the map_val_t corresponding to key as get() does, for a caller
+ * that has hashed the key with the map's hash function already.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node.
+ * @param hash The hash of key.
+ *
+ * @returns The corresponding value. If the key is not found,
+ *           the map_val_t instance will contain a NULL pointer and a val_len of 0.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return the not found instance.
+ */
+map_val_t get_hashed(hashmap_t *self, map_key_t key, uint32_t hash) {
     if (self == NULL || key.key_len == 0 || self->invalid) {
         errno = EINVAL;
         return MAP_VAL(NULL, 0);
     }
-    debug("111");
-    pthread_mutex_lock(&self->fields_lock);
-    debug("here");
-    self->num_readers++;
-    if (self->num_readers == 1) {
-        pthread_mutex_lock(&self->write_lock);
+    read_enter(self);
+    map_val_t val = lookup_node(self, key, hash).val;
+    read_exit(self);
+
+    return val;
+}
+
+/*
+ * Retrieves the map_val_t corresponding to key and takes a reference on its entry,
+ * so the value outlives overwrites and deletes until release_ref is called.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node.
+ *
+ * @returns The corresponding value and its entry. If the key is not found,
+ *           the map_ref_t instance will contain a NULL value pointer and a NULL entry.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return the not found instance.
+ */
+map_ref_t get_ref(hashmap_t *self, map_key_t key) {
+    if (self == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return MAP_REF(MAP_VAL(NULL, 0), NULL);
     }
-    pthread_mutex_unlock(&self->fields_lock);
-    debug("GET KEY %s", (char*)key.key_base);
-    int nodeIndex = get_index(self, key);
-    debug("Node Index: %d", nodeIndex);
-    int i = nodeIndex;
-    map_node_t *myMapNode;
-    while(i < self->capacity+nodeIndex) {
-        debug("I: %d", i);
-        myMapNode = &self->nodes[i % self->capacity];
-        debug("Tomb %d", myMapNode->tombstone);
-        debug("KEY: %s", (char*)myMapNode->key.key_base);
-        // found!!!
-        if (self->nodes[i].tombstone == false && ((key.key_len == myMapNode->key.key_len &&
-            memcmp(key.key_base, myMapNode->key.key_base, key.key_len) == 0) || (key.key_base == NULL && myMapNode == NULL))) {
-            debug("MEMCMP: %s", (char*)key.key_base);
-            debug("MEMCMP: %s", (char*)myMapNode->key.key_base);
-            debug("KEY LEN: %d", (int)key.key_len);
-            break;
-        }
-        i++;
-        myMapNode = NULL;
+    return get_ref_hashed(self, key, self->hash_function(key));
+}
+
+/*
+ * Retrieves the map_val_t corresponding to key and takes a reference on its entry
+ * as get_ref() does, for a caller that has hashed the key with the map's hash function already.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node.
+ * @param hash The hash of key.
+ *
+ * @returns The corresponding value and its entry. If the key is not found,
+ *           the map_ref_t instance will contain a NULL value pointer and a NULL entry.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return the not found instance.
+ */
+map_ref_t get_ref_hashed(hashmap_t *self, map_key_t key, uint32_t hash) {
+    if (self == NULL || key.key_len == 0 || self->invalid) {
+        errno = EINVAL;
+        return MAP_REF(MAP_VAL(NULL, 0), NULL);
+    }
+    read_enter(self);
+    map_ref_t node = lookup_node(self, key, hash);
+    // the map's own reference can't be dropped before this thread leaves the epoch
+    if (node.entry != NULL) {
+        __atomic_add_fetch(&node.entry->refs, 1, __ATOMIC_RELAXED);
     }
+    read_exit(self);
 
-    pthread_mutex_lock(&self->fields_lock);
-    self->num_readers--;
-    if(self->num_readers == 0) {
-        pthread_mutex_unlock(&self->write_lock);
+    return MAP_REF(node.val, node.entry);
+}
+
+/*
+ * Releases a reference taken by get_ref. The pair is destroyed if it was
+ * removed from the map and this was the last reference.
+ *
+ * @param ref The reference to release.
+ */
+void release_ref(map_ref_t ref) {
+    if (ref.entry != NULL) {
+        release_entry(ref.entry);
     }
-    pthread_mutex_unlock(&self->fields_lock);
+}
+
+/*
+ * Retrieves the map_val_t of every key in keys without taking any lock.
+ *
+ * @param self A pointer to the hashmap
+ * @param keys The keys to look up.
+ * @param vals The values of the keys, in the same order. A key that is not found
+ *             gets a map_val_t instance with a NULL pointer and a val_len of 0.
+ * @param num_keys The number of keys to look up.
+ *
+ * @returns The number of keys that were found.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ */
+size_t get_batch(hashmap_t *self, map_key_t *keys, map_val_t *vals, size_t num_keys) {
+    return get_batch_hashed(self, keys, NULL, vals, num_keys);
+}
 
-    if(myMapNode != NULL) {
-        return myMapNode->val;
+/*
+ * Retrieves the map_val_t of every key in keys as get_batch() does, for a caller
+ * that has hashed the keys with the map's hash function already.
+ *
+ * @param self A pointer to the hashmap
+ * @param keys The keys to look up.
+ * @param hashes The hashes of the keys, in the same order, or NULL to hash them here.
+ * @param vals The values of the keys, in the same order. A key that is not found
+ *             gets a map_val_t instance with a NULL pointer and a val_len of 0.
+ * @param num_keys The number of keys to look up.
+ *
+ * @returns The number of keys that were found.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ */
+size_t get_batch_hashed(hashmap_t *self, map_key_t *keys, const uint32_t *hashes, map_val_t *vals, size_t num_keys) {
+    if (self == NULL || keys == NULL || vals == NULL || self->invalid) {
+        errno = EINVAL;
+        return 0;
+    }
+    size_t found = 0;
+    read_enter(self);
+    for (size_t i = 0; i < num_keys; i++) {
+        if (keys[i].key_len == 0) {
+            vals[i] = MAP_VAL(NULL, 0);
+            continue;
+        }
+        uint32_t hash = hashes != NULL ? hashes[i] : self->hash_function(keys[i]);
+        vals[i] = lookup_node(self, keys[i], hash).val;
+        if (vals[i].val_base != NULL) {
+            found++;
+        }
     }
+    read_exit(self);
 
-    // not found
-    return MAP_VAL(NULL, 0);
+    return found;
 }
 
 /*
- * Removes the entry with key
+ * Removes the entry with key. Its key and value are destroyed once no reader can see them
+ * and every reference to them was released.
  *
  * @param self A pointer to the hashmap
  * @param key The key associated with the node.
@@ -223,45 +1569,117 @@ map_val_t get(hashmap_t *self, map_key_t key) {
  *             return a map_node_t with all pointers set to NULL and lengths set to 0.
  */
 map_node_t delete(hashmap_t *self, map_key_t key) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+    return delete_hashed(self, key, self->hash_function(key));
+}
+
+/*
+ * Removes the entry with key as delete() does, for a caller that has hashed
+ * the key with the map's hash function already.
+ *
+ * @param self A pointer to the hashmap
+ * @param key The key associated with the node.
+ * @param hash The hash of key.
+ *
+ * @returns The removed map_node_t instance.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and
+ *             return a map_node_t with all pointers set to NULL and lengths set to 0.
+ */
+map_node_t delete_hashed(hashmap_t *self, map_key_t key, uint32_t hash) {
     if (self == NULL || key.key_base == NULL || key.key_len == 0 || self->invalid) {
         errno = EINVAL;
         return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
     }
+    map_node_t removed = MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+
     // lock write thread before we write
-    pthread_mutex_lock(&self->write_lock);
+    lock_map(self);
 
-    int nodeIndex = get_index(self, key);
-    int i = nodeIndex;
-    map_node_t *myMapNode;
-    while(i < self->capacity+nodeIndex) {
-        myMapNode = &self->nodes[i % self->capacity];
-        if (self->nodes[i].tombstone == false && ((key.key_len == myMapNode->key.key_len &&
-            memcmp(key.key_base, myMapNode->key.key_base, key.key_len) == 0) || (key.key_base == NULL && myMapNode == NULL))) {
-            debug("BREAKKKKK");
-            break;
+    migrate_nodes(self, MIGRATE_SLOTS);
+
+    map_table_t *table = NULL;
+    int slot = find_node(self, key, hash, &table);
+
+    if (slot >= 0) {
+        map_entry_t *entry = table->slots[slot].entry;
+        debug("TOMB %s", (char*) entry->key.key_base);
+        // an expired pair is gone already, it just wasn't cleaned up yet
+        if (!is_expired(entry, map_clock())) {
+            removed = MAP_NODE(entry->key, entry->val, true);
         }
-        i++;
-        myMapNode = NULL;
+        remove_node(self, table, slot);
     }
+    // unlock write thread when we finished
+    unlock_map(self);
+
+    return removed;
+}
 
-    if (!(myMapNode == NULL || myMapNode->key.key_base == NULL || myMapNode->key.key_len == 0 || myMapNode->val.val_base == NULL
-            || myMapNode->val.val_len == 0)) {
-        debug("TOMB %s", (char*) myMapNode->key.key_base);
-        myMapNode->tombstone = true;
-        self->size--;
+/*
+ * Advances the map's timing wheel to the present and removes every entry
+ * that expired on the way. Only the buckets of the ticks that passed are
+ * visited, plus one higher level bucket whenever a level completes a lap.
+ *
+ * @param self A pointer to the hashmap
+ *
+ * @returns The number of entries that were removed.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ */
+size_t expire_map(hashmap_t *self) {
+    if (self == NULL || self->invalid) {
+        errno = EINVAL;
+        return 0;
     }
-    // unlock write thread when we finished
-    pthread_mutex_unlock(&self->write_lock);
+    size_t expired = 0;
+    // a map without expiring entries isn't worth taking the write lock for
+    if (__atomic_load_n(&self->wheel.count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    lock_map(self);
+    timing_wheel_t *wheel = &self->wheel;
+    uint64_t now = map_clock() / WHEEL_TICK_MS;
+    while (wheel->count > 0 && wheel->tick <= now) {
+        uint32_t index = wheel->tick & WHEEL_MASK;
+        for (uint32_t level = 1; index == 0 && level < WHEEL_LEVELS; level++) {
+            if (wheel_cascade(wheel, level) != 0) {
+                break;
+            }
+        }
 
-    if(myMapNode != NULL) {
-        return *myMapNode;
+        // removing an entry unlinks it from the bucket through retire_node
+        map_entry_t *entry;
+        while ((entry = wheel->buckets[0][index]) != NULL) {
+            map_table_t *table = NULL;
+            int slot = find_node(self, entry->key, self->hash_function(entry->key), &table);
+            if (slot < 0) {
+                // every entry on the wheel is in the map, but never loop on one that isn't
+                wheel_remove(wheel, entry);
+                continue;
+            }
+            remove_node(self, table, slot);
+            expired++;
+        }
+        wheel->tick++;
     }
+    // nothing is left to expire, so the ticks in between don't need visiting
+    if (wheel->count == 0) {
+        wheel->tick = now + 1;
+    }
+    unlock_map(self);
 
-    return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    debug("Expired %zu entries", expired);
+    return expired;
 }
 
 /*
- * Clears all remaining entries in the map. It will call the destroy_function in self on every remaining item.
+ * Clears all remaining entries in the map. It will call the destroy_function in self on every remaining item
+ * once no reader can see it anymore. A map that was growing drops its previous table.
  *
  * @param self A pointer to the hashmap
  *
@@ -276,27 +1694,80 @@ bool clear_map(hashmap_t *self) {
         return false;
     }
     // lock write thread before we write
-    pthread_mutex_lock(&self->write_lock);
-    int i = 0;
-    while(i < self->capacity) {
-        self->destroy_function(self->nodes[i].key, self->nodes[i].val);
-        self->nodes[i].key.key_base = NULL;
-        self->nodes[i].key.key_len = 0;
-        self->nodes[i].val.val_base = NULL;
-        self->nodes[i].val.val_len = 0;
-        i++;
+    lock_map(self);
+    map_table_t *tables[2] = {self->table, self->old_table};
+    for (int t = 0; t < 2 && tables[t] != NULL; t++) {
+        uint32_t i = 0;
+        while(i < num_slots(tables[t])) {
+            map_slot_t old = tables[t]->slots[i];
+            if (tables[t]->ctrl[i] != CTRL_EMPTY) {
+                store_node(self, tables[t], i, CTRL_EMPTY, (map_slot_t) {0});
+            }
+            retire_node(self, old.entry);
+            i++;
+        }
+    }
+    if (self->old_table != NULL) {
+        write_begin(self);
+        __atomic_store_n(&self->old_table, NULL, __ATOMIC_RELAXED);
+        write_end(self);
+        retire_table(self, tables[1]);
     }
 
     self->size = 0;
     // unlock write thread after we finished writing
-    pthread_mutex_unlock(&self->write_lock);
+    unlock_map(self);
     debug("TRUE");
 	return true;
 }
 
 /*
- * This will invalidate the hashmap_t instances pointed to by self. It will call the destroy function in self on every remaining item.
- * It will free(3) the nodes pointer in self. It will set the invalid flag to true.
+ * Measures the probe length of every key in the map while holding the write lock.
+ *
+ * @param self A pointer to the hashmap
+ *
+ * @returns The number of keys and their maximum and total probe length.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return all zeros.
+ */
+probe_stats_t map_probe_stats(hashmap_t *self) {
+    probe_stats_t stats = {0, 0, 0};
+    if (self == NULL || self->invalid) {
+        errno = EINVAL;
+        return stats;
+    }
+
+    lock_map(self);
+    map_table_t *tables[2] = {self->table, self->old_table};
+    for (int t = 0; t < 2 && tables[t] != NULL; t++) {
+        map_table_t *table = tables[t];
+        for (uint32_t i = 0; i < num_slots(table); i++) {
+            if (table->ctrl[i] & 0x80) {
+                continue;
+            }
+            uint32_t probe;
+            if (self->probing == ROBIN_HOOD_PROBING) {
+                probe = probe_distance(table, table->slots[i].hash, i) + 1;
+            } else {
+                uint32_t home = hash_group(table, table->slots[i].hash);
+                probe = ((i / MAP_GROUP_SIZE - home) & (table->num_groups - 1)) + 1;
+            }
+            stats.num_entries++;
+            stats.total_probe += probe;
+            if (probe > stats.max_probe) {
+                stats.max_probe = probe;
+            }
+        }
+    }
+    unlock_map(self);
+
+    return stats;
+}
+
+/*
+ * This will invalidate the hashmap_t instances pointed to by self. It will drop the map's reference to every remaining item,
+ * including the retired ones, right away, so the destroy function in self runs on every item nobody holds a reference to.
+ * It will free(3) the tables in self. It will set the invalid flag to true.
  *
  * @param self A pointer to the hashmap
  *
@@ -310,24 +1781,41 @@ bool invalidate_map(hashmap_t *self) {
         return false;
     }
     // lock write thread before we write
-    pthread_mutex_lock(&self->write_lock);
+    lock_map(self);
 
-    int counter = self->capacity;
-    int i = 0;
-    while(counter > 0) {
-        self->destroy_function(self->nodes[i].key, self->nodes[i].val);
-        self->nodes[i].key.key_base = NULL;
-        self->nodes[i].key.key_len = 0;
-        self->nodes[i].val.val_base = NULL;
-        self->nodes[i].val.val_len = 0;
-        counter--;
-        i++;
+    map_table_t *tables[2] = {self->table, self->old_table};
+    for (int t = 0; t < 2 && tables[t] != NULL; t++) {
+        uint32_t counter = num_slots(tables[t]);
+        uint32_t i = 0;
+        while(counter > 0) {
+            if (tables[t]->slots[i].entry != NULL) {
+                release_entry(tables[t]->slots[i].entry);
+            }
+            counter--;
+            i++;
+        }
+        free_table(tables[t]);
+    }
+    self->table = NULL;
+    self->old_table = NULL;
+
+    // nobody may read the map anymore, so the retired entries and table don't have to wait
+    for (size_t j = 0; j < self->num_retired; j++) {
+        release_entry(self->retired[j].entry);
+    }
+    free(self->retired);
+    self->retired = NULL;
+    self->num_retired = 0;
+    self->retired_cap = 0;
+    if (self->retired_table != NULL) {
+        free_table(self->retired_table);
+        self->retired_table = NULL;
     }
 
     self->size = 0;
+    self->bytes = 0;
     self->invalid = true;
-    free(self->nodes);
-    pthread_mutex_unlock(&self->write_lock);
+    unlock_map(self);
 
     return true;
 }
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include "hugepage.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static bool enabled;
+static huge_page_stats_t stats;
+
+static size_t huge_size(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+}
+
+static uint64_t *stats_of(page_sizes pages) {
+    if (pages == HUGETLB_PAGES) {
+        return &stats.hugetlb_bytes;
+    }
+    return pages == TRANSPARENT_HUGE_PAGES ? &stats.transparent_bytes : &stats.small_bytes;
+}
+
+void set_huge_pages(bool enable) {
+    __atomic_store_n(&enabled, enable, __ATOMIC_RELAXED);
+}
+
+bool huge_pages_enabled(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+/*
+ * This function mmap(2)s memory with MAP_HUGETLB, which succeeds only while
+ * the hugetlb pool has enough free pages for all of it. Otherwise it maps
+ * twice the size it needs, trims the mapping to a huge page boundary so
+ * every 2MB of it can be one page, and asks for transparent huge pages with
+ * madvise(2). Those are only a request, the kernel falls back to 4K pages
+ * when it can't find contiguous memory.
+ *
+ * @param size The number of bytes needed.
+ * @param pages Set to what backs the memory.
+ *
+ * @return The memory, aligned to HUGE_PAGE_SIZE.
+ *
+ * Error case: If size is 0 or pages is NULL, set errno to EINVAL and return NULL.
+ * Error case: If mmap(2) is unsuccessful, return NULL.
+ */
+void *huge_alloc(size_t size, page_sizes *pages) {
+    if (size == 0 || pages == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size = huge_size(size);
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+        *pages = HUGETLB_PAGES;
+    } else {
+        debug("no hugetlb pages for %zu bytes: %s", size, strerror(errno));
+        char *mapping = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return NULL;
+        }
+        char *aligned = (char *) huge_size((uintptr_t) mapping);
+        if (aligned > mapping) {
+            munmap(mapping, aligned - mapping);
+        }
+        munmap(aligned + size, mapping + HUGE_PAGE_SIZE - aligned);
+        memory = aligned;
+        *pages = madvise(memory, size, MADV_HUGEPAGE) == 0 ? TRANSPARENT_HUGE_PAGES : SMALL_PAGES;
+    }
+
+    __atomic_add_fetch(stats_of(*pages), size, __ATOMIC_RELAXED);
+    return memory;
+}
+
+void huge_free(void *ptr, size_t size, page_sizes pages) {
+    if (ptr == NULL) {
+        return;
+    }
+    size = huge_size(size);
+    munmap(ptr, size);
+    __atomic_sub_fetch(stats_of(pages), size, __ATOMIC_RELAXED);
+}
+
+huge_page_stats_t huge_page_stats(void) {
+    huge_page_stats_t current = {
+        .hugetlb_bytes = __atomic_load_n(&stats.hugetlb_bytes, __ATOMIC_RELAXED),
+        .transparent_bytes = __atomic_load_n(&stats.transparent_bytes, __ATOMIC_RELAXED),
+        .small_bytes = __atomic_load_n(&stats.small_bytes, __ATOMIC_RELAXED),
+    };
+    return current;
+}
+
+/*
+ * Sums the AnonHugePages of the process, from the one line of
+ * /proc/self/smaps_rollup or, on kernels without it, from every mapping in
+ * /proc/self/smaps. Unless the kernel puts all anonymous memory on
+ * transparent huge pages, only the ranges huge_alloc() asked for get them.
+ * The kernel walks the page tables of the whole process to answer, so this
+ * is meant for an occasional report, not for every request.
+ *
+ * @return The bytes on transparent huge pages.
+ */
+uint64_t transparent_huge_page_bytes(void) {
+    FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (smaps == NULL && (smaps = fopen("/proc/self/smaps", "r")) == NULL) {
+        return 0;
+    }
+    char line[256];
+    uint64_t total_kb = 0;
+    unsigned long kb;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            total_kb += kb;
+        }
+    }
+    fclose(smaps);
+    return total_kb * 1024;
+}
+
+/*
+ * Reads HugePages_Free from /proc/meminfo.
+ *
+ * @return The number of free pages of the default huge page size.
+ */
+long free_hugetlb_pages(void) {
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo == NULL) {
+        return 0;
+    }
+    char line[128];
+    long free_pages = 0;
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+        if (sscanf(line, "HugePages_Free: %ld", &free_pages) == 1) {
+            break;
+        }
+    }
+    fclose(meminfo);
+    return free_pages;
+}
+
+/*
+ * Reads the transparent huge page mode, in which the selected one is in brackets.
+ *
+ * @return true unless the mode is [never] or the kernel has no transparent huge pages.
+ */
+bool transparent_huge_pages_available(void) {
+    FILE *mode = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (mode == NULL) {
+        return false;
+    }
+    char line[128] = "";
+    bool available = fgets(line, sizeof(line), mode) != NULL && strstr(line, "[never]") == NULL;
+    fclose(mode);
+    return available;
+}
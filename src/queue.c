@@ -1,40 +1,109 @@
 #include "queue.h"
 #include "errno.h"
 #include "debug.h"
+
+#include <limits.h>
+#include <sched.h>
+#include <string.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void futex_wait(uint32_t *word, uint32_t expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word, int waiters) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, waiters, NULL, NULL, 0);
+}
+
 /*
- * This function will calloc(3) a new instance of queue_t and
- *    initilize all locks and semaphores in the queue_t struct.
+ * This function will aligned_alloc(3) a new instance of queue_t and
+ *    number its cells so that producers can fill them in order.
  *
  *
  * @return A valid pointer to an initilized queue_t instance or NULL.
  *
- * Error Case: If calloc(3) returns NULL or if the locks fail to initilize, return NULL.
+ * Error Case: If aligned_alloc(3) returns NULL, return NULL.
  */
 queue_t *create_queue(void) {
-    struct queue_t *queue = (struct queue_t*) calloc(1, sizeof(queue_t));
+    queue_t *queue = aligned_alloc(QUEUE_CACHE_LINE_SIZE, sizeof(queue_t));
     if (queue == NULL) {
         return NULL;
     }
-    int sem_return_code = sem_init(&((*queue).items), 0, 0);
-    if (sem_return_code != 0) {
-        return NULL;
+    memset(queue, 0, sizeof(queue_t));
+    for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
+        queue->cells[i].sequence = i;
     }
 
-    int mutex = pthread_mutex_init(&queue->lock, NULL);
+    return queue;
+}
+
+/*
+ * Claims up to max consecutive cells starting at the position in counter, with
+ * one compare-and-swap. A cell is ready when its sequence is its position plus
+ * offset: 0 for a free cell a producer may fill, 1 for a full one a consumer may take.
+ *
+ * @param first Set to the position of the first claimed cell.
+ * @return The number of claimed cells, or 0 if the first cell wasn't ready.
+ */
+static size_t claim_cells(queue_t *self, size_t *counter, size_t offset, size_t max, size_t *first) {
+    size_t pos = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (1) {
+        queue_cell_t *cell = &self->cells[pos & (QUEUE_CAPACITY - 1)];
+        intptr_t diff = (intptr_t) __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (intptr_t) (pos + offset);
+        if (diff < 0) {
+            // the other side of the last lap hasn't finished with the cell
+            return 0;
+        }
+        if (diff > 0) {
+            // another thread on this side claimed it first
+            pos = __atomic_load_n(counter, __ATOMIC_RELAXED);
+            continue;
+        }
 
-    if (mutex != 0) {
-        return NULL;
+        // nobody else can claim the ready cells behind it before our counter moves past them
+        size_t ready = 1;
+        while (ready < max && __atomic_load_n(&self->cells[(pos + ready) & (QUEUE_CAPACITY - 1)].sequence, __ATOMIC_ACQUIRE) ==
+                              pos + ready + offset) {
+            ready++;
+        }
+        if (__atomic_compare_exchange_n(counter, &pos, pos + ready, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *first = pos;
+            return ready;
+        }
     }
+}
 
-    return queue;
+/*
+ * Takes up to max items that are ready, without waiting.
+ *
+ * @return The number of items written to items, 0 if the queue was empty.
+ */
+static size_t try_dequeue_batch(queue_t *self, void **items, size_t max) {
+    size_t first;
+    size_t taken = claim_cells(self, &self->dequeue_pos, 1, max, &first);
+    for (size_t i = 0; i < taken; i++) {
+        queue_cell_t *cell = &self->cells[(first + i) & (QUEUE_CAPACITY - 1)];
+        items[i] = cell->item;
+        // hand the cell to the producer one lap ahead
+        __atomic_store_n(&cell->sequence, first + i + QUEUE_CAPACITY, __ATOMIC_RELEASE);
+    }
+    return taken;
+}
+
+static void *try_dequeue(queue_t *self) {
+    void *item;
+    return try_dequeue_batch(self, &item, 1) == 1 ? item : NULL;
 }
 
 /*
- *  Free's the space allocated for the queue
+ *  Calls destroy_function on every item left in the queue and wakes the
+ *  consumers that are waiting for one, which return NULL from then on.
  *
  *  @param self The pointer to the queue
  *  @param destroy_function will be called on all remaining items
- *                           in the queue and free the queue_node_t instances.
+ *                           in the queue.
  *  @return true if the invalidation was successful
  *          false otherwise
  *
@@ -45,78 +114,328 @@ bool invalidate_queue(queue_t *self, item_destructor_f destroy_function) {
         errno = EINVAL;
         return false;
     }
-    pthread_mutex_lock(&self->lock);
-    queue_node_t *currentNode = (self->front);
-    while(currentNode != NULL) {
-        destroy_function(currentNode);
-        free(currentNode);
-        currentNode = currentNode->next;
-    }
-    self->invalid = true;
-    self->front = NULL;
-    self->rear = NULL;
-    pthread_mutex_unlock(&self->lock);
+    __atomic_store_n(&self->invalid, true, __ATOMIC_SEQ_CST);
+    void *item;
+    while ((item = try_dequeue(self)) != NULL) {
+        destroy_function(item);
+    }
+    __atomic_add_fetch(&self->wakeups, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&self->wakeups, INT_MAX);
     return true;
 }
 
 /*
- * This function will calloc(3) a new queue_node_t instance to add to the queue.
+ * This function will fill the next free cells of the ring with items, claiming
+ * as many at once as are free. If the ring is full it yields until a consumer
+ * frees a cell. Sleeping consumers are woken with a single futex call.
  *
  * @param self A pointer to the queue.
- * @param item A pointer to an item to add to the queue
+ * @param items The pointers to add to the queue, in order.
+ * @param num_items The number of items.
  *
  * @return true if the operation was successful, false otherwise
  * Eror Case: If any parameters are inalid, set errno to EINVAL and return false.
  */
-bool enqueue(queue_t *self, void *item) {
-    if (item == NULL || self == NULL) {
+bool enqueue_batch(queue_t *self, void **items, size_t num_items) {
+    if (self == NULL || (items == NULL && num_items > 0) || __atomic_load_n(&self->invalid, __ATOMIC_RELAXED)) {
         errno = EINVAL;
         return false;
     }
-    pthread_mutex_lock(&self->lock);
-    struct queue_node_t *qnode = (struct queue_node_t*) calloc(1, sizeof(queue_node_t));
+    for (size_t i = 0; i < num_items; i++) {
+        if (items[i] == NULL) {
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    size_t added = 0;
+    while (added < num_items) {
+        size_t first;
+        size_t claimed = claim_cells(self, &self->enqueue_pos, 0, num_items - added, &first);
+        if (claimed == 0) {
+            // the ring is full until a consumer takes an item
+            sched_yield();
+            continue;
+        }
+        for (size_t i = 0; i < claimed; i++) {
+            queue_cell_t *cell = &self->cells[(first + i) & (QUEUE_CAPACITY - 1)];
+            cell->item = items[added + i];
+            __atomic_store_n(&cell->sequence, first + i + 1, __ATOMIC_RELEASE);
+        }
+        added += claimed;
+    }
 
-    qnode->item = item;
-    qnode->next = NULL;
-    if(self->front == NULL) {
-        self->front = qnode;
-        self->rear = qnode;
-    } else {
-        self->rear->next = qnode;
-        self->rear = qnode;
+    // pairs with the fence in dequeue_batch, so either a sleeper is seen or it sees the items
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (num_items > 0 && __atomic_load_n(&self->sleepers, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(&self->wakeups, 1, __ATOMIC_RELAXED);
+        futex_wake(&self->wakeups, num_items < INT_MAX ? (int) num_items : INT_MAX);
     }
-    sem_post(&self->items);
-    pthread_mutex_unlock(&self->lock);
 
     return true;
 }
 
 /*
- * Removes the item at the front of the queue pointed to by self.
- * This function will free(3) the queue_node_t instance being removed from the queue.
- * This function will block until an item is avalible to dequeue.
+ * Adds a single item, as enqueue_batch() would.
+ *
+ * @param self A pointer to the queue.
+ * @param item A pointer to an item to add to the queue
+ *
+ * @return true if the operation was successful, false otherwise
+ * Eror Case: If any parameters are inalid, set errno to EINVAL and return false.
+ */
+bool enqueue(queue_t *self, void *item) {
+    if (item == NULL) {
+        errno = EINVAL;
+        return false;
+    }
+    return enqueue_batch(self, &item, 1);
+}
+
+/*
+ * Removes up to max items from the front of the queue pointed to by self,
+ * taking every item that is ready at once.
+ * This function will block on a futex until an item is avalible to dequeue.
+ *
+ * @param self A pointer to the queue.
+ * @param items Filled with the items, in order.
+ * @param max The most items to take.
+ *
+ * @return The number of items taken, at least 1.
+ * Eror Case: If any parameters are inalid or the queue was invalidated,
+ *            set errno to EINVAL and return 0.
+ */
+size_t dequeue_batch(queue_t *self, void **items, size_t max) {
+    while (self != NULL && items != NULL && max > 0 && !__atomic_load_n(&self->invalid, __ATOMIC_ACQUIRE)) {
+        size_t taken = try_dequeue_batch(self, items, max);
+        if (taken > 0) {
+            return taken;
+        }
+
+        // announce the sleep before looking again, so a producer that misses the item wakes us
+        uint32_t wakeups = __atomic_load_n(&self->wakeups, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&self->sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        taken = try_dequeue_batch(self, items, max);
+        if (taken == 0 && !__atomic_load_n(&self->invalid, __ATOMIC_ACQUIRE)) {
+            futex_wait(&self->wakeups, wakeups);
+        }
+        __atomic_sub_fetch(&self->sleepers, 1, __ATOMIC_RELAXED);
+        if (taken > 0) {
+            return taken;
+        }
+    }
+    errno = EINVAL;
+    return 0;
+}
+
+/*
+ * Removes the item at the front of the queue pointed to by self, as dequeue_batch() would.
  *
  * @param self A pointer to the queue.
  *
  * @return A pointer to the item stored at the front of the queue.
- * Eror Case: If any parameters are inalid, set errno to EINVAL and return NULL.
+ * Eror Case: If any parameters are inalid or the queue was invalidated,
+ *            set errno to EINVAL and return NULL.
  */
 void *dequeue(queue_t *self) {
-    if(self == NULL || self->invalid == 1) {
+    void *item;
+    return dequeue_batch(self, &item, 1) == 1 ? item : NULL;
+}
+
+/*
+ * This function will calloc(3) a new instance of scheduler_t and
+ *    create a queue for every worker.
+ *
+ * @param num_workers The number of workers taking items.
+ *
+ * @return A valid pointer to an initilized scheduler_t instance or NULL.
+ *
+ * Error Case: If num_workers is 0, set errno to EINVAL and return NULL.
+ *             If an allocation fails, return NULL.
+ */
+scheduler_t *create_scheduler(uint32_t num_workers) {
+    if (num_workers == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    scheduler_t *scheduler = aligned_alloc(QUEUE_CACHE_LINE_SIZE, sizeof(scheduler_t));
+    if (scheduler == NULL) {
+        return NULL;
+    }
+    memset(scheduler, 0, sizeof(scheduler_t));
+    scheduler->num_workers = num_workers;
+    scheduler->queues = calloc(num_workers, sizeof(queue_t *));
+    if (scheduler->queues == NULL) {
+        free(scheduler);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < num_workers; i++) {
+        scheduler->queues[i] = create_queue();
+        if (scheduler->queues[i] == NULL) {
+            for (uint32_t j = 0; j < i; j++) {
+                free(scheduler->queues[j]);
+            }
+            free(scheduler->queues);
+            free(scheduler);
+            return NULL;
+        }
+    }
+
+    return scheduler;
+}
+
+/*
+ *  Invalidates every queue of the scheduler, which calls destroy_function on
+ *  the items left in them, and wakes the workers that are waiting for one.
+ *
+ *  @param self The pointer to the scheduler
+ *  @param destroy_function will be called on all remaining items.
+ *  @return true if the invalidation was successful
+ *          false otherwise
+ *
+ *  @Error Case: if any parameters are invalid, set errno to EINVAL and return false
+ */
+bool invalidate_scheduler(scheduler_t *self, item_destructor_f destroy_function) {
+    if (self == NULL || destroy_function == NULL) {
+        errno = EINVAL;
+        return false;
+    }
+    __atomic_store_n(&self->invalid, true, __ATOMIC_SEQ_CST);
+    for (uint32_t i = 0; i < self->num_workers; i++) {
+        invalidate_queue(self->queues[i], destroy_function);
+    }
+    __atomic_add_fetch(&self->wakeups, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&self->wakeups, INT_MAX);
+    return true;
+}
+
+/*
+ * This function will deal items to the queues of the next workers in turn,
+ * adding all items of one worker at once, and wake as many idle workers as
+ * there are items with a single futex call. An idle worker may steal an
+ * item dealt to a busy one.
+ *
+ * @param self A pointer to the scheduler.
+ * @param items The pointers to hand to workers.
+ * @param num_items The number of items.
+ *
+ * @return true if the operation was successful, false otherwise
+ * Eror Case: If any parameters are inalid, set errno to EINVAL and return false.
+ */
+bool schedule_batch(scheduler_t *self, void **items, size_t num_items) {
+    if (self == NULL || (items == NULL && num_items > 0)) {
+        errno = EINVAL;
+        return false;
+    }
+    uint32_t start = __atomic_fetch_add(&self->next_worker, (uint32_t) num_items, __ATOMIC_RELAXED);
+    size_t num_queues = num_items < self->num_workers ? num_items : self->num_workers;
+    for (size_t offset = 0; offset < num_queues; offset++) {
+        queue_t *queue = self->queues[(start + offset) % self->num_workers];
+        // the items of one worker are every num_workers-th item, gathered a chunk at a time
+        void *dealt[QUEUE_BATCH_SIZE];
+        size_t num_dealt = 0;
+        for (size_t i = offset; i < num_items; i += self->num_workers) {
+            dealt[num_dealt++] = items[i];
+            if (num_dealt == QUEUE_BATCH_SIZE || i + self->num_workers >= num_items) {
+                if (!enqueue_batch(queue, dealt, num_dealt)) {
+                    return false;
+                }
+                num_dealt = 0;
+            }
+        }
+    }
+
+    // pairs with the fence in next_items, so either a sleeper is seen or it sees the items
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (num_items > 0 && __atomic_load_n(&self->sleepers, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(&self->wakeups, 1, __ATOMIC_RELAXED);
+        futex_wake(&self->wakeups, num_items < INT_MAX ? (int) num_items : INT_MAX);
+    }
+    return true;
+}
+
+/*
+ * Hands a single item to the next worker in turn, as schedule_batch() would.
+ *
+ * @param self A pointer to the scheduler.
+ * @param item A pointer to an item to hand to a worker.
+ *
+ * @return true if the operation was successful, false otherwise
+ * Eror Case: If any parameters are inalid, set errno to EINVAL and return false.
+ */
+bool schedule(scheduler_t *self, void *item) {
+    if (item == NULL) {
         errno = EINVAL;
         return false;
     }
+    return schedule_batch(self, &item, 1);
+}
+
+/*
+ * Takes items from the worker's own queue, or else from the first peer
+ * that has some, starting with the next worker so thieves spread out.
+ *
+ * @return The number of items taken, 0 if every queue was empty.
+ */
+static size_t take_items(scheduler_t *self, uint32_t worker, void **items, size_t max) {
+    size_t taken = try_dequeue_batch(self->queues[worker], items, max);
+    for (uint32_t i = 1; taken == 0 && i < self->num_workers; i++) {
+        taken = try_dequeue_batch(self->queues[(worker + i) % self->num_workers], items, max);
+    }
+    return taken;
+}
 
-    sem_wait(&self->items);
-    pthread_mutex_lock(&self->lock);
-    queue_node_t *frontNode = self->front;
-    self->front = self->front->next;
-    void *dequeueItem = frontNode->item;
+/*
+ * Returns up to max items for a worker, preferring its own queue and stealing
+ * from its peers when that is empty. This function will block on a futex
+ * until an item is avalible in any queue.
+ *
+ * @param self A pointer to the scheduler.
+ * @param worker The index of the worker asking.
+ * @param items Filled with the items.
+ * @param max The most items to take.
+ *
+ * @return The number of items taken, at least 1.
+ * Eror Case: If any parameters are inalid or the scheduler was invalidated,
+ *            set errno to EINVAL and return 0.
+ */
+size_t next_items(scheduler_t *self, uint32_t worker, void **items, size_t max) {
+    while (self != NULL && worker < self->num_workers && items != NULL && max > 0 &&
+           !__atomic_load_n(&self->invalid, __ATOMIC_ACQUIRE)) {
+        size_t taken = take_items(self, worker, items, max);
+        if (taken > 0) {
+            return taken;
+        }
 
-    if(self->front == NULL) {
-        self->rear = NULL;
+        // announce the sleep before looking again, so a scheduler that misses the item wakes us
+        uint32_t wakeups = __atomic_load_n(&self->wakeups, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&self->sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        taken = take_items(self, worker, items, max);
+        if (taken == 0 && !__atomic_load_n(&self->invalid, __ATOMIC_ACQUIRE)) {
+            futex_wait(&self->wakeups, wakeups);
+        }
+        __atomic_sub_fetch(&self->sleepers, 1, __ATOMIC_RELAXED);
+        if (taken > 0) {
+            return taken;
+        }
     }
-    free(frontNode);
-    pthread_mutex_unlock(&self->lock);
-    return dequeueItem;
+    errno = EINVAL;
+    return 0;
+}
+
+/*
+ * Returns the next item for a worker, as next_items() would.
+ *
+ * @param self A pointer to the scheduler.
+ * @param worker The index of the worker asking.
+ *
+ * @return A pointer to the item.
+ * Eror Case: If any parameters are inalid or the scheduler was invalidated,
+ *            set errno to EINVAL and return NULL.
+ */
+void *next_item(scheduler_t *self, uint32_t worker) {
+    void *item;
+    return next_items(self, worker, &item, 1) == 1 ? item : NULL;
 }
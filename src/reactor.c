@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "connection.h"
+#include "debug.h"
+#include "slab.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define MAX_PENDING_OUTPUT (1 << 20)
+
+typedef struct reactor_t {
+    int epoll_fd;
+    int listen_fd;
+    int idle_timeout;
+    conn_list_t idle;
+    /* The partition only this loop serves and expires, or NULL if the loops share server_map */
+    sharded_map_t *map;
+    pthread_t thread;
+} reactor_t;
+
+static void close_conn(reactor_t *reactor, conn_t *conn) {
+    unlink_conn(&reactor->idle, conn);
+    close(conn->fd);
+    destroy_conn(conn);
+}
+
+/*
+ * Accepts every pending connection and registers it for edge-triggered events.
+ */
+static void accept_conns(reactor_t *reactor) {
+    while (1) {
+        int fd = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                debug("Error Initiating connection");
+            }
+            return;
+        }
+
+        conn_t *conn = create_conn(fd);
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            destroy_conn(conn);
+            continue;
+        }
+        touch_conn(&reactor->idle, conn);
+    }
+}
+
+/*
+ * Reads until the socket would block, running every complete request as it arrives.
+ * Stops early once enough responses are waiting to be sent.
+ *
+ * @param drained Set to true if the socket has no more bytes to read right now.
+ * @return false if the connection failed and must be closed.
+ */
+static bool read_conn(conn_t *conn, bool *drained) {
+    *drained = false;
+    while (!conn->closing && conn_pending_output(conn) < MAX_PENDING_OUTPUT) {
+        size_t space = conn_input_space(conn);
+        if (space == 0) {
+            return false;
+        }
+
+        ssize_t x = read(conn->fd, conn->in + conn->in_end, space);
+        if (x < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *drained = true;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (x == 0) {
+            // the client is done sending, answer what it already sent and hang up
+            conn->closing = true;
+            *drained = true;
+            return true;
+        }
+
+        conn->in_end += x;
+        if (!conn_process(conn)) {
+            return false;
+        }
+    }
+    *drained = conn->closing;
+    return true;
+}
+
+/*
+ * Writes queued responses until they are all sent or the socket would block.
+ *
+ * @return false if the connection failed and must be closed.
+ */
+static bool flush_conn(conn_t *conn) {
+    while (conn_pending_output(conn) > 0) {
+        ssize_t x = send(conn->fd, conn->out + conn->out_start, conn_pending_output(conn), MSG_NOSIGNAL);
+        if (x < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn_consume_output(conn, x);
+    }
+    return true;
+}
+
+static void service_conn(reactor_t *reactor, conn_t *conn) {
+    bool ok = true;
+    bool drained = false;
+
+    // alternate between reading and flushing so a client that pipelines requests
+    // faster than it reads responses can't grow the output buffer without bound
+    while (ok) {
+        ok = read_conn(conn, &drained) && flush_conn(conn);
+        if (drained || conn_pending_output(conn) >= MAX_PENDING_OUTPUT) {
+            break;
+        }
+    }
+
+    if (!ok || (conn->closing && conn_pending_output(conn) == 0)) {
+        close_conn(reactor, conn);
+    } else {
+        touch_conn(&reactor->idle, conn);
+    }
+}
+
+/*
+ * Closes the connections that have been idle for longer than the keep-alive timeout.
+ */
+static void expire_idle_conns(reactor_t *reactor) {
+    time_t now = time(NULL);
+    while (reactor->idle.head != NULL && now - reactor->idle.head->last_active >= reactor->idle_timeout) {
+        debug("Closing idle connection %d", reactor->idle.head->fd);
+        close_conn(reactor, reactor->idle.head);
+    }
+}
+
+static void *reactor_loop(void *arg) {
+    reactor_t *reactor = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = reactor->idle_timeout > 0 ? 1000 : -1;
+    uint64_t next_expiry = 0;
+    if (reactor->map != NULL) {
+        // nobody else expires the partition, so wake up as often as the expiry thread would
+        set_request_map(reactor->map);
+        // and its pairs are kept in size classes that no other loop touches
+        slab_use_cache(slab_create_cache());
+        timeout = EXPIRY_INTERVAL_MS;
+        next_expiry = map_clock() + EXPIRY_INTERVAL_MS;
+    }
+
+    while (1) {
+        int n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno != EINTR) {
+                debug("epoll_wait failed");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_conns(reactor);
+            } else {
+                service_conn(reactor, events[i].data.ptr);
+            }
+        }
+
+        if (reactor->idle_timeout > 0) {
+            expire_idle_conns(reactor);
+        }
+        if (reactor->map != NULL && map_clock() >= next_expiry) {
+            sharded_expire(reactor->map);
+            next_expiry = map_clock() + EXPIRY_INTERVAL_MS;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Registers the listening socket of a loop and starts its thread.
+ *
+ * @param events The events to wait for on the listening socket.
+ * @param cpu The CPU the loop runs on, or -1.
+ */
+static void start_reactor(reactor_t *reactor, int listen_fd, int idle_timeout, uint32_t events, int cpu) {
+    reactor->listen_fd = listen_fd;
+    reactor->idle_timeout = idle_timeout;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event = {.events = events, .data.ptr = NULL};
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &event) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (create_pinned_thread(&reactor->thread, cpu, reactor_loop, reactor) != 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Starts one event loop per worker and waits on them.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @param listenfds The listening sockets, each shared by every num_listeners-th event loop.
+ * @param num_listeners The number of listening sockets.
+ */
+void run_reactor(args_struct *args, int *listenfds, int num_listeners) {
+    for (int i = 0; i < num_listeners; i++) {
+        set_nonblocking(listenfds[i]);
+    }
+
+    reactor_t *reactors = calloc(args->NUM_WORKERS, sizeof(reactor_t));
+    if (reactors == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        // only one of the loops is woken for each incoming connection
+        start_reactor(&reactors[i], listenfds[i % num_listeners], args->KEEP_ALIVE, EPOLLIN | EPOLLEXCLUSIVE,
+                      worker_cpu(args, i));
+    }
+
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    free(reactors);
+}
+
+/*
+ * Starts one event loop per worker, each with a port and a partition of its
+ * own, and waits on them. Every loop owns a map with an equal share of
+ * MAX_ENTRIES and of the memory limit.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @param listenfds The listening socket of every loop, NUM_WORKERS of them.
+ */
+void run_cores(args_struct *args, int *listenfds) {
+    reactor_t *reactors = calloc(args->NUM_WORKERS, sizeof(reactor_t));
+    if (reactors == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    uint32_t capacity = args->MAX_ENTRIES / args->NUM_WORKERS > 0 ? args->MAX_ENTRIES / args->NUM_WORKERS : 1;
+    // a limit too small to split still has to be a limit
+    uint64_t max_memory = args->MAX_MEMORY / args->NUM_WORKERS;
+    if (args->MAX_MEMORY != 0 && max_memory == 0) {
+        max_memory = 1;
+    }
+
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        set_nonblocking(listenfds[i]);
+
+        // the loop is the only thread that ever touches its partition, so it needs no locks
+        reactors[i].map = create_server_map(args, capacity, 1, max_memory);
+        if (reactors[i].map == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        sharded_set_single_owner(reactors[i].map);
+        // and it sits next to the loop's CPU
+        int node = cpu_node(worker_cpu(args, i));
+        if (node >= 0) {
+            sharded_set_numa_nodes(reactors[i].map, &node, 1);
+        }
+        start_reactor(&reactors[i], listenfds[i], args->KEEP_ALIVE, EPOLLIN, worker_cpu(args, i));
+    }
+
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        pthread_join(reactors[i].thread, NULL);
+        invalidate_sharded_map(reactors[i].map);
+    }
+    free(reactors);
+}
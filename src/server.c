@@ -1,4 +1,7 @@
 #include "server.h"
+#include "reactor.h"
+#include "uring.h"
+#include "epoch.h"
 #include "debug.h"
 
 #include <getopt.h>
@@ -8,8 +11,54 @@
 #include <sys/socket.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include "csapp.h"
 
+/* The store every engine but `cores` serves */
+sharded_map_t *server_map;
+
+/* Seconds a persistent connection may sit idle, or 0 to close after every request */
+static int keep_alive_timeout;
+
+/* Set when the server shuts down, so the expiry thread stops touching the map */
+static bool stop_expiry;
+
+/* The partition the requests of this thread go to, when it owns one */
+static __thread sharded_map_t *request_map;
+
+/*
+ * Parses a number of bytes with an optional K, M or G suffix.
+ *
+ * @param arg The command line argument.
+ * @return The number of bytes, or 0 if arg is not a positive size.
+ */
+static uint64_t parse_bytes(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long bytes = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || arg[0] == '-') {
+        return 0;
+    }
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    } else if (*end != '\0') {
+        return 0;
+    }
+    if (shift != 0 && end[1] != '\0') {
+        return 0;
+    }
+    if (bytes > (UINT64_MAX >> shift)) {
+        return 0;
+    }
+    return (uint64_t) bytes << shift;
+}
+
 /*
  * Parses the arguments passed from the command line.
  *
@@ -18,23 +67,134 @@
  * @return A pointer to the parsed arguments.
  */
 args_struct *parse_args(int argc, char *argv[]) {
-    if (argc != 2 && argc != 4 && argc != 5) {
-        debug("Failed");
+    static struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"keep-alive", required_argument, NULL, 'k'},
+        {"engine", required_argument, NULL, 'e'},
+        {"listeners", required_argument, NULL, 'l'},
+        {"shards", required_argument, NULL, 's'},
+        {"probing", required_argument, NULL, 'p'},
+        {"hash", required_argument, NULL, 'H'},
+        {"ttl", required_argument, NULL, 't'},
+        {"max-memory", required_argument, NULL, 'm'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"huge-pages", no_argument, NULL, 'L'},
+        {NULL, 0, NULL, 0}
+    };
+
+    args_struct *args = calloc(1, sizeof(args_struct));
+    if (args == NULL) {
         USAGE(argv[0], EXIT_FAILURE);
     }
 
-    if(strcmp(argv[1], "-h") == 0) {
-        USAGE(argv[0], EXIT_SUCCESS);
+    args->LISTENERS = 1;
+    args->HASH_FUNCTION = wyhash_hash;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hk:e:l:s:p:H:t:m:c:L", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                free(args);
+                USAGE(argv[0], EXIT_SUCCESS);
+            case 'k':
+                args->KEEP_ALIVE = atoi(optarg);
+                if (args->KEEP_ALIVE < 0) {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "threads") == 0) {
+                    args->ENGINE = THREADS_ENGINE;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    args->ENGINE = EPOLL_ENGINE;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    args->ENGINE = URING_ENGINE;
+                } else if (strcmp(optarg, "cores") == 0) {
+                    args->ENGINE = CORES_ENGINE;
+                } else {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                args->LISTENERS = atoi(optarg);
+                if (args->LISTENERS <= 0) {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                args->SHARDS = atoi(optarg);
+                if (args->SHARDS <= 0) {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "groups") == 0) {
+                    args->PROBING = GROUP_PROBING;
+                } else if (strcmp(optarg, "robin-hood") == 0) {
+                    args->PROBING = ROBIN_HOOD_PROBING;
+                } else {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'H':
+                args->HASH_FUNCTION = hash_function_by_name(optarg);
+                if (args->HASH_FUNCTION == NULL) {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                args->DEFAULT_TTL = atoi(optarg);
+                // TTLs are kept in milliseconds
+                if (args->DEFAULT_TTL < 0 || args->DEFAULT_TTL > INT32_MAX / 1000) {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                args->MAX_MEMORY = parse_bytes(optarg);
+                if (args->MAX_MEMORY == 0) {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                args->NUM_CPUS = parse_cpu_list(optarg, args->CPUS, MAX_CPUS);
+                if (args->NUM_CPUS < 0) {
+                    free(args);
+                    USAGE(argv[0], EXIT_FAILURE);
+                }
+                for (int i = 0; i < args->NUM_CPUS; i++) {
+                    if (!cpu_allowed(args->CPUS[i])) {
+                        fprintf(stderr, "CPU %d is not available\n", args->CPUS[i]);
+                        free(args);
+                        USAGE(argv[0], EXIT_FAILURE);
+                    }
+                }
+                break;
+            case 'L':
+                args->HUGE_PAGES = true;
+                break;
+            default:
+                free(args);
+                USAGE(argv[0], EXIT_FAILURE);
+        }
     }
 
-    args_struct *args = malloc(sizeof(args_struct));
-    if (args == NULL) {
+    if (argc - optind != 3) {
+        debug("Failed");
+        free(args);
         USAGE(argv[0], EXIT_FAILURE);
     }
 
-    args->NUM_WORKERS = atoi(argv[1]);
-    args->PORT_NUMBER = argv[2];
-    args->MAX_ENTRIES = atoi(argv[3]);
+    args->NUM_WORKERS = atoi(argv[optind]);
+    args->PORT_NUMBER = argv[optind + 1];
+    args->MAX_ENTRIES = atoi(argv[optind + 2]);
 
     if (args->NUM_WORKERS <= 0 || args->MAX_ENTRIES <= 0) {
         exit(EXIT_FAILURE);
@@ -43,69 +203,383 @@ args_struct *parse_args(int argc, char *argv[]) {
     return args;
 }
 
+/*
+ * Picks how many shards the map is split into. Unless it was given on the
+ * command line, there are a few shards per worker so that workers rarely
+ * meet on the same lock, but never so many that a shard holds fewer than
+ * MIN_SHARD_ENTRIES entries and fills up long before the whole map does.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @return The number of shards.
+ */
+static uint32_t map_shards(args_struct *args) {
+    if (args->SHARDS > 0) {
+        return args->SHARDS;
+    }
+    uint32_t shards = 1;
+    while (shards < 4 * (uint32_t) args->NUM_WORKERS && shards * 2 * MIN_SHARD_ENTRIES <= (uint32_t) args->MAX_ENTRIES) {
+        shards *= 2;
+    }
+    return shards;
+}
+
+/*
+ * Makes the requests the calling thread executes from now on use map instead
+ * of server_map, so a thread can serve a partition that only it touches.
+ *
+ * @param map The map the thread owns.
+ */
+void set_request_map(sharded_map_t *map) {
+    request_map = map;
+}
+
+/*
+ * @return The map the calling thread executes requests against.
+ */
+static sharded_map_t *current_map(void) {
+    return request_map != NULL ? request_map : server_map;
+}
+
+/*
+ * @param args A pointer to the arguments passed from the command line.
+ * @param worker The index of a worker, event loop or ring.
+ * @return The CPU the worker is pinned to, or -1 if it isn't pinned.
+ */
+int worker_cpu(args_struct *args, int worker) {
+    return args->NUM_CPUS > 0 ? args->CPUS[worker % args->NUM_CPUS] : -1;
+}
+
+/*
+ * Spreads the shards of the shared map over the nodes of the workers' CPUs.
+ * Any worker may touch any shard, so no shard is local to all of them, but
+ * the node array no longer piles up on the node that happened to touch it
+ * first and every socket serves its share of the misses.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ */
+static void place_server_map(args_struct *args) {
+    if (args->NUM_CPUS == 0) {
+        return;
+    }
+    int *nodes = calloc(args->NUM_WORKERS, sizeof(int));
+    if (nodes == NULL) {
+        return;
+    }
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        nodes[i] = cpu_node(worker_cpu(args, i));
+    }
+    sharded_set_numa_nodes(server_map, nodes, args->NUM_WORKERS);
+    free(nodes);
+}
+
+/*
+ * Prints where the workers run and where the data store lives.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ */
+static void report_topology(args_struct *args) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nodes = num_numa_nodes();
+    fprintf(stderr, "%ld CPU%s on %d NUMA node%s\n", cpus, cpus == 1 ? "" : "s", nodes, nodes == 1 ? "" : "s");
+    if (args->NUM_CPUS == 0) {
+        fprintf(stderr, "workers are not pinned, the data store is placed where it is first touched\n");
+        return;
+    }
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        int cpu = worker_cpu(args, i);
+        fprintf(stderr, "worker %d: CPU %d, node %d\n", i, cpu, cpu_node(cpu));
+    }
+    if (server_map == NULL) {
+        fprintf(stderr, "every worker's partition is on its own node\n");
+        return;
+    }
+    for (uint32_t s = 0; s < server_map->num_shards; s++) {
+        fprintf(stderr, "shard %u: node %d\n", s, server_map->shards[s]->numa_node);
+    }
+}
+
+/*
+ * Turns huge pages on and prints what the kernel has to give. Whether the
+ * store actually gets them is only known once it grows, STATS reports it.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ */
+static void enable_huge_pages(args_struct *args) {
+    if (!args->HUGE_PAGES) {
+        return;
+    }
+    set_huge_pages(true);
+    long free_pages = free_hugetlb_pages();
+    bool transparent = transparent_huge_pages_available();
+    if (free_pages > 0) {
+        fprintf(stderr, "huge pages: %ld free in the hugetlb pool%s\n", free_pages,
+                transparent ? ", transparent huge pages once they run out" : "");
+    } else if (transparent) {
+        fprintf(stderr, "huge pages: the hugetlb pool is empty, asking for transparent huge pages instead\n");
+    } else {
+        fprintf(stderr, "huge pages: the hugetlb pool is empty and transparent huge pages are off, using 4K pages\n");
+    }
+}
+
+/*
+ * Creates a map configured the way the command line asks for.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @param capacity The number of elements the map can hold.
+ * @param num_shards The number of shards the map is split into.
+ * @param max_memory The most bytes the pairs may be charged, or 0 for no limit.
+ * @return The map, or NULL if it could not be created.
+ */
+sharded_map_t *create_server_map(args_struct *args, uint32_t capacity, uint32_t num_shards, uint64_t max_memory) {
+    sharded_map_t *map = create_sharded_map(capacity, num_shards, args->HASH_FUNCTION, destroy_hash_function, args->PROBING);
+    if (map == NULL) {
+        return NULL;
+    }
+    sharded_set_default_ttl(map, (uint32_t) args->DEFAULT_TTL * 1000);
+    if (max_memory != 0) {
+        sharded_set_memory_limit(map, max_memory, pair_size_function);
+    }
+    return map;
+}
+
 /*
  * Starts the server
  *
  * @param args A pointer to the arguemnts passed from the command line.
  */
 void start_server(args_struct *args) {
-    server_hashmap = create_map(args->MAX_ENTRIES, jenkins_one_at_a_time_hash, destroy_hash_function);
-    server_queue = create_queue();
+    random_seed_hash_functions();
+    keep_alive_timeout = args->KEEP_ALIVE;
+    enable_huge_pages(args);
+    if (args->ENGINE == CORES_ENGINE) {
+        // every event loop owns its port and partition, there is no shared map and no expiry thread
+        report_topology(args);
+        int *listenfds = calloc(args->NUM_WORKERS, sizeof(int));
+        if (listenfds == NULL) {
+            free(args);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < args->NUM_WORKERS; i++) {
+            char port[16];
+            snprintf(port, sizeof(port), "%d", atoi(args->PORT_NUMBER) + i);
+            listenfds[i] = open_listenfd(port);
+            if (listenfds[i] < 0) {
+                free(args);
+                exit(EXIT_FAILURE);
+            }
+        }
+        run_cores(args, listenfds);
+        free(listenfds);
+        free(args);
+        exit(EXIT_SUCCESS);
+    }
 
-    pthread_t *threads = calloc(args->NUM_WORKERS, sizeof(pthread_t));
+    server_map = create_server_map(args, args->MAX_ENTRIES, map_shards(args), args->MAX_MEMORY);
+    if (server_map == NULL) {
+        free(args);
+        exit(EXIT_FAILURE);
+    }
+    place_server_map(args);
+    report_topology(args);
+
+    pthread_t expiry_thread;
+    if (pthread_create(&expiry_thread, NULL, expiry_function, NULL) != 0) {
+        free(args);
+        exit(EXIT_FAILURE);
+    }
+
+    // every listener group needs at least one worker to drain its queue
+    int num_listeners = args->LISTENERS;
+    if (args->ENGINE == THREADS_ENGINE && num_listeners > args->NUM_WORKERS) {
+        num_listeners = args->NUM_WORKERS;
+    }
+
+    int *listenfds = calloc(num_listeners, sizeof(int));
+    if (listenfds == NULL) {
+        free(args);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_listeners; i++) {
+        listenfds[i] = num_listeners > 1 ? open_reuseport_listenfd(args->PORT_NUMBER) : open_listenfd(args->PORT_NUMBER);
+        if (listenfds[i] < 0) {
+            free(args);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (args->ENGINE == EPOLL_ENGINE) {
+        run_reactor(args, listenfds, num_listeners);
+    } else if (args->ENGINE == URING_ENGINE && !run_uring(args, listenfds, num_listeners)) {
+        fprintf(stderr, "io_uring is not available, falling back to the threads engine\n");
+    }
+
+    // each listening socket feeds its own scheduler and the workers of its group, which steal from each other
+    listener_group_t *groups = calloc(num_listeners, sizeof(listener_group_t));
+    for (int i = 0; i < num_listeners; i++) {
+        groups[i].listenfd = listenfds[i];
+        int group_workers = args->NUM_WORKERS / num_listeners + (i < args->NUM_WORKERS % num_listeners);
+        groups[i].scheduler = create_scheduler(group_workers);
+        if (groups[i].scheduler == NULL) {
+            free(args);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    worker_t *workers = calloc(args->NUM_WORKERS, sizeof(worker_t));
     for(int i = 0; i < args->NUM_WORKERS; i++) {
-        int x = pthread_create(&threads[i], NULL, worker_function, NULL);
+        workers[i].scheduler = groups[i % num_listeners].scheduler;
+        workers[i].index = i / num_listeners;
+        int x = create_pinned_thread(&workers[i].thread, worker_cpu(args, i), worker_function, &workers[i]);
         if (x != 0) {
             free(args);
             exit(EXIT_FAILURE);
         }
     }
 
-    struct sockaddr_in clientAddress;
-    socklen_t addressLength = sizeof(clientAddress);
-    int listenfd = open_listenfd(args->PORT_NUMBER);
-    while(1) {
-        int connection = accept(listenfd, (struct sockaddr *)&clientAddress, &addressLength);
-        if (connection < 0) {
-            debug("Error Initiating connection");
-            continue;
+    for (int i = 0; i < num_listeners; i++) {
+        if (pthread_create(&groups[i].acceptor, NULL, acceptor_function, &groups[i]) != 0) {
+            free(args);
+            exit(EXIT_FAILURE);
         }
-        int *cfd = malloc(sizeof(int));
-        *cfd = connection;
-        enqueue(server_queue, cfd);
+    }
+
+    for (int i = 0; i < num_listeners; i++) {
+        pthread_join(groups[i].acceptor, NULL);
     }
 
     // Kill all threads after they are done with their jobs
     for (int i = 0; i < args->NUM_WORKERS; i++) {
-        pthread_join(threads[i], NULL);
+        pthread_join(workers[i].thread, NULL);
     }
 
     // clean up
-    invalidate_queue(server_queue, destroy_queue_function);
-    invalidate_map(server_hashmap);
+    for (int i = 0; i < num_listeners; i++) {
+        invalidate_scheduler(groups[i].scheduler, destroy_queue_function);
+    }
+    __atomic_store_n(&stop_expiry, true, __ATOMIC_RELEASE);
+    pthread_join(expiry_thread, NULL);
+    invalidate_sharded_map(server_map);
 
     free(args);
     exit(EXIT_SUCCESS);
 }
 
 /*
- * Destroys the hash function for a given element
+ * Opens a listening socket with SO_REUSEPORT set, so several sockets can
+ * bind the same port and the kernel spreads incoming connections over them.
+ *
+ * @param port The port to listen on.
+ * @return The listening socket, or -1 on error.
+ */
+int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+        return -1;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+        listenfd = -1;
+    }
+
+    freeaddrinfo(listp);
+    if (listenfd < 0 || listen(listenfd, LISTENQ) < 0) {
+        if (listenfd >= 0) {
+            close(listenfd);
+        }
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * Accepts connections on a group's listening socket and hands them to the
+ * group's workers. The socket is made non-blocking so that every wakeup
+ * drains the backlog, up to ACCEPT_BATCH connections, and a burst of
+ * connections is scheduled with one wakeup of the idle workers.
+ *
+ * @param arg A pointer to the listener_group_t to accept for.
+ */
+void *acceptor_function(void *arg) {
+    listener_group_t *group = arg;
+    struct sockaddr_in clientAddress;
+    socklen_t addressLength = sizeof(clientAddress);
+    void *accepted[ACCEPT_BATCH];
+    fcntl(group->listenfd, F_SETFL, fcntl(group->listenfd, F_GETFL) | O_NONBLOCK);
+
+    while(1) {
+        struct pollfd listener = {.fd = group->listenfd, .events = POLLIN};
+        if (poll(&listener, 1, -1) < 0) {
+            continue;
+        }
+
+        size_t num_accepted = 0;
+        while (num_accepted < ACCEPT_BATCH) {
+            addressLength = sizeof(clientAddress);
+            // the connections inherit nothing from the listener, so they block as the workers expect
+            int connection = accept(group->listenfd, (struct sockaddr *)&clientAddress, &addressLength);
+            if (connection < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    debug("Error Initiating connection");
+                }
+                break;
+            }
+            // responses are written whole, so there's nothing for Nagle to coalesce
+            int one = 1;
+            setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            accepted[num_accepted++] = FD_TO_ITEM(connection);
+        }
+        schedule_batch(group->scheduler, accepted, num_accepted);
+    }
+
+    return NULL;
+}
+
+/*
+ * Destroys the hash function for a given element. The value of every element
+ * lives in the same allocation as its key.
  *
  * @param key The key for an element in the hashmap
  * @param val The value of an element in the hashmap
  */
 void destroy_hash_function(map_key_t key, map_val_t val) {
-    free(key.key_base);
-    free(val.val_base);
+    (void) val;
+    slab_free(key.key_base);
+}
+
+/*
+ * Measures what an element takes up for the memory limit: the slab chunk its
+ * key and value share.
+ *
+ * @param key The key for an element in the hashmap
+ * @param val The value of an element in the hashmap
+ * @return The size of the chunk.
+ */
+size_t pair_size_function(map_key_t key, map_val_t val) {
+    (void) val;
+    return slab_size(key.key_base);
 }
 
 /*
- * Free's the memory allocated for a queue
+ * Closes a connection that was still waiting for a worker when the server shut down.
  *
- * @param queue The queue
+ * @param item The connection, as FD_TO_ITEM() scheduled it.
  */
-void destroy_queue_function(void* queue) {
-    free(queue);
+void destroy_queue_function(void* item) {
+    close(ITEM_TO_FD(item));
 }
 
 bool isKeyValid(request_header_t request_header, response_header_t *response_header) {
@@ -128,6 +602,28 @@ bool isValValid(request_header_t request_header, response_header_t *response_hea
     return false;
 }
 
+/*
+ * Checks that a batch request carries between 1 and MAX_BATCH_KEYS entries
+ * and a body whose length fits that many entries.
+ */
+bool isBatchValid(request_header_t request_header, response_header_t *response_header) {
+    uint64_t min_entry = sizeof(batch_entry_header_t) + MIN_KEY_SIZE;
+    uint64_t max_entry = sizeof(batch_entry_header_t) + MAX_KEY_SIZE;
+    if (request_header.request_code == MPUT) {
+        min_entry += MIN_VALUE_SIZE;
+        max_entry += MAX_VALUE_SIZE;
+    }
+    uint64_t min_size = request_header.key_size * min_entry;
+    uint64_t max_size = request_header.key_size * max_entry;
+    if (request_header.key_size >= 1 && request_header.key_size <= MAX_BATCH_KEYS &&
+        request_header.value_size >= min_size && request_header.value_size <= max_size) {
+        return true;
+    }
+
+    response_header->response_code = BAD_REQUEST;
+    return false;
+}
+
 int readNBytes(int client_fd, void* myBuffer, int bytesToRead) {
     int i = 0;
     char *bufferPtr = myBuffer;
@@ -173,136 +669,548 @@ int writeNBytes(int client_fd, void* myBuffer, int bytesToRead) {
     return bytesToRead;
 }
 
+/*
+ * Copies bytesToRead bytes into myBuffer, serving them from the connection's
+ * read buffer first. When the buffer runs dry it is refilled with a single
+ * read(2) of as much as the client has sent, so a whole request usually
+ * arrives in one system call. Reads too large for the buffer go straight
+ * into myBuffer.
+ *
+ * @param client_fd The socket connected to the client.
+ * @param buffer The connection's read buffer.
+ * @param myBuffer Where to copy the bytes.
+ * @param bytesToRead The number of bytes wanted.
+ * @return The number of bytes copied, which is less than bytesToRead if the client closed the connection.
+ *
+ * Error case: If read(2) fails, return -1 and leave errno set.
+ */
+int readBufferedNBytes(int client_fd, read_buffer_t *buffer, void* myBuffer, int bytesToRead) {
+    char *bufferPtr = myBuffer;
+    int copied = 0;
 
-void *worker_function() {
-    while (1) {
-        // get client file descriptor
-        int *cfd = dequeue(server_queue);
-        // if nothing in queue, try again
-        if (cfd == NULL) {
+    while (copied < bytesToRead) {
+        int buffered = buffer->end - buffer->start;
+        if (buffered > 0) {
+            int n = buffered < bytesToRead - copied ? buffered : bytesToRead - copied;
+            memcpy(bufferPtr + copied, buffer->data + buffer->start, n);
+            buffer->start += n;
+            copied += n;
             continue;
         }
-        // client fd is valid and get the request and responce headers
-        request_header_t request_header;
-        response_header_t response_header;
-        map_val_t map_value = MAP_VAL(NULL, 0);
-        map_node_t map_node;
 
-        int client_fd = *cfd;
-        // first we try to read for the header
-        if (readNBytes(client_fd, &request_header, sizeof(request_header)) < 0) {
-            response_header.response_code = BAD_REQUEST;
-            response_header.value_size = 0;
+        buffer->start = 0;
+        buffer->end = 0;
+        bool direct = bytesToRead - copied >= READ_BUFFER_SIZE;
+        int x = direct ? read(client_fd, bufferPtr + copied, bytesToRead - copied)
+                       : read(client_fd, buffer->data, READ_BUFFER_SIZE);
+        if (x < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (x == 0) {
+            return copied;
+        }
+
+        if (direct) {
+            copied += x;
         } else {
-            if (request_header.request_code == PUT) {
-                debug("Works");
-                debug("KEY VALID %d", isKeyValid(request_header, &response_header));
-                debug("VALUE %d", isValValid(request_header, &response_header));
-                if (isKeyValid(request_header, &response_header) && isValValid(request_header, &response_header)) {
-                    void *key = malloc(request_header.key_size);
-                    void *value = malloc(request_header.value_size);
-
-
-                    // read and check if the key is valid
-                    if (readNBytes(client_fd, key, request_header.key_size) < 0) {
-                        response_header.response_code = BAD_REQUEST;
-                        response_header.value_size = 0;
-                    }
+            buffer->end = x;
+        }
+    }
+    return copied;
+}
 
-                    // read and check if the key is valid
-                    if (readNBytes(client_fd, value, request_header.value_size) < 0) {
-                        response_header.response_code = BAD_REQUEST;
-                        response_header.value_size = 0;
-                    }
-                    debug("Key From Client: %s", (char*)key);
-                    debug("Value From Client: %s", (char*)value);
-                    // fullfill the PUT request
-                    if (response_header.response_code != BAD_REQUEST) {
-                        if (put(server_hashmap, MAP_KEY(key, request_header.key_size), MAP_VAL(value, request_header.value_size), true)) {
-                            response_header.response_code = OK;
-                            response_header.value_size = 0;
-                        } else {
-                            response_header.response_code = BAD_REQUEST;
-                            response_header.value_size = 0;
-                        }
-                    }
+/*
+ * Sends the bytes described by iov with as few sendmsg(2) calls as possible,
+ * resuming after partial sends. The iov array is modified as bytes are sent.
+ *
+ * @param client_fd The socket connected to the client.
+ * @param iov The buffers to send, in order.
+ * @param iovcnt The number of buffers.
+ * @return The number of bytes sent.
+ *
+ * Error case: If sendmsg(2) fails, return -1 and leave errno set.
+ */
+int sendvNBytes(int client_fd, struct iovec *iov, int iovcnt) {
+    int total = 0;
 
-                }
-            } else if (request_header.request_code == GET) {
-                if (isKeyValid(request_header, &response_header)) {
-                    // MALLOC KEY
-                    void *key = malloc(request_header.key_size);
-
-                    // read the key
-                    if (readNBytes(client_fd, key, request_header.key_size) < 0) {
-                        response_header.response_code = BAD_REQUEST;
-                        response_header.value_size = 0;
-                    }
+    while (iovcnt > 0) {
+        struct msghdr message = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        ssize_t x = sendmsg(client_fd, &message, MSG_NOSIGNAL);
+        if (x < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += x;
 
-                    // fullfill the GET request
-                    if(response_header.response_code != BAD_REQUEST) {
-                        debug("Start Get");
-                        map_value = get(server_hashmap, MAP_KEY(key, request_header.key_size));
-                        debug("End GET");
-                        if (map_value.val_base != NULL && map_value.val_len != 0) {
-                            response_header.response_code = OK;
-                            response_header.value_size = map_value.val_len;
-                        } else {
-                            // couldn't find the element in the hash map
-                            response_header.response_code = NOT_FOUND;
-                            response_header.value_size = 0;
-                        }
-                    }
+        // skip the buffers that went out whole and trim the one that didn't
+        while (iovcnt > 0 && (size_t) x >= iov->iov_len) {
+            x -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + x;
+            iov->iov_len -= x;
+        }
+    }
+    return total;
+}
 
-                }
-                debug("GET DONE");
 
-            } else if (request_header.request_code == EVICT) {
-                if(isKeyValid(request_header, &response_header)) {
-                    // MALLOC KEY
-                    void *key = malloc(request_header.key_size);
+/*
+ * Splits the body of a batch request into its entries. The keys and values
+ * point into the body.
+ *
+ * @param request_header The header of the batch request.
+ * @param body The body of the request.
+ * @param keys Filled with the key of every entry.
+ * @param vals Filled with the value of every entry, which is empty for an MGET.
+ * @return false if the body is malformed.
+ */
+static bool parse_batch(request_header_t request_header, char *body, map_key_t *keys, map_val_t *vals) {
+    bool has_values = request_header.request_code == MPUT;
+    size_t offset = 0;
 
-                    // read the key
-                    if (readNBytes(client_fd, key, request_header.key_size) < 0) {
-                        response_header.response_code = BAD_REQUEST;
-                        response_header.value_size = 0;
-                    }
+    for (uint32_t i = 0; i < request_header.key_size; i++) {
+        batch_entry_header_t entry;
+        if (request_header.value_size - offset < sizeof(entry)) {
+            return false;
+        }
+        memcpy(&entry, body + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.key_size < MIN_KEY_SIZE || entry.key_size > MAX_KEY_SIZE) {
+            return false;
+        }
+        if (has_values ? (entry.value_size < MIN_VALUE_SIZE || entry.value_size > MAX_VALUE_SIZE) : entry.value_size != 0) {
+            return false;
+        }
+        if (request_header.value_size - offset < (size_t) entry.key_size + entry.value_size) {
+            return false;
+        }
+        keys[i] = MAP_KEY(body + offset, entry.key_size);
+        offset += entry.key_size;
+        vals[i] = MAP_VAL(body + offset, entry.value_size);
+        offset += entry.value_size;
+    }
 
-                    if (response_header.response_code != BAD_REQUEST) {
-                        map_node = delete(server_hashmap, MAP_KEY(key, request_header.key_size));
-                        if (map_node.key.key_base != NULL || map_node.key.key_len != 0) {
-                            response_header.response_code = OK;
-                            response_header.value_size = 0;
-                        } else {
-                            // couldn't find the element in the hash map
-                            response_header.response_code = NOT_FOUND;
-                            response_header.value_size = 0;
-                        }
-                    }
+    return offset == request_header.value_size;
+}
 
-                }
+/*
+ * Looks up every key of an MGET body under one read acquisition of each shard
+ * and packs the per-key response headers and values into one buffer.
+ *
+ * @param request_header The header of the MGET request.
+ * @param body The body of the request.
+ * @param arena The arena of the request, which holds the response.
+ * @param response_header The response header to fill in.
+ * @return The packed response body, which lives until the arena is reset.
+ */
+static map_val_t execute_mget(request_header_t request_header, char *body, arena_t *arena, response_header_t *response_header) {
+    map_key_t keys[MAX_BATCH_KEYS];
+    map_val_t vals[MAX_BATCH_KEYS];
+    uint32_t num_keys = request_header.key_size;
 
-            } else if (request_header.request_code == CLEAR) {
-                if (clear_map(server_hashmap) == false) {
-                    response_header.response_code = BAD_REQUEST;
-                    response_header.value_size = 0;
-                } else {
-                    response_header.response_code = OK;
-                    response_header.value_size = 0;
-                }
-            } else {
-                response_header.response_code = UNSUPPORTED;
-                response_header.value_size = 0;
+    if (!parse_batch(request_header, body, keys, vals)) {
+        response_header->response_code = BAD_REQUEST;
+        return MAP_VAL(NULL, 0);
+    }
+
+    // the values are copied into the response, so they only have to outlive this epoch
+    epoch_enter();
+    sharded_get_batch(current_map(), keys, vals, num_keys);
+
+    size_t length = 0;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        length += sizeof(response_header_t) + vals[i].val_len;
+    }
+    char *packed = arena_alloc(arena, length);
+    if (packed == NULL) {
+        epoch_exit();
+        response_header->response_code = BAD_REQUEST;
+        return MAP_VAL(NULL, 0);
+    }
+
+    size_t offset = 0;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        response_header_t entry_header = {vals[i].val_base != NULL ? OK : NOT_FOUND, vals[i].val_len};
+        memcpy(packed + offset, &entry_header, sizeof(entry_header));
+        offset += sizeof(entry_header);
+        if (vals[i].val_base != NULL) {
+            memcpy(packed + offset, vals[i].val_base, vals[i].val_len);
+            offset += vals[i].val_len;
+        }
+    }
+    epoch_exit();
+
+    response_header->response_code = OK;
+    response_header->value_size = length;
+    return MAP_VAL(packed, length);
+}
+
+/*
+ * Copies the key and value of a PUT out of the request into one slab chunk and
+ * stores them. The chunk is only taken once the request was read in full, and
+ * the map keeps it if the pair is stored.
+ *
+ * @param request_header The header of the PUT or PUT_TTL request.
+ * @param key The key of the request.
+ * @param value The value of the request, followed by its TTL trailer for a PUT_TTL.
+ * @return true if the pair was stored.
+ */
+static bool execute_put(request_header_t request_header, char *key, char *value) {
+    char *pair = slab_alloc(request_header.key_size + request_header.value_size);
+    if (pair == NULL) {
+        return false;
+    }
+    memcpy(pair, key, request_header.key_size);
+    memcpy(pair + request_header.key_size, value, request_header.value_size);
+    map_key_t map_key = MAP_KEY(pair, request_header.key_size);
+    map_val_t map_val = MAP_VAL(pair + request_header.key_size, request_header.value_size);
+
+    bool stored;
+    if (request_header.request_code == PUT_TTL) {
+        // the trailer is right behind the value
+        ttl_trailer_t trailer;
+        memcpy(&trailer, value + request_header.value_size, sizeof(trailer));
+        stored = sharded_put_ttl(current_map(), map_key, map_val, trailer.ttl, true);
+    } else {
+        stored = sharded_put(current_map(), map_key, map_val, true);
+    }
+    if (!stored) {
+        slab_free(pair);
+    }
+    return stored;
+}
+
+/*
+ * Stores every pair of an MPUT body while taking the write lock of each shard once.
+ * Pairs that were stored stay stored when others can't be, so a partial store is
+ * answered with how many there are.
+ *
+ * @param request_header The header of the MPUT request.
+ * @param body The body of the request.
+ * @param arena The arena of the request, which holds the response.
+ * @param response_header The response header to fill in.
+ * @return The mput_response_t body of a partial store, which lives until the arena is reset,
+ *         or a NULL value if there is none.
+ */
+static map_val_t execute_mput(request_header_t request_header, char *body, arena_t *arena, response_header_t *response_header) {
+    map_key_t keys[MAX_BATCH_KEYS];
+    map_val_t vals[MAX_BATCH_KEYS];
+    uint32_t num_pairs = request_header.key_size;
+    size_t inserted = 0;
+
+    if (!parse_batch(request_header, body, keys, vals)) {
+        response_header->response_code = BAD_REQUEST;
+        return MAP_VAL(NULL, 0);
+    }
+
+    // the map keeps every key and value, so they can't live in the request body
+    for (uint32_t i = 0; i < num_pairs; i++) {
+        char *key = slab_alloc(keys[i].key_len + vals[i].val_len);
+        if (key == NULL) {
+            for (uint32_t j = 0; j < i; j++) {
+                slab_free(keys[j].key_base);
             }
+            num_pairs = 0;
+            break;
         }
-        // end if
+        char *value = key + keys[i].key_len;
+        memcpy(key, keys[i].key_base, keys[i].key_len);
+        memcpy(value, vals[i].val_base, vals[i].val_len);
+        keys[i].key_base = key;
+        vals[i].val_base = value;
+    }
 
-        writeNBytes(client_fd, &response_header, sizeof(response_header));
-        if (map_value.val_len != 0 && map_value.val_base != NULL) {
-            writeNBytes(client_fd, map_value.val_base, map_value.val_len);
+    if (num_pairs != 0) {
+        inserted = sharded_put_batch(current_map(), keys, vals, num_pairs, true);
+        for (size_t i = inserted; i < num_pairs; i++) {
+            slab_free(keys[i].key_base);
         }
-        close(client_fd);
-        free(cfd);
+    }
+    if (num_pairs != 0 && inserted == num_pairs) {
+        response_header->response_code = OK;
+        return MAP_VAL(NULL, 0);
     }
 
+    response_header->response_code = BAD_REQUEST;
+    mput_response_t *stored = arena_alloc(arena, sizeof(mput_response_t));
+    if (stored == NULL) {
+        return MAP_VAL(NULL, 0);
+    }
+    stored->num_stored = inserted;
+    response_header->value_size = sizeof(mput_response_t);
+    return MAP_VAL(stored, sizeof(mput_response_t));
 }
+
+/*
+ * Measures the probe lengths of every shard for a STATS request.
+ *
+ * @param arena The arena of the request, which holds the response.
+ * @param response_header The response header to fill in.
+ * @return The stats_response_t body, which lives until the arena is reset.
+ */
+static map_val_t execute_stats(arena_t *arena, response_header_t *response_header) {
+    stats_response_t *body = arena_alloc(arena, sizeof(stats_response_t));
+    if (body == NULL) {
+        response_header->response_code = BAD_REQUEST;
+        return MAP_VAL(NULL, 0);
+    }
+
+    probe_stats_t stats = sharded_probe_stats(current_map());
+    body->num_entries = stats.num_entries;
+    body->max_probe = stats.max_probe;
+    body->mean_probe_milli = stats.num_entries == 0 ? 0 : stats.total_probe * 1000 / stats.num_entries;
+    huge_page_stats_t pages = huge_page_stats();
+    body->hugetlb_bytes = pages.hugetlb_bytes;
+    body->transparent_bytes = pages.transparent_bytes;
+    // asking for transparent huge pages doesn't mean getting them, so say how many there are
+    body->transparent_huge_bytes = pages.transparent_bytes != 0 ? transparent_huge_page_bytes() : 0;
+
+    response_header->response_code = OK;
+    response_header->value_size = sizeof(stats_response_t);
+    return MAP_VAL(body, sizeof(stats_response_t));
+}
+
+/*
+ * Validates a request header and computes how many body bytes follow it.
+ *
+ * @param request_header The header of the request.
+ * @param response_header The response header, set to BAD_REQUEST if the header is invalid
+ *                        and to UNSUPPORTED if the request code is unknown.
+ * @param body_size Set to the number of bytes of the key, value, trailer or batch that follow.
+ * @return false if the header is invalid or unknown. The end of its body can't be told
+ *         then, so the connection has to be closed after answering.
+ */
+bool frame_request(request_header_t request_header, response_header_t *response_header, size_t *body_size) {
+    *body_size = 0;
+    if (request_header.request_code == PUT || request_header.request_code == PUT_TTL) {
+        if (!isKeyValid(request_header, response_header) || !isValValid(request_header, response_header)) {
+            return false;
+        }
+        *body_size = (size_t) request_header.key_size + request_header.value_size;
+        if (request_header.request_code == PUT_TTL) {
+            *body_size += sizeof(ttl_trailer_t);
+        }
+    } else if (request_header.request_code == GET || request_header.request_code == EVICT) {
+        if (!isKeyValid(request_header, response_header)) {
+            return false;
+        }
+        *body_size = request_header.key_size;
+    } else if (request_header.request_code == MGET || request_header.request_code == MPUT) {
+        if (!isBatchValid(request_header, response_header)) {
+            return false;
+        }
+        *body_size = request_header.value_size;
+    } else if (request_header.request_code == CLEAR || request_header.request_code == STATS) {
+        // a bare header, any size it claims would leave a body unread
+        if (request_header.key_size != 0 || request_header.value_size != 0) {
+            response_header->response_code = BAD_REQUEST;
+            return false;
+        }
+    } else {
+        response_header->response_code = UNSUPPORTED;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Fulfills a request whose key and value have already been received. The
+ * caller keeps owning them, a PUT copies what the map keeps. Batch requests
+ * pass their whole body as key.
+ *
+ * @param request_header The header of the request.
+ * @param key The key sent with the request, the body of a batch request, or NULL if it has none.
+ * @param value The value sent with the request, or NULL if it has none.
+ * @param arena The arena of the request, which holds the packed response of an MGET or STATS.
+ * @param response_header The response header to fill in.
+ * @return The value to send after the response header, or a map_ref_t
+ *         with a NULL value pointer if there is none. The caller must
+ *         release_ref() it once the value was sent, and only then reset the arena.
+ */
+map_ref_t execute_request(request_header_t request_header, void *key, void *value, arena_t *arena, response_header_t *response_header) {
+    map_ref_t map_value = MAP_REF(MAP_VAL(NULL, 0), NULL);
+    map_node_t map_node;
+    response_header->value_size = 0;
+
+    if (request_header.request_code == PUT || request_header.request_code == PUT_TTL) {
+        debug("Key From Client: %s", (char*)key);
+        debug("Value From Client: %s", (char*)value);
+        // fullfill the PUT request
+        if (execute_put(request_header, key, value)) {
+            response_header->response_code = OK;
+        } else {
+            response_header->response_code = BAD_REQUEST;
+        }
+    } else if (request_header.request_code == GET) {
+        // fullfill the GET request
+        debug("Start Get");
+        map_value = sharded_get_ref(current_map(), MAP_KEY(key, request_header.key_size));
+        debug("End GET");
+        if (map_value.val.val_base != NULL && map_value.val.val_len != 0) {
+            response_header->response_code = OK;
+            response_header->value_size = map_value.val.val_len;
+        } else {
+            // couldn't find the element in the hash map
+            response_header->response_code = NOT_FOUND;
+        }
+    } else if (request_header.request_code == EVICT) {
+        map_node = sharded_delete(current_map(), MAP_KEY(key, request_header.key_size));
+        if (map_node.key.key_base != NULL || map_node.key.key_len != 0) {
+            response_header->response_code = OK;
+        } else {
+            // couldn't find the element in the hash map
+            response_header->response_code = NOT_FOUND;
+        }
+    } else if (request_header.request_code == MGET) {
+        map_value.val = execute_mget(request_header, key, arena, response_header);
+    } else if (request_header.request_code == MPUT) {
+        map_value.val = execute_mput(request_header, key, arena, response_header);
+    } else if (request_header.request_code == CLEAR) {
+        if (clear_sharded_map(current_map()) == false) {
+            response_header->response_code = BAD_REQUEST;
+        } else {
+            response_header->response_code = OK;
+        }
+    } else if (request_header.request_code == STATS) {
+        map_value.val = execute_stats(arena, response_header);
+    } else {
+        response_header->response_code = UNSUPPORTED;
+    }
+
+    return map_value;
+}
+
+/*
+ * Reads a single request from a client, fulfills it and writes the response.
+ * The body is read into the arena, which is reset once the response was sent.
+ *
+ * @param client_fd The socket connected to the client.
+ * @param buffer The bytes already received on this connection but not yet consumed.
+ * @param arena The arena of the worker serving the connection.
+ * @return true if the connection can serve another request, false if it should be closed.
+ */
+bool handle_request(int client_fd, read_buffer_t *buffer, arena_t *arena) {
+    // get the request and responce headers
+    request_header_t request_header;
+    response_header_t response_header = {0, 0};
+    map_ref_t map_value = MAP_REF(MAP_VAL(NULL, 0), NULL);
+    void *key = NULL;
+    void *value = NULL;
+    size_t body_size = 0;
+    bool framed = false;
+
+    // first we try to read for the header
+    int header_bytes = readBufferedNBytes(client_fd, buffer, &request_header, sizeof(request_header));
+    if (header_bytes == 0 || (header_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+        // the client closed the connection or sat idle past the keep-alive timeout
+        return false;
+    }
+    if (header_bytes != sizeof(request_header)) {
+        response_header.response_code = BAD_REQUEST;
+    } else if ((framed = frame_request(request_header, &response_header, &body_size)) && body_size > 0) {
+        // read the key, value and trailer, or the whole batch body, execute_request splits it into keys
+        key = arena_alloc(arena, body_size);
+        if (key == NULL || readBufferedNBytes(client_fd, buffer, key, body_size) != (int) body_size) {
+            response_header.response_code = BAD_REQUEST;
+        } else if (request_header.request_code == PUT || request_header.request_code == PUT_TTL) {
+            value = (char *) key + request_header.key_size;
+        }
+    }
+
+    // a bad or unknown request may have left part of its body unread, so the stream can't be trusted
+    bool in_step = framed && response_header.response_code != BAD_REQUEST;
+    if (in_step) {
+        map_value = execute_request(request_header, key, value, arena, &response_header);
+    }
+
+    // send the header and the value together so the client gets them in one segment,
+    // the reference keeps a GET value alive even if it is replaced during a slow send
+    struct iovec response[2] = {
+        {.iov_base = &response_header, .iov_len = sizeof(response_header)},
+        {.iov_base = map_value.val.val_base, .iov_len = map_value.val.val_len},
+    };
+    int parts = map_value.val.val_len != 0 && map_value.val.val_base != NULL ? 2 : 1;
+    bool sent = sendvNBytes(client_fd, response, parts) >= 0;
+    release_ref(map_value);
+    arena_reset(arena);
+    if (!sent) {
+        return false;
+    }
+
+    // a request that was read whole keeps the connection open even if it failed
+    return in_step;
+}
+
+/*
+ * Serves the connections its scheduler hands it, one at a time, stealing
+ * them from the other workers of its group while it has none of its own.
+ *
+ * @param arg A pointer to the worker_t of the thread.
+ */
+void *worker_function(void *arg) {
+    worker_t *worker = arg;
+    read_buffer_t *buffer = malloc(sizeof(read_buffer_t));
+    if (buffer == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    // the worker serves one connection at a time, so its requests share one arena
+    arena_t arena;
+    arena_init(&arena);
+    // connections taken together wait for each other and can't be stolen anymore,
+    // so only take several when each of them is served a single request
+    void *items[WORKER_BATCH];
+    size_t max_items = keep_alive_timeout > 0 ? 1 : WORKER_BATCH;
+
+    while (1) {
+        // get client file descriptors
+        size_t num_items = next_items(worker->scheduler, worker->index, items, max_items);
+        // the scheduler only runs dry when the server shuts down
+        if (num_items == 0) {
+            break;
+        }
+        for (size_t i = 0; i < num_items; i++) {
+            int client_fd = ITEM_TO_FD(items[i]);
+            buffer->start = 0;
+            buffer->end = 0;
+
+            if (keep_alive_timeout > 0) {
+                // serve requests on this connection until the client closes it or goes idle
+                struct timeval timeout = {.tv_sec = keep_alive_timeout, .tv_usec = 0};
+                setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                while (handle_request(client_fd, buffer, &arena));
+            } else {
+                handle_request(client_fd, buffer, &arena);
+            }
+
+            close(client_fd);
+        }
+    }
+
+    arena_destroy(&arena);
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Removes the entries whose TTL ran out every EXPIRY_INTERVAL_MS, so they
+ * stop taking up room that live entries could use. Lookups already miss
+ * expired entries in between.
+ *
+ * @param arg Unused.
+ */
+void *expiry_function(void *arg) {
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = EXPIRY_INTERVAL_MS * 1000000L};
+    while (!__atomic_load_n(&stop_expiry, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        sharded_expire(server_map);
+    }
+    return NULL;
+}
+
@@ -0,0 +1,514 @@
+#include "sharded_map.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <string.h>
+
+/*
+ * This function will calloc(3) a new instance of sharded_map_t and create
+ *      num_shards hashmap_t segments that share capacity between them.
+ *
+ * @param capacity The maximum number of items that the map can hold.
+ * @param num_shards The number of segments, rounded up to a power of two.
+ * @param hash_function The hash function that the map uses to hash keys.
+ * @param destroy_function The destroyer function that the map uses to free keys and values when it is destroyed.
+ * @param probing How every segment places its keys.
+ *
+ * @returns A valid pointer to a sharded_map_t instance, or NULL.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return NULL.
+ * Error case: If calloc(3) or create_probing_map is unsuccessful, return NULL.
+ */
+sharded_map_t *create_sharded_map(uint32_t capacity, uint32_t num_shards, hash_func_f hash_function, destructor_f destroy_function,
+                                  probe_modes probing) {
+    if (hash_function == NULL || destroy_function == NULL || capacity == 0 || num_shards == 0 || num_shards > (1u << 16)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sharded_map_t *map = calloc(1, sizeof(sharded_map_t));
+    if (map == NULL) {
+        return NULL;
+    }
+    while ((1u << map->shard_bits) < num_shards) {
+        map->shard_bits++;
+    }
+    map->num_shards = 1u << map->shard_bits;
+    map->hash_function = hash_function;
+
+    map->shards = calloc(map->num_shards, sizeof(hashmap_t *));
+    if (map->shards == NULL) {
+        free(map);
+        return NULL;
+    }
+
+    uint32_t shard_capacity = (capacity + map->num_shards - 1) / map->num_shards;
+    for (uint32_t i = 0; i < map->num_shards; i++) {
+        map->shards[i] = create_probing_map(shard_capacity, hash_function, destroy_function, probing);
+        if (map->shards[i] == NULL) {
+            for (uint32_t j = 0; j < i; j++) {
+                invalidate_map(map->shards[j]);
+                free(map->shards[j]);
+            }
+            free(map->shards);
+            free(map);
+            return NULL;
+        }
+    }
+
+    return map;
+}
+
+/*
+ * Picks the shard of a key from the top bits of its hash. The shard hands
+ * the same hash on, and takes the tag and the slot from its low bits, so
+ * the key is hashed once and the choice of shard doesn't correlate with
+ * the slot. The two only share bits once a shard has 2^(25 - shard_bits)
+ * groups.
+ */
+static uint32_t shard_index(sharded_map_t *self, uint32_t hash) {
+    if (self->shard_bits == 0) {
+        return 0;
+    }
+    return hash >> (32 - self->shard_bits);
+}
+
+/*
+ * Hashes keys and sorts their positions by shard with a counting sort.
+ *
+ * @param hashes Filled with the hash of every key, 0 for an empty key.
+ * @param order Filled with the positions of keys, grouped by shard.
+ * @param starts Filled so that the keys of shard s are order[starts[s]] to order[starts[s + 1] - 1].
+ *               Must hold num_shards + 1 entries.
+ */
+static void group_by_shard(sharded_map_t *self, map_key_t *keys, size_t num_keys, uint32_t *hashes, size_t *order, size_t *starts) {
+    memset(starts, 0, (self->num_shards + 1) * sizeof(size_t));
+    for (size_t i = 0; i < num_keys; i++) {
+        hashes[i] = keys[i].key_len != 0 ? self->hash_function(keys[i]) : 0;
+        starts[shard_index(self, hashes[i]) + 1]++;
+    }
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        starts[s + 1] += starts[s];
+    }
+    size_t *next = starts + self->num_shards + 1;
+    memcpy(next, starts, self->num_shards * sizeof(size_t));
+    for (size_t i = 0; i < num_keys; i++) {
+        order[next[shard_index(self, hashes[i])]++] = i;
+    }
+}
+
+/*
+ * Scratch space for a batch operation, allocated in one block.
+ */
+typedef struct batch_plan_t {
+    /* the hashes of the keys in request order, and in shard order */
+    uint32_t *hashes;
+    uint32_t *sorted_hashes;
+    size_t *order;
+    size_t *starts;
+    map_key_t *keys;
+    map_val_t *vals;
+} batch_plan_t;
+
+static void *create_batch_plan(sharded_map_t *self, map_key_t *keys, size_t num_keys, batch_plan_t *plan) {
+    size_t counters = 2 * (size_t) self->num_shards + 1;
+    char *block = malloc(num_keys * (sizeof(map_key_t) + sizeof(map_val_t) + sizeof(size_t) + 2 * sizeof(uint32_t))
+        + counters * sizeof(size_t));
+    if (block == NULL) {
+        return NULL;
+    }
+    plan->keys = (map_key_t *) block;
+    plan->vals = (map_val_t *) (plan->keys + num_keys);
+    plan->order = (size_t *) (plan->vals + num_keys);
+    plan->starts = plan->order + num_keys;
+    plan->hashes = (uint32_t *) (plan->starts + counters);
+    plan->sorted_hashes = plan->hashes + num_keys;
+
+    group_by_shard(self, keys, num_keys, plan->hashes, plan->order, plan->starts);
+    for (size_t j = 0; j < num_keys; j++) {
+        plan->sorted_hashes[j] = plan->hashes[plan->order[j]];
+    }
+    return block;
+}
+
+/*
+ * This will insert a key/value pair into the shard that owns the key.
+ *
+ * @param self A pointer to the sharded map
+ * @param key The key associated with the node
+ * @param val The value associated with the node
+ * @param force If the shard is full and force is true, evict an entry of that shard that wasn't looked up recently.
+ *
+ * @returns true if the operation was successful, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return false.
+ * Error case: If the shard is full and force is set to false, set errno to ENOMEM and return false.
+ */
+bool sharded_put(sharded_map_t *self, map_key_t key, map_val_t val, bool force) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    uint32_t hash = self->hash_function(key);
+    return put_hashed(self->shards[shard_index(self, hash)], key, val, hash, force);
+}
+
+/*
+ * This will insert a key/value pair that expires after its own TTL into the shard that owns the key.
+ *
+ * @param self A pointer to the sharded map
+ * @param key The key associated with the node
+ * @param val The value associated with the node
+ * @param ttl The milliseconds until the pair expires, or 0 if it never does.
+ * @param force If the shard is full and force is true, evict an entry of that shard that wasn't looked up recently.
+ *
+ * @returns true if the operation was successful, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return false.
+ * Error case: If the shard is full and force is set to false, set errno to ENOMEM and return false.
+ */
+bool sharded_put_ttl(sharded_map_t *self, map_key_t key, map_val_t val, uint32_t ttl, bool force) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    uint32_t hash = self->hash_function(key);
+    return put_ttl_hashed(self->shards[shard_index(self, hash)], key, val, hash, ttl, force);
+}
+
+/*
+ * Sets the TTL of the pairs sharded_put() and sharded_put_batch() insert from now on.
+ *
+ * @param self A pointer to the sharded map
+ * @param ttl The milliseconds until those pairs expire, or 0 if they never do.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL.
+ */
+void sharded_set_default_ttl(sharded_map_t *self, uint32_t ttl) {
+    if (self == NULL) {
+        errno = EINVAL;
+        return;
+    }
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        set_default_ttl(self->shards[s], ttl);
+    }
+}
+
+/*
+ * This will insert many key/value pairs while taking the write lock of each
+ * shard only once. On return the pairs that were inserted are at the front
+ * of keys and vals and the ones that were not are behind them.
+ *
+ * @param self A pointer to the sharded map
+ * @param keys The keys of the pairs
+ * @param vals The values of the pairs, in the same order as keys
+ * @param num_pairs The number of pairs to insert
+ * @param force If a shard is full and force is true, pairs evict entries of that shard that weren't looked up recently.
+ *
+ * @returns The number of pairs that were inserted. The map takes ownership of those pairs only.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ * Error case: If malloc(3) is unsuccessful, return 0 without inserting anything.
+ */
+size_t sharded_put_batch(sharded_map_t *self, map_key_t *keys, map_val_t *vals, size_t num_pairs, bool force) {
+    if (self == NULL || keys == NULL || vals == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    batch_plan_t plan;
+    void *block = create_batch_plan(self, keys, num_pairs, &plan);
+    if (block == NULL) {
+        return 0;
+    }
+    for (size_t j = 0; j < num_pairs; j++) {
+        plan.keys[j] = keys[plan.order[j]];
+        plan.vals[j] = vals[plan.order[j]];
+    }
+
+    // put_batch stops at the first pair it can't insert, so each shard inserts a prefix of its group.
+    // Collect those prefixes first and the rest after them
+    size_t inserted = 0;
+    size_t rejected = num_pairs;
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        size_t start = plan.starts[s];
+        size_t length = plan.starts[s + 1] - start;
+        if (length == 0) {
+            continue;
+        }
+        size_t done = put_batch_hashed(self->shards[s], plan.keys + start, plan.vals + start, plan.sorted_hashes + start, length, force);
+        for (size_t j = start; j < start + length; j++) {
+            size_t to = j < start + done ? inserted++ : --rejected;
+            keys[to] = plan.keys[j];
+            vals[to] = plan.vals[j];
+        }
+    }
+
+    free(block);
+    return inserted;
+}
+
+/*
+ * Retrieves the map_val_t corresponding to key from the shard that owns it.
+ *
+ * @param self A pointer to the sharded map
+ * @param key The key associated with the node.
+ *
+ * @returns The corresponding value. If the key is not found,
+ *           the map_val_t instance will contain a NULL pointer and a val_len of 0.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return a map_val_t with a NULL pointer.
+ */
+map_val_t sharded_get(sharded_map_t *self, map_key_t key) {
+    if (self == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return MAP_VAL(NULL, 0);
+    }
+    uint32_t hash = self->hash_function(key);
+    return get_hashed(self->shards[shard_index(self, hash)], key, hash);
+}
+
+/*
+ * Retrieves the map_val_t corresponding to key from the shard that owns it
+ * and takes a reference on it.
+ *
+ * @param self A pointer to the sharded map
+ * @param key The key associated with the node.
+ *
+ * @returns The corresponding value and its entry. If the key is not found,
+ *           the map_ref_t instance will contain a NULL value pointer and a NULL entry.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return the not found instance.
+ */
+map_ref_t sharded_get_ref(sharded_map_t *self, map_key_t key) {
+    if (self == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return MAP_REF(MAP_VAL(NULL, 0), NULL);
+    }
+    uint32_t hash = self->hash_function(key);
+    return get_ref_hashed(self->shards[shard_index(self, hash)], key, hash);
+}
+
+/*
+ * Retrieves the map_val_t of every key in keys while holding each shard once.
+ *
+ * @param self A pointer to the sharded map
+ * @param keys The keys to look up.
+ * @param vals The values of the keys, in the same order. A key that is not found
+ *             gets a map_val_t instance with a NULL pointer and a val_len of 0.
+ * @param num_keys The number of keys to look up.
+ *
+ * @returns The number of keys that were found.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ * Error case: If malloc(3) is unsuccessful, every key is reported as not found.
+ */
+size_t sharded_get_batch(sharded_map_t *self, map_key_t *keys, map_val_t *vals, size_t num_keys) {
+    if (self == NULL || keys == NULL || vals == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    batch_plan_t plan;
+    void *block = create_batch_plan(self, keys, num_keys, &plan);
+    if (block == NULL) {
+        for (size_t i = 0; i < num_keys; i++) {
+            vals[i] = MAP_VAL(NULL, 0);
+        }
+        return 0;
+    }
+    for (size_t j = 0; j < num_keys; j++) {
+        plan.keys[j] = keys[plan.order[j]];
+    }
+
+    size_t found = 0;
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        size_t start = plan.starts[s];
+        size_t length = plan.starts[s + 1] - start;
+        if (length != 0) {
+            found += get_batch_hashed(self->shards[s], plan.keys + start, plan.sorted_hashes + start, plan.vals + start, length);
+        }
+    }
+    for (size_t j = 0; j < num_keys; j++) {
+        vals[plan.order[j]] = plan.vals[j];
+    }
+
+    free(block);
+    return found;
+}
+
+/*
+ * Removes the entry with key from the shard that owns it.
+ *
+ * @param self A pointer to the sharded map
+ * @param key The key associated with the node.
+ *
+ * @returns The removed map_node_t instance.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and
+ *             return a map_node_t with all pointers set to NULL and lengths set to 0.
+ */
+map_node_t sharded_delete(sharded_map_t *self, map_key_t key) {
+    if (self == NULL || key.key_base == NULL || key.key_len == 0) {
+        errno = EINVAL;
+        return MAP_NODE(MAP_KEY(NULL, 0), MAP_VAL(NULL, 0), false);
+    }
+    uint32_t hash = self->hash_function(key);
+    return delete_hashed(self->shards[shard_index(self, hash)], key, hash);
+}
+
+/*
+ * Clears every shard one after another. Concurrent puts into a shard that
+ * was already cleared survive the call.
+ *
+ * @param self A pointer to the sharded map
+ *
+ * @returns true if every shard was cleared, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return false.
+ */
+bool clear_sharded_map(sharded_map_t *self) {
+    if (self == NULL) {
+        errno = EINVAL;
+        return false;
+    }
+    bool cleared = true;
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        cleared = clear_map(self->shards[s]) && cleared;
+    }
+    return cleared;
+}
+
+/*
+ * Limits the memory the pairs take up, split evenly over the shards like the capacity.
+ *
+ * @param self A pointer to the sharded map
+ * @param max_bytes The most bytes the pairs may be charged, or 0 for no limit.
+ * @param size_function What a pair takes up, or NULL to charge the lengths of its key and value.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL.
+ */
+void sharded_set_memory_limit(sharded_map_t *self, uint64_t max_bytes, size_func_f size_function) {
+    if (self == NULL) {
+        errno = EINVAL;
+        return;
+    }
+    // a limit too small to split still has to be a limit
+    uint64_t shard_bytes = max_bytes / self->num_shards;
+    if (max_bytes != 0 && shard_bytes == 0) {
+        shard_bytes = 1;
+    }
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        set_memory_limit(self->shards[s], shard_bytes, size_function);
+    }
+}
+
+/*
+ * Hands every shard to a single thread, which then uses them without locks.
+ *
+ * @param self A pointer to the sharded map
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL.
+ */
+void sharded_set_single_owner(sharded_map_t *self) {
+    if (self == NULL) {
+        errno = EINVAL;
+        return;
+    }
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        set_single_owner(self->shards[s]);
+    }
+}
+
+/*
+ * Spreads the shards over NUMA nodes, shard s growing its tables on nodes[s % num_nodes].
+ *
+ * @param self A pointer to the sharded map
+ * @param nodes The nodes to place shards on, -1 leaving a shard to the kernel.
+ * @param num_nodes The number of nodes.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL.
+ */
+void sharded_set_numa_nodes(sharded_map_t *self, const int *nodes, uint32_t num_nodes) {
+    if (self == NULL || nodes == NULL || num_nodes == 0) {
+        errno = EINVAL;
+        return;
+    }
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        set_numa_node(self->shards[s], nodes[s % num_nodes]);
+    }
+}
+
+/*
+ * Removes the expired entries of every shard, taking the write lock of one
+ * shard at a time.
+ *
+ * @param self A pointer to the sharded map
+ *
+ * @returns The number of entries that were removed.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return 0.
+ */
+size_t sharded_expire(sharded_map_t *self) {
+    if (self == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    size_t expired = 0;
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        expired += expire_map(self->shards[s]);
+    }
+    return expired;
+}
+
+/*
+ * Adds up the probe lengths of every shard. Each shard is measured under its
+ * own write lock, so the result is not a snapshot of the whole map.
+ *
+ * @param self A pointer to the sharded map
+ *
+ * @returns The number of keys and their maximum and total probe length.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return all zeros.
+ */
+probe_stats_t sharded_probe_stats(sharded_map_t *self) {
+    probe_stats_t stats = {0, 0, 0};
+    if (self == NULL) {
+        errno = EINVAL;
+        return stats;
+    }
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        probe_stats_t shard = map_probe_stats(self->shards[s]);
+        stats.num_entries += shard.num_entries;
+        stats.total_probe += shard.total_probe;
+        if (shard.max_probe > stats.max_probe) {
+            stats.max_probe = shard.max_probe;
+        }
+    }
+    return stats;
+}
+
+/*
+ * This will invalidate every shard, destroying their remaining items, and free(3) the map.
+ *
+ * @param self A pointer to the sharded map
+ *
+ * @returns true if the invalidation was successful, false otherwise.
+ *
+ * Error case: If any parameters are invalid, set errno to EINVAL and return false.
+ */
+bool invalidate_sharded_map(sharded_map_t *self) {
+    if (self == NULL) {
+        errno = EINVAL;
+        return false;
+    }
+    bool invalidated = true;
+    for (uint32_t s = 0; s < self->num_shards; s++) {
+        invalidated = invalidate_map(self->shards[s]) && invalidated;
+        free(self->shards[s]);
+    }
+    free(self->shards);
+    free(self);
+    return invalidated;
+}
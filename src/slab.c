@@ -0,0 +1,373 @@
+#include "slab.h"
+#include "cream.h"
+#include "debug.h"
+#include "hugepage.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The largest chunk holds the longest key next to the longest value */
+#define SLAB_MAX_CHUNK ((MAX_KEY_SIZE + MAX_VALUE_SIZE + 15) & ~(size_t) 15)
+
+/* Enough classes to grow from SLAB_MIN_CHUNK to SLAB_MAX_CHUNK */
+#define SLAB_MAX_CLASSES 64
+
+/* The start of every page, chunks follow on the next cache line */
+#define SLAB_PAGE_HEADER 64
+
+/* The empty pages the pool keeps resident, beyond them their memory goes back to the system */
+#define SLAB_RESIDENT_PAGES 4
+
+/* A free chunk links to the next free chunk of its page */
+typedef struct slab_chunk_t {
+    struct slab_chunk_t *next;
+} slab_chunk_t;
+
+/* The header at the start of every page */
+typedef struct slab_page_t {
+    struct slab_class_t *class;
+    /* the chunks handed out and not freed yet, the page may leave its class when this drops to 0 */
+    uint32_t used;
+    /* set when the page was cut out of a huge page, whose memory can't be given back in part */
+    bool huge;
+    /* set while the page is on its class's list of pages with room */
+    bool partial;
+    slab_chunk_t *free_chunks;
+    /* the part of the page that was never handed out */
+    char *carve;
+    /* the neighbours on the list of pages with room, or the next empty page in the pool */
+    struct slab_page_t *prev, *next;
+} slab_page_t;
+
+typedef struct slab_class_t {
+    pthread_mutex_t lock;
+    /* set for the classes of a thread's own cache, which only that thread uses and doesn't lock */
+    bool owned;
+    size_t chunk_size;
+    /* the pages of the class that have a free or uncarved chunk */
+    slab_page_t *partial;
+    /* an empty page the class keeps on its partial list instead of giving it up */
+    slab_page_t *spare;
+} slab_class_t;
+
+/* A full set of size classes */
+struct slab_cache_t {
+    slab_class_t classes[SLAB_MAX_CLASSES];
+};
+
+/* The classes every thread without a cache of its own allocates from */
+static slab_cache_t shared_cache;
+static slab_class_t *classes = shared_cache.classes;
+static uint32_t num_classes;
+static __thread slab_cache_t *thread_cache;
+static uint64_t footprint;
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Pages no class is using, which any class takes before asking the system
+ * for more, and the part of the newest huge page that no class has taken a
+ * page from yet. Empty pages whose memory is still resident are taken before
+ * the ones that gave it back. A class lock may be held while taking this one,
+ * never the other way around.
+ */
+static pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_page_t *empty_pages;
+static uint32_t num_resident_pages;
+static slab_page_t *released_pages;
+static char *huge_carve;
+static char *huge_carve_end;
+
+_Static_assert(sizeof(slab_page_t) <= SLAB_PAGE_HEADER, "the page header must fit in front of the chunks");
+_Static_assert(HUGE_PAGE_SIZE % SLAB_PAGE_SIZE == 0, "slab pages must tile a huge page");
+
+/*
+ * Lays out the size classes. Every class is SLAB_GROWTH_PERCENT of the one
+ * before, rounded up to 16 bytes, so a chunk wastes at most about a fifth of
+ * itself, and the last class is exactly SLAB_MAX_CHUNK.
+ */
+static void create_classes(void) {
+    size_t size = SLAB_MIN_CHUNK;
+    while (num_classes < SLAB_MAX_CLASSES) {
+        if (size > SLAB_MAX_CHUNK) {
+            size = SLAB_MAX_CHUNK;
+        }
+        pthread_mutex_init(&classes[num_classes].lock, NULL);
+        classes[num_classes].chunk_size = size;
+        num_classes++;
+        if (size == SLAB_MAX_CHUNK) {
+            break;
+        }
+        size = ((size * SLAB_GROWTH_PERCENT / 100) + 15) & ~(size_t) 15;
+    }
+    debug("%u slab classes up to %zu bytes", num_classes, classes[num_classes - 1].chunk_size);
+}
+
+/*
+ * @return The index of the smallest class whose chunks hold size bytes.
+ */
+static uint32_t class_of(size_t size) {
+    uint32_t low = 0, high = num_classes - 1;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (classes[middle].chunk_size < size) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static slab_page_t *page_of(void *ptr) {
+    return (slab_page_t *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+}
+
+static void lock_class(slab_class_t *class) {
+    if (!class->owned) {
+        pthread_mutex_lock(&class->lock);
+    }
+}
+
+static void unlock_class(slab_class_t *class) {
+    if (!class->owned) {
+        pthread_mutex_unlock(&class->lock);
+    }
+}
+
+/*
+ * This function creates a set of size classes for the calling thread alone.
+ * Its classes take pages from the same pool as every other class, but never
+ * hand a chunk to another thread, so they are used without locks.
+ *
+ * @return The cache, or NULL if calloc(3) is unsuccessful.
+ */
+slab_cache_t *slab_create_cache(void) {
+    pthread_once(&classes_once, create_classes);
+    slab_cache_t *cache = calloc(1, sizeof(slab_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < num_classes; i++) {
+        cache->classes[i].owned = true;
+        cache->classes[i].chunk_size = classes[i].chunk_size;
+    }
+    return cache;
+}
+
+void slab_use_cache(slab_cache_t *cache) {
+    thread_cache = cache;
+}
+
+/*
+ * Cuts a slab page out of a huge page, mapping a new huge page when the last
+ * one is used up. The caller must hold the pages lock.
+ *
+ * @return The page, or NULL if no huge page could be mapped.
+ */
+static slab_page_t *alloc_huge_page(void) {
+    if (huge_carve == huge_carve_end) {
+        page_sizes pages;
+        huge_carve = huge_alloc(HUGE_PAGE_SIZE, &pages);
+        huge_carve_end = huge_carve != NULL ? huge_carve + HUGE_PAGE_SIZE : NULL;
+    }
+    slab_page_t *page = (slab_page_t *) huge_carve;
+    if (page != NULL) {
+        huge_carve += SLAB_PAGE_SIZE;
+        page->huge = true;
+    }
+    return page;
+}
+
+/*
+ * Takes a page for a class, an empty one another class gave up if there is
+ * one, otherwise a new one from the system, out of a huge page if those are
+ * enabled and one can be mapped. The caller must hold the class lock.
+ *
+ * @return The page, or NULL if it could not be allocated.
+ */
+static slab_page_t *take_page(slab_class_t *class) {
+    pthread_mutex_lock(&pages_lock);
+    slab_page_t *page = empty_pages;
+    if (page != NULL) {
+        empty_pages = page->next;
+        num_resident_pages -= !page->huge;
+    } else if ((page = released_pages) != NULL) {
+        released_pages = page->next;
+    } else {
+        // without a huge page to cut from, the page comes from the heap
+        page = huge_pages_enabled() ? alloc_huge_page() : NULL;
+        if (page == NULL && (page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE)) != NULL) {
+            page->huge = false;
+        }
+    }
+    if (page != NULL) {
+        __atomic_add_fetch(&footprint, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pages_lock);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    page->class = class;
+    page->used = 0;
+    page->partial = false;
+    page->free_chunks = NULL;
+    page->carve = (char *) page + SLAB_PAGE_HEADER;
+    return page;
+}
+
+/*
+ * Hands a page whose chunks were all freed to the pool, so that whichever
+ * class needs a page next gets it. The pool keeps SLAB_RESIDENT_PAGES of
+ * them as they are, and the memory behind the chunks of any more goes back
+ * to the system until they are taken, unless it is part of a huge page.
+ * The caller must not hold a class lock, so no class waits for madvise(2).
+ */
+static void give_up_page(slab_page_t *page) {
+    pthread_mutex_lock(&pages_lock);
+    __atomic_sub_fetch(&footprint, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    bool release = !page->huge && num_resident_pages >= SLAB_RESIDENT_PAGES;
+    if (!release) {
+        page->next = empty_pages;
+        empty_pages = page;
+        num_resident_pages += !page->huge;
+    }
+    pthread_mutex_unlock(&pages_lock);
+    if (!release) {
+        return;
+    }
+
+    size_t system_page = sysconf(_SC_PAGESIZE);
+    madvise((char *) page + system_page, SLAB_PAGE_SIZE - system_page, MADV_DONTNEED);
+    pthread_mutex_lock(&pages_lock);
+    page->next = released_pages;
+    released_pages = page;
+    pthread_mutex_unlock(&pages_lock);
+}
+
+static void link_partial(slab_class_t *class, slab_page_t *page) {
+    page->prev = NULL;
+    page->next = class->partial;
+    if (class->partial != NULL) {
+        class->partial->prev = page;
+    }
+    class->partial = page;
+    page->partial = true;
+}
+
+static void unlink_partial(slab_class_t *class, slab_page_t *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        class->partial = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->partial = false;
+}
+
+/*
+ * Allocates a chunk from the smallest size class that fits, in the cache of
+ * the calling thread if it has one. A page of the class with room hands out
+ * a freed chunk first, then carves a new one.
+ * When no page has room, the class takes another page.
+ *
+ * @param size The number of bytes needed.
+ *
+ * @return The chunk.
+ *
+ * Error case: If size is 0 or larger than the largest class, return NULL.
+ * Error case: If aligned_alloc(3) is unsuccessful, return NULL.
+ */
+void *slab_alloc(size_t size) {
+    pthread_once(&classes_once, create_classes);
+    if (size == 0 || size > SLAB_MAX_CHUNK) {
+        return NULL;
+    }
+    slab_class_t *class = (thread_cache != NULL ? thread_cache->classes : classes) + class_of(size);
+    void *chunk = NULL;
+
+    lock_class(class);
+    slab_page_t *page = class->partial;
+    if (page == NULL && (page = take_page(class)) != NULL) {
+        link_partial(class, page);
+    }
+    if (page != NULL) {
+        if (page->free_chunks != NULL) {
+            chunk = page->free_chunks;
+            page->free_chunks = page->free_chunks->next;
+        } else {
+            chunk = page->carve;
+            page->carve += class->chunk_size;
+        }
+        if (page == class->spare) {
+            class->spare = NULL;
+        }
+        page->used++;
+        if (page->free_chunks == NULL && (size_t) ((char *) page + SLAB_PAGE_SIZE - page->carve) < class->chunk_size) {
+            unlink_partial(class, page);
+        }
+    }
+    unlock_class(class);
+
+    return chunk;
+}
+
+/*
+ * Returns a chunk to its page. A page that has no chunk in use anymore is
+ * given up, so the memory of a class that went out of use can serve any other,
+ * unless it is the only empty page of its class. The class keeps that one, so
+ * a size that is freed and stored again around a page boundary doesn't move a
+ * page in and out of the pool every time.
+ *
+ * @param ptr A chunk returned by slab_alloc(), or NULL.
+ */
+void slab_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    // the page can't change class while one of its chunks is in use
+    slab_page_t *page = page_of(ptr);
+    slab_class_t *class = page->class;
+    slab_chunk_t *chunk = ptr;
+    bool emptied = false;
+
+    lock_class(class);
+    chunk->next = page->free_chunks;
+    page->free_chunks = chunk;
+    if (--page->used == 0 && class->spare != NULL) {
+        if (page->partial) {
+            unlink_partial(class, page);
+        }
+        emptied = true;
+    } else {
+        if (page->used == 0) {
+            class->spare = page;
+        }
+        if (!page->partial) {
+            link_partial(class, page);
+        }
+    }
+    unlock_class(class);
+
+    // nothing else can reach a page that left its class
+    if (emptied) {
+        give_up_page(page);
+    }
+}
+
+size_t slab_size(void *ptr) {
+    return page_of(ptr)->class->chunk_size;
+}
+
+size_t slab_max_size(void) {
+    return SLAB_MAX_CHUNK;
+}
+
+uint64_t slab_footprint(void) {
+    return __atomic_load_n(&footprint, __ATOMIC_RELAXED);
+}
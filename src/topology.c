@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include "topology.h"
+#include "debug.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Parses the number at *list and moves past it.
+ *
+ * @return The number, or -1 if there is none or it is not a CPU.
+ */
+static int parse_cpu(const char **list) {
+    if (**list < '0' || **list > '9') {
+        return -1;
+    }
+    char *end;
+    long cpu = strtol(*list, &end, 10);
+    *list = end;
+    return cpu < MAX_CPUS ? (int) cpu : -1;
+}
+
+/*
+ * This function parses a comma separated list of CPUs and inclusive ranges
+ * of CPUs. A CPU may be listed more than once, for threads that share it.
+ *
+ * @param list The list to parse.
+ * @param cpus Filled with the listed CPUs.
+ * @param max_cpus The capacity of cpus.
+ *
+ * @return The number of CPUs in cpus.
+ *
+ * Error case: If the list is empty, malformed or names more than max_cpus CPUs,
+ *             set errno to EINVAL and return -1.
+ */
+int parse_cpu_list(const char *list, int *cpus, int max_cpus) {
+    if (list == NULL || cpus == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int count = 0;
+    while (1) {
+        int first = parse_cpu(&list);
+        int last = first;
+        if (*list == '-') {
+            list++;
+            last = parse_cpu(&list);
+        }
+        if (first < 0 || last < first || count + (last - first + 1) > max_cpus) {
+            errno = EINVAL;
+            return -1;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus[count++] = cpu;
+        }
+
+        if (*list == '\0') {
+            return count;
+        }
+        if (*list++ != ',') {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+}
+
+/*
+ * @param cpu A CPU number.
+ *
+ * @return Whether the CPU is in the affinity mask the process started with.
+ */
+bool cpu_allowed(int cpu) {
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= CPU_SETSIZE || sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return false;
+    }
+    return CPU_ISSET(cpu, &set);
+}
+
+/*
+ * Looks the node of a CPU up in sysfs, where the CPU's directory links to it as nodeN.
+ *
+ * @param cpu A CPU number.
+ *
+ * @return The node, or -1 if the kernel was built without NUMA or the CPU doesn't exist.
+ */
+int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent *entry;
+    while (node < 0 && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/*
+ * Counts the nodeN directories the kernel lists for the host.
+ *
+ * @return The number of NUMA nodes, 1 if the kernel doesn't list any.
+ */
+int num_numa_nodes(void) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return 1;
+    }
+
+    int nodes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            nodes++;
+        }
+    }
+    closedir(dir);
+    return nodes > 0 ? nodes : 1;
+}
+
+/*
+ * This function creates a thread whose affinity is set before it starts, so
+ * everything it allocates and touches first lands on the node of its CPU.
+ *
+ * @param thread Set to the new thread.
+ * @param cpu The CPU the thread runs on, or -1 for the default attributes.
+ * @param start_routine The function the thread runs.
+ * @param arg The argument to start_routine.
+ *
+ * @return 0 on success.
+ *
+ * Error case: If the CPU is invalid or the thread cannot be created, return the error number.
+ */
+int create_pinned_thread(pthread_t *thread, int cpu, void *(*start_routine)(void *), void *arg) {
+    if (cpu < 0) {
+        return pthread_create(thread, NULL, start_routine, arg);
+    }
+    if (cpu >= CPU_SETSIZE) {
+        return EINVAL;
+    }
+
+    pthread_attr_t attr;
+    int error = pthread_attr_init(&attr);
+    if (error != 0) {
+        return error;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    error = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    if (error == 0) {
+        error = pthread_create(thread, &attr, start_routine, arg);
+    }
+    pthread_attr_destroy(&attr);
+    return error;
+}
+
+/*
+ * This function sets the memory policy of a range with mbind(2) so that its
+ * pages are faulted in on the given node. The node is preferred rather than
+ * required, so the range still gets memory when the node runs out. Pages that
+ * were touched before are left where they are.
+ *
+ * @param addr The start of the range, aligned to a page.
+ * @param length The length of the range.
+ * @param node The node to take pages from.
+ *
+ * @return true if the policy was set.
+ *
+ * Error case: If the node is out of range, set errno to EINVAL and return false.
+ * Error case: If mbind(2) fails, return false with errno set by it.
+ */
+bool bind_memory(void *addr, size_t length, int node) {
+    if (addr == NULL || node < 0 || node >= MAX_NUMA_NODES) {
+        errno = EINVAL;
+        return false;
+    }
+    unsigned long mask = 1UL << node;
+    // the kernel reads one bit less than maxnode says
+    if (syscall(SYS_mbind, addr, length, MPOL_PREFERRED, &mask, MAX_NUMA_NODES + 1, 0) != 0) {
+        debug("mbind to node %d failed: %s", node, strerror(errno));
+        return false;
+    }
+    return true;
+}
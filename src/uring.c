@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "connection.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define NUM_FIXED_BUFFERS 64
+
+/* The low bits of a submission's user_data say which operation completed */
+#define OP_ACCEPT 1
+#define OP_TICK 2
+#define OP_RECV 3
+#define OP_SEND 4
+#define OP_MASK 7
+
+typedef struct uring_conn_t {
+    conn_t *conn;
+    int fixed_buffer;
+} __attribute__((aligned(8))) uring_conn_t;
+
+typedef struct uring_t {
+    int ring_fd;
+    int listen_fd;
+    int idle_timeout;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, sq_local_tail, to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *fixed_buffers;
+    int free_buffers[NUM_FIXED_BUFFERS];
+    int num_free_buffers;
+    bool accepting, ticking;
+    struct __kernel_timespec tick;
+    conn_list_t idle;
+    pthread_t thread;
+} uring_t;
+
+/*
+ * Registers a block of receive buffers with the ring so the kernel doesn't
+ * have to map the pages of every receive. Running without them is fine.
+ */
+static void register_buffers(uring_t *ring) {
+    struct iovec iovecs[NUM_FIXED_BUFFERS];
+    size_t length = (size_t) NUM_FIXED_BUFFERS * CONN_BUFFER_SIZE;
+
+    ring->fixed_buffers = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->fixed_buffers == MAP_FAILED) {
+        ring->fixed_buffers = NULL;
+        return;
+    }
+    for (int i = 0; i < NUM_FIXED_BUFFERS; i++) {
+        iovecs[i].iov_base = ring->fixed_buffers + (size_t) i * CONN_BUFFER_SIZE;
+        iovecs[i].iov_len = CONN_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS, iovecs, NUM_FIXED_BUFFERS) < 0) {
+        debug("Running without registered buffers");
+        munmap(ring->fixed_buffers, length);
+        ring->fixed_buffers = NULL;
+        return;
+    }
+    for (int i = 0; i < NUM_FIXED_BUFFERS; i++) {
+        ring->free_buffers[i] = i;
+    }
+    ring->num_free_buffers = NUM_FIXED_BUFFERS;
+}
+
+/*
+ * Creates the ring and maps its submission and completion queues.
+ *
+ * @return false if the kernel does not support io_uring or the ring could not be mapped.
+ */
+static bool setup_ring(uring_t *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->ring_fd < 0) {
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(ring->ring_fd);
+        return false;
+    }
+    char *cq = sq;
+    if (!single_mmap) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            munmap(sq, sq_size);
+            close(ring->ring_fd);
+            return false;
+        }
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!single_mmap) {
+            munmap(cq, cq_size);
+        }
+        munmap(sq, sq_size);
+        close(ring->ring_fd);
+        return false;
+    }
+
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    register_buffers(ring);
+    return true;
+}
+
+/*
+ * Hands every queued submission to the kernel and optionally waits for completions.
+ *
+ * @return The number of submissions consumed, or -1 on error.
+ */
+static int submit(uring_t *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (1) {
+        int x = syscall(__NR_io_uring_enter, ring->ring_fd, ring->to_submit, wait_nr,
+            wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (x >= 0) {
+            ring->to_submit -= x;
+            return x;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Claims the next submission queue entry, flushing the queue first if it is full.
+ *
+ * @return A zeroed entry, or NULL if the kernel would not take more submissions.
+ */
+static struct io_uring_sqe *get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head == ring->sq_entries) {
+        submit(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head == ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+static void arm_accept(uring_t *ring) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    ring->accepting = true;
+}
+
+static void arm_tick(uring_t *ring) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &ring->tick;
+    sqe->len = 1;
+    sqe->user_data = OP_TICK;
+    ring->ticking = true;
+}
+
+/*
+ * Queues a receive for a connection. A connection with no partial request
+ * buffered receives into a free registered buffer, otherwise it receives
+ * straight into its own input buffer after the partial request.
+ */
+static bool arm_recv(uring_t *ring, uring_conn_t *uconn) {
+    conn_t *conn = uconn->conn;
+    bool fixed = conn->in_start == conn->in_end && ring->num_free_buffers > 0;
+    size_t space = fixed ? CONN_BUFFER_SIZE : conn_input_space(conn);
+    if (space == 0) {
+        return false;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->fd = conn->fd;
+    sqe->user_data = (uintptr_t) uconn | OP_RECV;
+    if (fixed) {
+        uconn->fixed_buffer = ring->free_buffers[--ring->num_free_buffers];
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t) (ring->fixed_buffers + (size_t) uconn->fixed_buffer * CONN_BUFFER_SIZE);
+        sqe->buf_index = uconn->fixed_buffer;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (uintptr_t) (conn->in + conn->in_end);
+    }
+    sqe->len = space;
+    return true;
+}
+
+static bool arm_send(uring_t *ring, uring_conn_t *uconn) {
+    conn_t *conn = uconn->conn;
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t) (conn->out + conn->out_start);
+    sqe->len = conn_pending_output(conn);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) uconn | OP_SEND;
+    return true;
+}
+
+static void close_uring_conn(uring_t *ring, uring_conn_t *uconn) {
+    unlink_conn(&ring->idle, uconn->conn);
+    close(uconn->conn->fd);
+    destroy_conn(uconn->conn);
+    free(uconn);
+}
+
+/*
+ * Queues the next operation of a connection once its last one completed.
+ * A connection has at most one operation in flight, so its buffers never
+ * move under the kernel: queued responses are sent before it receives again.
+ */
+static void continue_conn(uring_t *ring, uring_conn_t *uconn) {
+    conn_t *conn = uconn->conn;
+    bool armed = false;
+
+    if (conn_pending_output(conn) > 0) {
+        armed = arm_send(ring, uconn);
+    } else if (!conn->closing) {
+        armed = arm_recv(ring, uconn);
+    }
+    if (!armed) {
+        close_uring_conn(ring, uconn);
+    }
+}
+
+static void accept_conn(uring_t *ring, int fd) {
+    conn_t *conn = create_conn(fd);
+    uring_conn_t *uconn = malloc(sizeof(uring_conn_t));
+    if (conn == NULL || uconn == NULL) {
+        destroy_conn(conn);
+        free(uconn);
+        close(fd);
+        return;
+    }
+    uconn->conn = conn;
+    uconn->fixed_buffer = -1;
+    touch_conn(&ring->idle, conn);
+    continue_conn(ring, uconn);
+}
+
+/*
+ * Shuts down the connections that have been idle for longer than the
+ * keep-alive timeout. Their pending receive then completes and closes them.
+ */
+static void expire_idle_conns(uring_t *ring) {
+    time_t now = time(NULL);
+    while (ring->idle.head != NULL && now - ring->idle.head->last_active >= ring->idle_timeout) {
+        conn_t *conn = ring->idle.head;
+        debug("Closing idle connection %d", conn->fd);
+        shutdown(conn->fd, SHUT_RDWR);
+        touch_conn(&ring->idle, conn);
+    }
+}
+
+static void handle_completion(uring_t *ring, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & OP_MASK;
+
+    if (op == OP_ACCEPT) {
+        ring->accepting = false;
+        if (cqe->res >= 0) {
+            accept_conn(ring, cqe->res);
+        } else {
+            debug("Error Initiating connection");
+        }
+        return;
+    }
+    if (op == OP_TICK) {
+        ring->ticking = false;
+        expire_idle_conns(ring);
+        return;
+    }
+
+    uring_conn_t *uconn = (uring_conn_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+    conn_t *conn = uconn->conn;
+    bool ok = true;
+
+    if (op == OP_RECV) {
+        if (cqe->res > 0) {
+            if (uconn->fixed_buffer >= 0) {
+                ok = conn_feed(conn, ring->fixed_buffers + (size_t) uconn->fixed_buffer * CONN_BUFFER_SIZE, cqe->res);
+            } else {
+                conn->in_end += cqe->res;
+                ok = conn_process(conn);
+            }
+            touch_conn(&ring->idle, conn);
+        } else if (cqe->res == 0) {
+            // the client is done sending, answer what it already sent and hang up
+            conn->closing = true;
+        } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+            ok = false;
+        }
+        if (uconn->fixed_buffer >= 0) {
+            ring->free_buffers[ring->num_free_buffers++] = uconn->fixed_buffer;
+            uconn->fixed_buffer = -1;
+        }
+    } else if (op == OP_SEND) {
+        if (cqe->res >= 0) {
+            conn_consume_output(conn, cqe->res);
+            touch_conn(&ring->idle, conn);
+        } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        continue_conn(ring, uconn);
+    } else {
+        close_uring_conn(ring, uconn);
+    }
+}
+
+static void *uring_loop(void *arg) {
+    uring_t *ring = arg;
+
+    while (1) {
+        if (!ring->accepting) {
+            arm_accept(ring);
+        }
+        if (ring->idle_timeout > 0 && !ring->ticking) {
+            arm_tick(ring);
+        }
+
+        // one system call submits everything queued since the last pass and waits for more work
+        if (submit(ring, 1) < 0 && errno != EBUSY && errno != EAGAIN) {
+            debug("io_uring_enter failed");
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+            head++;
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            handle_completion(ring, &cqe);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts one io_uring loop per worker and waits on them.
+ *
+ * @param args A pointer to the arguments passed from the command line.
+ * @param listenfds The listening sockets, each shared by every num_listeners-th loop.
+ * @param num_listeners The number of listening sockets.
+ *
+ * @return false if io_uring is not available. Otherwise it does not return.
+ */
+bool run_uring(args_struct *args, int *listenfds, int num_listeners) {
+    uring_t *rings = calloc(args->NUM_WORKERS, sizeof(uring_t));
+    if (rings == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        uring_t *ring = &rings[i];
+        if (!setup_ring(ring)) {
+            if (i == 0) {
+                // the kernel lacks io_uring or it is disabled, let the caller fall back
+                free(rings);
+                return false;
+            }
+            exit(EXIT_FAILURE);
+        }
+        ring->listen_fd = listenfds[i % num_listeners];
+        ring->idle_timeout = args->KEEP_ALIVE;
+        ring->tick.tv_sec = 1;
+    }
+
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        if (create_pinned_thread(&rings[i].thread, worker_cpu(args, i), uring_loop, &rings[i]) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < args->NUM_WORKERS; i++) {
+        pthread_join(rings[i].thread, NULL);
+    }
+    free(rings);
+    return true;
+}
@@ -1,4 +1,50 @@
 #include "utils.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+/* The key of the seeded hash functions, shared by every map in the process */
+static uint64_t hash_key[2] = {0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull};
+
+static const uint64_t wyhash_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+/*
+ * Loads 8 or 4 bytes of a key in the byte order of the machine, without
+ * caring about alignment.
+ */
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+/*
+ * Multiplies two words into 128 bits and folds the halves together.
+ */
+static inline uint64_t wyhash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/*
+ * Folds a 64-bit hash into the 32 bits a map uses, keeping every input bit.
+ */
+static inline uint32_t fold_hash(uint64_t hash) {
+    return (uint32_t) (hash ^ (hash >> 32));
+}
 
 /*
  * Computes the hash of a byte stream.
@@ -22,9 +68,150 @@ uint32_t jenkins_one_at_a_time_hash(map_key_t map_key) {
 }
 
 /*
- * Gets the index for a key using the hash function
- * in the self parameter.
+ * Computes the hash of a byte stream with wyhash, which consumes 16 bytes per
+ * 64x64 bit multiply and runs three independent multiply chains over long keys.
+ * It is seeded with the process's hash key.
+ */
+uint32_t wyhash_hash(map_key_t map_key) {
+    const uint8_t *p = map_key.key_base;
+    size_t length = map_key.key_len;
+    uint64_t seed = hash_key[0] ^ wyhash_mix(hash_key[0] ^ wyhash_secret[0], wyhash_secret[1]);
+    uint64_t a, b;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t middle = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+        } else if (length > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wyhash_mix(read64(p) ^ wyhash_secret[1], read64(p + 8) ^ seed);
+                see1 = wyhash_mix(read64(p + 16) ^ wyhash_secret[2], read64(p + 24) ^ see1);
+                see2 = wyhash_mix(read64(p + 32) ^ wyhash_secret[3], read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wyhash_mix(read64(p) ^ wyhash_secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // the last 16 bytes may overlap the ones already mixed
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    __uint128_t r = (__uint128_t) (a ^ wyhash_secret[1]) * (b ^ seed);
+    a = (uint64_t) r;
+    b = (uint64_t) (r >> 64);
+    return fold_hash(wyhash_mix(a ^ wyhash_secret[0] ^ length, b ^ wyhash_secret[1]));
+}
+
+#define SIPROUND(v0, v1, v2, v3)                                  \
+    do {                                                          \
+        v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32); \
+        v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;                  \
+        v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;                  \
+        v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32); \
+    } while (0)
+
+/*
+ * Computes SipHash-2-4 of a byte stream keyed with the process's hash key. It
+ * is slower than wyhash, but a client that doesn't know the key can't choose
+ * keys that collide, even after watching how the map behaves.
+ */
+uint32_t siphash_hash(map_key_t map_key) {
+    const uint8_t *p = map_key.key_base;
+    size_t length = map_key.key_len;
+    uint64_t v0 = hash_key[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = hash_key[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = hash_key[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = hash_key[1] ^ 0x7465646279746573ull;
+
+    const uint8_t *end = p + (length & ~(size_t) 7);
+    for (; p != end; p += 8) {
+        uint64_t m = read64(p);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    uint64_t last = (uint64_t) length << 56;
+    for (size_t i = 0; i < (length & 7); i++) {
+        last |= (uint64_t) p[i] << (8 * i);
+    }
+    v3 ^= last;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++) {
+        SIPROUND(v0, v1, v2, v3);
+    }
+    return fold_hash(v0 ^ v1 ^ v2 ^ v3);
+}
+
+/*
+ * Looks a hash function up by the name it is selected with on the command line.
+ *
+ * @param name `jenkins`, `wyhash` or `siphash`.
+ * @return The hash function, or NULL if there is none with that name.
+ */
+hash_func_f hash_function_by_name(const char *name) {
+    if (strcmp(name, "jenkins") == 0) {
+        return jenkins_one_at_a_time_hash;
+    } else if (strcmp(name, "wyhash") == 0) {
+        return wyhash_hash;
+    } else if (strcmp(name, "siphash") == 0) {
+        return siphash_hash;
+    }
+    return NULL;
+}
+
+/*
+ * Sets the key of the seeded hash functions. It must not change while any map
+ * hashes with them, or stored keys can no longer be found.
+ */
+void seed_hash_functions(uint64_t k0, uint64_t k1) {
+    hash_key[0] = k0;
+    hash_key[1] = k1;
+}
+
+/*
+ * Keys the seeded hash functions with random bytes from the kernel, so every
+ * process places keys differently and a client can't precompute a set of keys
+ * that all land on the same probe chain. Falls back to the clock and pid if
+ * getrandom(2) is unavailable.
+ */
+void random_seed_hash_functions(void) {
+    uint64_t key[2];
+    if (getrandom(key, sizeof(key), 0) != sizeof(key)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        key[0] = ((uint64_t) now.tv_sec << 32) ^ (uint64_t) now.tv_nsec;
+        key[1] = wyhash_mix(key[0] ^ wyhash_secret[2], (uint64_t) getpid() ^ wyhash_secret[3]);
+    }
+    seed_hash_functions(key[0], key[1]);
+}
+
+/*
+ * Gets the home slot of a key in the current table of self using the hash
+ * function in the self parameter. Tables have a power of two slots, so the
+ * hash is masked instead of reduced with a modulo.
  */
 int get_index(hashmap_t *self, map_key_t key) {
-    return self->hash_function(key) % self->capacity;
+    return (self->hash_function(key) >> 7) & (self->table->num_groups * MAP_GROUP_SIZE - 1);
 }
@@ -0,0 +1,60 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdint.h>
+#include <string.h>
+#include "debug.h"
+#include "arena.h"
+
+arena_t arena;
+
+void arena_setup(void) {
+    arena_init(&arena);
+}
+
+void arena_teardown(void) {
+    arena_destroy(&arena);
+}
+
+Test(arena_suite, 00_bump, .timeout = 2, .init = arena_setup, .fini = arena_teardown) {
+    char *first = arena_alloc(&arena, 10);
+    char *second = arena_alloc(&arena, 100);
+    cr_assert_not_null(first, "Could not allocate from an empty arena");
+    cr_assert_not_null(second, "Could not allocate from the block");
+    cr_assert_eq((uintptr_t) second % 16, 0, "Allocations are not aligned");
+    cr_assert_eq(second, first + 16, "The second allocation did not follow the first one");
+    memset(first, 'a', 10);
+    memset(second, 'b', 100);
+    cr_assert_eq(first[9], 'a', "The allocations overlap");
+}
+
+Test(arena_suite, 01_reuse, .timeout = 2, .init = arena_setup, .fini = arena_teardown) {
+    char *first = arena_alloc(&arena, 64);
+    arena_reset(&arena);
+    char *second = arena_alloc(&arena, 64);
+    cr_assert_eq(first, second, "The block was not reused after a reset");
+    cr_assert_eq(arena.capacity, ARENA_BLOCK_SIZE, "Block of %zu bytes. Expected %d", arena.capacity, ARENA_BLOCK_SIZE);
+}
+
+Test(arena_suite, 02_overflow_grows_block, .timeout = 2, .init = arena_setup, .fini = arena_teardown) {
+    // the first allocation sizes the block, the second one no longer fits
+    arena_alloc(&arena, 1000);
+    char *large = arena_alloc(&arena, 3 * ARENA_BLOCK_SIZE);
+    cr_assert_not_null(large, "Could not allocate past the block");
+    memset(large, 'c', 3 * ARENA_BLOCK_SIZE);
+    cr_assert_eq(arena.overflow_bytes, 3 * ARENA_BLOCK_SIZE, "The allocation did not overflow the block");
+
+    arena_reset(&arena);
+    cr_assert_null(arena.overflow, "The overflow was not freed");
+    cr_assert(arena.capacity >= 1008 + 3 * ARENA_BLOCK_SIZE, "The block did not grow to the request");
+
+    arena_alloc(&arena, 1000);
+    arena_alloc(&arena, 3 * ARENA_BLOCK_SIZE);
+    cr_assert_eq(arena.overflow_bytes, 0, "The same request did not fit the grown block");
+}
+
+Test(arena_suite, 03_max_block, .timeout = 2, .init = arena_setup, .fini = arena_teardown) {
+    char *huge = arena_alloc(&arena, ARENA_MAX_BLOCK_SIZE + 1);
+    cr_assert_not_null(huge, "Could not allocate more than a block may hold");
+    arena_reset(&arena);
+    cr_assert(arena.capacity <= ARENA_MAX_BLOCK_SIZE, "The block grew past ARENA_MAX_BLOCK_SIZE");
+}
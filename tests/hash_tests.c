@@ -0,0 +1,108 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "cream.h"
+#include "utils.h"
+#include "sharded_map.h"
+#define NUM_KEYS 4096
+#define NUM_BUCKETS 256
+
+static uint8_t test_bytes[MAX_KEY_SIZE];
+
+/* The key of the SipHash reference vectors: the bytes 0x00 to 0x0f */
+static void hash_init(void) {
+    for (size_t i = 0; i < sizeof(test_bytes); i++) {
+        test_bytes[i] = i;
+    }
+    seed_hash_functions(0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull);
+}
+
+static uint32_t fold(uint64_t hash) {
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+/* Pearson's statistic of NUM_KEYS keys over num_buckets buckets, close to num_buckets when uniform */
+static double chi_square(int *buckets, int num_buckets) {
+    double expected = (double) NUM_KEYS / num_buckets;
+    double sum = 0;
+    for (int b = 0; b < num_buckets; b++) {
+        sum += (buckets[b] - expected) * (buckets[b] - expected) / expected;
+    }
+    return sum;
+}
+
+static void hash_free_function(map_key_t key, map_val_t val) {
+    free(key.key_base);
+}
+
+Test(hash_suite, 00_siphash_vectors, .timeout = 2, .init = hash_init) {
+    cr_assert_eq(siphash_hash(MAP_KEY(test_bytes, 0)), fold(0x726fdb47dd0e0e31ull), "Empty message does not match SipHash-2-4");
+    cr_assert_eq(siphash_hash(MAP_KEY(test_bytes, 15)), fold(0xa129ca6149be45e5ull), "15 byte message does not match SipHash-2-4");
+}
+
+Test(hash_suite, 01_seeded, .timeout = 2, .init = hash_init) {
+    hash_func_f functions[] = {wyhash_hash, siphash_hash};
+    for (int f = 0; f < 2; f++) {
+        uint32_t before = functions[f](MAP_KEY(test_bytes, 100));
+        seed_hash_functions(1, 2);
+        uint32_t after = functions[f](MAP_KEY(test_bytes, 100));
+        seed_hash_functions(0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull);
+        cr_assert_neq(before, after, "Hash function %d ignores its seed", f);
+        cr_assert_eq(before, functions[f](MAP_KEY(test_bytes, 100)), "Hash function %d is not deterministic", f);
+    }
+}
+
+Test(hash_suite, 02_every_length, .timeout = 2, .init = hash_init) {
+    // every tail and block path, each length must give a different hash of the same bytes
+    hash_func_f functions[] = {wyhash_hash, siphash_hash};
+    for (int f = 0; f < 2; f++) {
+        for (size_t length = 0; length <= 200; length++) {
+            uint8_t *copy = malloc(length + 1);
+            memcpy(copy, test_bytes, length);
+            uint32_t hash = functions[f](MAP_KEY(copy, length));
+            free(copy);
+            cr_assert_neq(hash, functions[f](MAP_KEY(test_bytes, length + 1)), "Lengths %zu and %zu collide", length, length + 1);
+        }
+    }
+}
+
+Test(hash_suite, 03_spread, .timeout = 2, .init = hash_init) {
+    // sequential integer keys must spread evenly over both the tag and the group bits
+    int tags[128] = {0};
+    int groups[NUM_BUCKETS] = {0};
+    for (int i = 0; i < NUM_KEYS; i++) {
+        uint32_t hash = wyhash_hash(MAP_KEY(&i, sizeof(int)));
+        tags[hash & 0x7F]++;
+        groups[(hash >> 7) % NUM_BUCKETS]++;
+    }
+    cr_assert_lt(chi_square(tags, 128), 2 * 128, "Tags are not uniform");
+    cr_assert_lt(chi_square(groups, NUM_BUCKETS), 2 * NUM_BUCKETS, "Groups are not uniform");
+}
+
+Test(hash_suite, 04_long_keys, .timeout = 5, .init = hash_init) {
+    sharded_map_t *map = create_sharded_map(NUM_KEYS, 8, wyhash_hash, hash_free_function, GROUP_PROBING);
+    cr_assert_not_null(map, "Map returned was NULL");
+
+    // keys of up to MAX_KEY_SIZE bytes that share everything but their last 4 bytes
+    size_t length = MAX_KEY_SIZE;
+    for (int i = 0; i < NUM_KEYS / 4; i++) {
+        length = length > 200 ? length - 7 : MAX_KEY_SIZE;
+        uint8_t *key = malloc(length);
+        memcpy(key, test_bytes, length - sizeof(int));
+        memcpy(key + length - sizeof(int), &i, sizeof(int));
+        cr_assert(sharded_put(map, MAP_KEY(key, length), MAP_VAL(key, length), false), "Could not insert key %d", i);
+    }
+
+    length = MAX_KEY_SIZE;
+    uint8_t probe[MAX_KEY_SIZE];
+    for (int i = 0; i < NUM_KEYS / 4; i++) {
+        length = length > 200 ? length - 7 : MAX_KEY_SIZE;
+        memcpy(probe, test_bytes, length);
+        memcpy(probe + length - sizeof(int), &i, sizeof(int));
+        map_val_t val = sharded_get(map, MAP_KEY(probe, length));
+        cr_assert(val.val_base != NULL && val.val_len == length, "Key %d was not found", i);
+    }
+    invalidate_sharded_map(map);
+}
@@ -3,8 +3,10 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include "debug.h"
 #include "hashmap.h"
+#include "epoch.h"
 #define NUM_THREADS 100
 #define MAP_KEY(kbase, klen) (map_key_t) {.key_base = kbase, .key_len = klen}
 #define MAP_VAL(vbase, vlen) (map_val_t) {.val_base = vbase, .val_len = vlen}
@@ -85,3 +87,480 @@ Test(map_suite, 02_multithreaded, .timeout = 2, .init = map_init, .fini = map_fi
     int num_items = global_map->size;
     cr_assert_eq(num_items, NUM_THREADS, "Had %d items in map. Expected %d", num_items, NUM_THREADS);
 }
+
+Test(map_suite, 03_get_batch, .timeout = 2, .init = map_init, .fini = map_fini) {
+    map_key_t keys[NUM_THREADS];
+    map_val_t vals[NUM_THREADS];
+    int missing = -1;
+
+    // fill half of the map, the odd keys are never inserted
+    for(int index = 0; index < NUM_THREADS / 2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index * 2;
+        *val_ptr = index * 4;
+        put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+    }
+
+    int *key_ints = malloc(NUM_THREADS * sizeof(int));
+    for(int index = 0; index < NUM_THREADS; index++) {
+        key_ints[index] = index;
+        keys[index] = MAP_KEY(&key_ints[index], sizeof(int));
+    }
+    keys[NUM_THREADS - 1] = MAP_KEY(&missing, sizeof(int));
+
+    size_t found = get_batch(global_map, keys, vals, NUM_THREADS);
+    cr_assert_eq(found, NUM_THREADS / 2, "Found %zu keys. Expected %d", found, NUM_THREADS / 2);
+    for(int index = 0; index < NUM_THREADS - 1; index++) {
+        if (index % 2 == 0) {
+            cr_assert_not_null(vals[index].val_base, "Key %d was not found", index);
+            cr_assert_eq(*(int *) vals[index].val_base, index * 2, "Wrong value for key %d", index);
+        } else {
+            cr_assert_null(vals[index].val_base, "Key %d should be missing", index);
+            cr_assert_eq(vals[index].val_len, 0, "Missing key %d has a length", index);
+        }
+    }
+    free(key_ints);
+}
+
+Test(map_suite, 04_put_batch, .timeout = 2, .init = map_init, .fini = map_fini) {
+    map_key_t keys[NUM_THREADS];
+    map_val_t vals[NUM_THREADS];
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 3;
+        keys[index] = MAP_KEY(key_ptr, sizeof(int));
+        vals[index] = MAP_VAL(val_ptr, sizeof(int));
+    }
+
+    size_t inserted = put_batch(global_map, keys, vals, NUM_THREADS, false);
+    cr_assert_eq(inserted, NUM_THREADS, "Inserted %zu pairs. Expected %d", inserted, NUM_THREADS);
+    cr_assert_eq(global_map->size, NUM_THREADS, "Had %d items in map. Expected %d", global_map->size, NUM_THREADS);
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(val.val_base, "Key %d was not found", index);
+        cr_assert_eq(*(int *) val.val_base, index * 3, "Wrong value for key %d", index);
+    }
+}
+
+#define NUM_ROUNDS 200
+
+static volatile bool readers_done;
+
+void *thread_overwrite(void *arg) {
+    // keep replacing every value while the readers look at them
+    for(int round = 1; round <= NUM_ROUNDS; round++) {
+        for(int index = 0; index < NUM_THREADS; index++) {
+            int *key_ptr = malloc(sizeof(int));
+            int *val_ptr = malloc(sizeof(int));
+            *key_ptr = index;
+            *val_ptr = round * NUM_THREADS + index;
+            put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+        }
+    }
+    readers_done = true;
+    return NULL;
+}
+
+void *thread_read(void *arg) {
+    long bad = 0;
+    while(!readers_done) {
+        for(int index = 0; index < NUM_THREADS; index++) {
+            epoch_enter();
+            map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+            if (val.val_base == NULL || val.val_len != sizeof(int) || *(int *) val.val_base % NUM_THREADS != index) {
+                bad++;
+            }
+            epoch_exit();
+        }
+    }
+    return (void *) bad;
+}
+
+Test(map_suite, 05_concurrent_reads, .timeout = 5, .init = map_init, .fini = map_fini) {
+    pthread_t writer;
+    pthread_t readers[4];
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+    }
+
+    readers_done = false;
+    for(int index = 0; index < 4; index++) {
+        if(pthread_create(&readers[index], NULL, thread_read, NULL) != 0)
+            exit(EXIT_FAILURE);
+    }
+    if(pthread_create(&writer, NULL, thread_overwrite, NULL) != 0)
+        exit(EXIT_FAILURE);
+
+    pthread_join(writer, NULL);
+    for(int index = 0; index < 4; index++) {
+        void *bad;
+        pthread_join(readers[index], &bad);
+        cr_assert_eq((long) bad, 0, "Reader %d saw %ld missing or torn values", index, (long) bad);
+    }
+    cr_assert_eq(global_map->size, NUM_THREADS, "Had %d items in map. Expected %d", global_map->size, NUM_THREADS);
+}
+
+Test(map_suite, 06_get_ref, .timeout = 2, .init = map_init, .fini = map_fini) {
+    int *key_ptr = malloc(sizeof(int));
+    int *val_ptr = malloc(sizeof(int));
+    *key_ptr = 7;
+    *val_ptr = 70;
+    put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+
+    int key = 7;
+    map_ref_t ref = get_ref(global_map, MAP_KEY(&key, sizeof(int)));
+    cr_assert_not_null(ref.val.val_base, "Key %d was not found", key);
+    cr_assert_not_null(ref.entry, "No reference was taken");
+
+    // replacing the value and clearing the map must not free the referenced value
+    key_ptr = malloc(sizeof(int));
+    val_ptr = malloc(sizeof(int));
+    *key_ptr = 7;
+    *val_ptr = 71;
+    put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+    clear_map(global_map);
+
+    cr_assert_eq(*(int *) ref.val.val_base, 70, "Referenced value changed to %d", *(int *) ref.val.val_base);
+    release_ref(ref);
+
+    map_ref_t missing = get_ref(global_map, MAP_KEY(&key, sizeof(int)));
+    cr_assert_null(missing.val.val_base, "Key %d is still in the cleared map", key);
+    cr_assert_null(missing.entry, "A reference was taken for a missing key");
+}
+
+Test(map_suite, 07_delete_and_refill, .timeout = 2, .init = map_init, .fini = map_fini) {
+    for (int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+    }
+    for (int index = 0; index < NUM_THREADS; index += 2) {
+        delete(global_map, MAP_KEY(&index, sizeof(int)));
+    }
+    cr_assert_eq(global_map->size, NUM_THREADS / 2, "Had %d items in map. Expected %d", global_map->size, NUM_THREADS / 2);
+
+    for (int index = 0; index < NUM_THREADS; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        if (index % 2 == 0) {
+            cr_assert_null(val.val_base, "Deleted key %d was found", index);
+        } else {
+            cr_assert_not_null(val.val_base, "Key %d was not found", index);
+        }
+    }
+
+    // the deleted slots must be reusable without forcing
+    for (int index = 0; index < NUM_THREADS; index += 2) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index + NUM_THREADS;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false), "Could not reinsert key %d", index);
+    }
+    for (int index = 0; index < NUM_THREADS; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        int expected = index % 2 == 0 ? index + NUM_THREADS : index;
+        cr_assert(val.val_base != NULL && *(int *) val.val_base == expected, "Key %d does not map to %d", index, expected);
+    }
+    cr_assert_eq(global_map->size, NUM_THREADS, "Had %d items in map. Expected %d", global_map->size, NUM_THREADS);
+}
+
+Test(map_suite, 08_robin_hood_churn, .timeout = 5, .init = map_init, .fini = map_fini) {
+    invalidate_map(global_map);
+    free(global_map);
+    global_map = create_probing_map(NUM_THREADS, jenkins_hash, map_free_function, ROBIN_HOOD_PROBING);
+    cr_assert_not_null(global_map, "Map returned was NULL");
+
+    // keep the map full while keys come and go, the way EVICT and PUT traffic does
+    for (int index = 0; index < NUM_THREADS * 50; index++) {
+        if (index >= NUM_THREADS) {
+            int old = index - NUM_THREADS;
+            map_node_t removed = delete(global_map, MAP_KEY(&old, sizeof(int)));
+            cr_assert_not_null(removed.key.key_base, "Key %d was not deleted", old);
+        }
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false), "Could not insert key %d", index);
+    }
+
+    for (int index = 0; index < NUM_THREADS * 50; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        if (index < NUM_THREADS * 49) {
+            cr_assert_null(val.val_base, "Deleted key %d was found", index);
+        } else {
+            cr_assert(val.val_base != NULL && *(int *) val.val_base == index, "Key %d was not found", index);
+        }
+    }
+
+    probe_stats_t stats = map_probe_stats(global_map);
+    cr_assert_eq(stats.num_entries, NUM_THREADS, "Measured %u keys. Expected %d", stats.num_entries, NUM_THREADS);
+    cr_assert_geq(stats.total_probe, stats.num_entries, "Every key takes at least one probe");
+    cr_assert_lt(stats.max_probe, NUM_THREADS / 2, "Probes grew to %u slots", stats.max_probe);
+}
+
+#define GROWN_ENTRIES (NUM_THREADS * 100)
+
+static int grown_inserted;
+
+void *thread_read_growing(void *arg) {
+    long bad = 0;
+    while(!readers_done) {
+        // every key published so far must stay visible while the table grows under the reader
+        int inserted = __atomic_load_n(&grown_inserted, __ATOMIC_ACQUIRE);
+        for(int index = 0; index < inserted; index += 7) {
+            map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+            if (val.val_base == NULL) {
+                bad++;
+            }
+        }
+    }
+    return (void *) bad;
+}
+
+Test(map_suite, 09_incremental_growth, .timeout = 10, .init = map_init, .fini = map_fini) {
+    probe_modes modes[2] = {GROUP_PROBING, ROBIN_HOOD_PROBING};
+    for (int mode = 0; mode < 2; mode++) {
+        invalidate_map(global_map);
+        free(global_map);
+        global_map = create_probing_map(GROWN_ENTRIES, jenkins_hash, map_free_function, modes[mode]);
+        cr_assert_not_null(global_map, "Map returned was NULL");
+        uint32_t initial_groups = global_map->table->num_groups;
+
+        pthread_t readers[4];
+        grown_inserted = 0;
+        readers_done = false;
+        for(int index = 0; index < 4; index++) {
+            if(pthread_create(&readers[index], NULL, thread_read_growing, NULL) != 0)
+                exit(EXIT_FAILURE);
+        }
+        for(int index = 0; index < GROWN_ENTRIES; index++) {
+            int *key_ptr = malloc(sizeof(int));
+            int *val_ptr = malloc(sizeof(int));
+            *key_ptr = index;
+            *val_ptr = index;
+            cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false), "Could not insert key %d", index);
+            __atomic_store_n(&grown_inserted, index + 1, __ATOMIC_RELEASE);
+        }
+        readers_done = true;
+        for(int index = 0; index < 4; index++) {
+            void *bad;
+            pthread_join(readers[index], &bad);
+            cr_assert_eq((long) bad, 0, "Reader %d missed %ld keys during growth", index, (long) bad);
+        }
+
+        cr_assert_eq(global_map->table->num_groups, global_map->max_groups, "The table did not grow to fit the capacity");
+        cr_assert_lt(initial_groups, global_map->max_groups, "The table did not start small");
+        cr_assert_eq(global_map->table->num_groups & (global_map->table->num_groups - 1), 0, "Group count is not a power of two");
+        for(int index = 0; index < GROWN_ENTRIES; index++) {
+            map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+            cr_assert(val.val_base != NULL && *(int *) val.val_base == index, "Key %d was lost while growing", index);
+        }
+        cr_assert_eq(map_probe_stats(global_map).num_entries, GROWN_ENTRIES, "Keys were duplicated or lost while migrating");
+    }
+}
+
+Test(map_suite, 10_inline_keys, .timeout = 2, .init = map_init, .fini = map_fini) {
+    // keys on both sides of MAP_INLINE_KEY_SIZE that only differ near their end
+    size_t lengths[] = {1, MAP_INLINE_KEY_SIZE - 1, MAP_INLINE_KEY_SIZE, MAP_INLINE_KEY_SIZE + 1, 2 * MAP_INLINE_KEY_SIZE};
+    int num_lengths = sizeof(lengths) / sizeof(lengths[0]);
+    for (int i = 0; i < num_lengths; i++) {
+        char *key_ptr = malloc(lengths[i]);
+        int *val_ptr = malloc(sizeof(int));
+        memset(key_ptr, 'k', lengths[i]);
+        *val_ptr = i;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, lengths[i]), MAP_VAL(val_ptr, sizeof(int)), false), "Could not insert a key of %zu bytes", lengths[i]);
+    }
+
+    char probe[2 * MAP_INLINE_KEY_SIZE];
+    for (int i = 0; i < num_lengths; i++) {
+        memset(probe, 'k', lengths[i]);
+        map_val_t val = get(global_map, MAP_KEY(probe, lengths[i]));
+        cr_assert(val.val_base != NULL && *(int *) val.val_base == i, "The key of %zu bytes does not map to %d", lengths[i], i);
+
+        probe[lengths[i] - 1] = 'x';
+        val = get(global_map, MAP_KEY(probe, lengths[i]));
+        cr_assert_null(val.val_base, "A different key of %zu bytes was found", lengths[i]);
+    }
+
+    for (int i = 0; i < num_lengths; i++) {
+        memset(probe, 'k', lengths[i]);
+        map_node_t removed = delete(global_map, MAP_KEY(probe, lengths[i]));
+        cr_assert(removed.tombstone && removed.key.key_len == lengths[i], "Could not delete the key of %zu bytes", lengths[i]);
+    }
+    cr_assert_eq(global_map->size, 0, "Had %d items in map. Expected 0", global_map->size);
+}
+
+Test(map_suite, 11_clock_eviction, .timeout = 2, .init = map_init, .fini = map_fini) {
+    for (int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+    }
+    // the first half is hot, so evictions have to come out of the second half
+    for (int index = 0; index < NUM_THREADS / 2; index++) {
+        cr_assert_not_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Key %d was not found", index);
+    }
+    for (int index = NUM_THREADS; index < NUM_THREADS + NUM_THREADS / 2; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), true), "Could not evict for key %d", index);
+    }
+
+    cr_assert_eq(global_map->size, NUM_THREADS, "Had %d items in map. Expected %d", global_map->size, NUM_THREADS);
+    for (int index = 0; index < NUM_THREADS / 2; index++) {
+        cr_assert_not_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Hot key %d was evicted", index);
+    }
+    for (int index = NUM_THREADS / 2; index < NUM_THREADS; index++) {
+        cr_assert_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Cold key %d was kept", index);
+    }
+}
+
+Test(map_suite, 12_ttl_expiry, .timeout = 5, .init = map_init, .fini = map_fini) {
+    // the TTLs land on the lowest level of the timing wheel and the one above it
+    uint32_t ttls[] = {0, 20, 300, 700};
+    int num_ttls = sizeof(ttls) / sizeof(ttls[0]);
+    for (int index = 0; index < num_ttls; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        cr_assert(put_ttl(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), ttls[index], false), "Could not insert key %d", index);
+    }
+    for (int index = 0; index < num_ttls; index++) {
+        cr_assert_not_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Key %d expired too early", index);
+    }
+
+    usleep(100 * 1000);
+    int index = 1;
+    cr_assert_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Expired key %d was found", index);
+    cr_assert_eq(expire_map(global_map), 1, "Expected exactly the first TTL to run out");
+    cr_assert_eq(global_map->size, num_ttls - 1, "Had %d items in map. Expected %d", global_map->size, num_ttls - 1);
+
+    usleep(700 * 1000);
+    cr_assert_eq(expire_map(global_map), 2, "Expected the longer TTLs to run out");
+    cr_assert_eq(global_map->size, 1, "Had %d items in map. Expected 1", global_map->size);
+    index = 0;
+    cr_assert_not_null(get(global_map, MAP_KEY(&index, sizeof(int))).val_base, "Key without a TTL expired");
+    cr_assert_eq(global_map->wheel.count, 0, "Expired keys were left on the timing wheel");
+}
+
+Test(map_suite, 13_memory_limit, .timeout = 2, .init = map_init, .fini = map_fini) {
+    // every pair is charged its key, its value and its entry
+    size_t charge = 2 * sizeof(int) + sizeof(map_entry_t);
+    int limit = 10;
+    set_memory_limit(global_map, limit * charge, NULL);
+
+    for (int index = 0; index < 2 * limit; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        bool force = index >= limit;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), force), "Could not insert key %d", index);
+        cr_assert(global_map->bytes <= limit * charge, "Charged %lu bytes, more than the limit", (unsigned long) global_map->bytes);
+    }
+    cr_assert_eq(global_map->size, limit, "Had %d items in map. Expected %d", global_map->size, limit);
+
+    int key = 2 * limit;
+    int val = 0;
+    cr_assert_not(put(global_map, MAP_KEY(&key, sizeof(int)), MAP_VAL(&val, sizeof(int)), false), "Went past the memory limit without force");
+    cr_assert_eq(errno, ENOMEM, "errno was not ENOMEM");
+
+    clear_map(global_map);
+    cr_assert_eq(global_map->bytes, 0, "Charged %lu bytes after clearing the map", (unsigned long) global_map->bytes);
+}
+
+Test(map_suite, 14_single_owner, .timeout = 2, .init = map_init, .fini = map_fini) {
+    set_single_owner(global_map);
+    uint32_t seq = global_map->seq;
+
+    // enough keys to grow the table while the owner keeps reading
+    for (int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false), "Could not insert key %d", index);
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert(val.val_base != NULL && *(int *) val.val_base == index, "Could not read back key %d", index);
+    }
+
+    for (int index = 0; index < NUM_THREADS; index += 2) {
+        map_node_t removed = delete(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert_not_null(removed.key.key_base, "Could not delete key %d", index);
+    }
+    for (int index = 0; index < NUM_THREADS; index++) {
+        bool found = get(global_map, MAP_KEY(&index, sizeof(int))).val_base != NULL;
+        cr_assert_eq(found, index % 2 == 1, "Key %d was %s", index, found ? "not deleted" : "lost");
+    }
+    cr_assert_eq(global_map->size, NUM_THREADS / 2, "Had %d items in map. Expected %d", global_map->size, NUM_THREADS / 2);
+    cr_assert_eq(global_map->seq, seq, "A single-owner map moved its sequence number");
+    // nobody else reads the map, so nothing waits for an epoch
+    cr_assert_eq(global_map->num_retired, 0, "A single-owner map retired %zu deleted entries", global_map->num_retired);
+    cr_assert_null(global_map->retired_table, "A single-owner map retired its old table");
+}
+
+Test(map_suite, 15_numa_node, .timeout = 2, .init = map_init, .fini = map_fini) {
+    set_numa_node(global_map, 0);
+    cr_assert_eq(global_map->numa_node, 0, "The map is not placed on node 0");
+
+    // every table the map grows into is allocated on the node
+    for (int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false), "Could not insert key %d", index);
+    }
+    cr_assert((uintptr_t) global_map->table->slots % sysconf(_SC_PAGESIZE) == 0, "A table on a node does not start on a page");
+    // heap pages may have been touched on another node already, so the table is mapped fresh
+    cr_assert(global_map->table->mapped, "A table on a node came from the heap");
+    for (int index = 0; index < NUM_THREADS; index++) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert(val.val_base != NULL && *(int *) val.val_base == index, "Could not read back key %d", index);
+    }
+
+    errno = 0;
+    set_numa_node(global_map, -2);
+    cr_assert_eq(errno, EINVAL, "errno was not EINVAL");
+}
+
+Test(map_suite, 16_huge_pages, .timeout = 5) {
+    // enough keys for the table to grow past a huge page of slots
+    int num_keys = 2 * HUGE_PAGE_SIZE / sizeof(map_slot_t) * 7 / 8 - MAP_GROUP_SIZE;
+    set_huge_pages(true);
+    global_map = create_map(num_keys, jenkins_hash, map_free_function);
+    for (int index = 0; index < num_keys; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        cr_assert(put(global_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false), "Could not insert key %d", index);
+    }
+    set_huge_pages(false);
+
+    cr_assert(global_map->table->huge, "A table of %u groups was not mapped on huge pages", global_map->table->num_groups);
+    cr_assert_eq((uintptr_t) global_map->table->slots % HUGE_PAGE_SIZE, 0, "The slots do not start on a huge page");
+    for (int index = 0; index < num_keys; index += 97) {
+        map_val_t val = get(global_map, MAP_KEY(&index, sizeof(int)));
+        cr_assert(val.val_base != NULL && *(int *) val.val_base == index, "Could not read back key %d", index);
+    }
+    invalidate_map(global_map);
+}
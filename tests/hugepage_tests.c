@@ -0,0 +1,64 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "debug.h"
+#include "hugepage.h"
+
+static uint64_t mapped_bytes(void) {
+    huge_page_stats_t stats = huge_page_stats();
+    return stats.hugetlb_bytes + stats.transparent_bytes + stats.small_bytes;
+}
+
+Test(hugepage_suite, 00_alloc, .timeout = 2) {
+    uint64_t before = mapped_bytes();
+    page_sizes pages;
+    size_t size = HUGE_PAGE_SIZE + HUGE_PAGE_SIZE / 2;
+    char *memory = huge_alloc(size, &pages);
+    cr_assert_not_null(memory, "Could not map %zu bytes", size);
+    cr_assert_eq((uintptr_t) memory % HUGE_PAGE_SIZE, 0, "The memory is not aligned to a huge page");
+    cr_assert_eq(memory[0], 0, "The memory is not zeroed");
+    cr_assert_eq(memory[size - 1], 0, "The memory is not zeroed");
+    memset(memory, 0xAB, 2 * HUGE_PAGE_SIZE);
+    cr_assert_eq(mapped_bytes(), before + 2 * HUGE_PAGE_SIZE, "Mapping %zu bytes was not counted as two huge pages", size);
+
+    huge_page_stats_t stats = huge_page_stats();
+    uint64_t backed = pages == HUGETLB_PAGES ? stats.hugetlb_bytes :
+                      pages == TRANSPARENT_HUGE_PAGES ? stats.transparent_bytes : stats.small_bytes;
+    cr_assert_geq(backed, 2 * HUGE_PAGE_SIZE, "The memory was counted for the wrong kind of page");
+
+    huge_free(memory, size, pages);
+    cr_assert_eq(mapped_bytes(), before, "Unmapping was not counted");
+}
+
+Test(hugepage_suite, 01_invalid, .timeout = 2) {
+    page_sizes pages;
+    errno = 0;
+    cr_assert_null(huge_alloc(0, &pages), "Mapped an empty range");
+    cr_assert_eq(errno, EINVAL, "errno was not EINVAL");
+    cr_assert_null(huge_alloc(HUGE_PAGE_SIZE, NULL), "Mapped memory without saying what backs it");
+    huge_free(NULL, HUGE_PAGE_SIZE, SMALL_PAGES);
+
+    set_huge_pages(true);
+    cr_assert(huge_pages_enabled(), "Huge pages were not enabled");
+    set_huge_pages(false);
+    cr_assert_not(huge_pages_enabled(), "Huge pages were not disabled");
+}
+
+Test(hugepage_suite, 02_transparent_pages_obtained, .timeout = 2) {
+    page_sizes pages;
+    char *memory = huge_alloc(2 * HUGE_PAGE_SIZE, &pages);
+    cr_assert_not_null(memory, "Could not map two huge pages");
+    uint64_t before = transparent_huge_page_bytes();
+    memset(memory, 0xAB, 2 * HUGE_PAGE_SIZE);
+    uint64_t after = transparent_huge_page_bytes();
+
+    // the kernel reports whole huge pages, and only the ones it handed out
+    cr_assert_eq(after % HUGE_PAGE_SIZE, 0, "%lu bytes are not whole huge pages", (unsigned long) after);
+    if (pages != TRANSPARENT_HUGE_PAGES) {
+        cr_assert_eq(after, before, "Pages that weren't asked for were counted");
+    }
+    cr_assert(after <= before + 2 * HUGE_PAGE_SIZE, "More pages were counted than were touched");
+    huge_free(memory, 2 * HUGE_PAGE_SIZE, pages);
+}
@@ -15,6 +15,10 @@ void queue_free_function(void *item) {
     free(item);
 }
 
+/* Used for items that are integers, which have nothing to free */
+void queue_keep_function(void *item) {
+}
+
 void queue_init(void) {
     global_queue = create_queue();
 }
@@ -47,10 +51,248 @@ Test(queue_suite, 01_multithreaded, .timeout = 2, .init = queue_init, .fini = qu
     for(int index = 0; index < NUM_THREADS; index++) {
         pthread_join(thread_ids[index], NULL);
     }
-    // get number of items in queue
-    int num_items;
-    if(sem_getvalue(&global_queue->items, &num_items) != 0)
-        exit(EXIT_FAILURE);
-    cr_assert_eq(num_items, NUM_THREADS, "Had %d items. Expected: %d", num_items, NUM_THREADS);
+    // every item must come out exactly once, and nothing else
+    bool seen[NUM_THREADS] = {false};
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *item = dequeue(global_queue);
+        cr_assert_not_null(item, "Dequeued NULL");
+        cr_assert_not(seen[*item], "Dequeued item %d twice", *item);
+        seen[*item] = true;
+        free(item);
+    }
+    cr_assert_eq(global_queue->enqueue_pos, global_queue->dequeue_pos, "Items were left in the queue");
+}
+
+Test(queue_suite, 02_fifo_wraps, .timeout = 2, .init = queue_init, .fini = queue_fini) {
+    // go around the ring a few times
+    for(uintptr_t index = 1; index <= 3 * QUEUE_CAPACITY; index++) {
+        cr_assert(enqueue(global_queue, (void *) index), "Could not enqueue %lu", (unsigned long) index);
+        cr_assert_eq(dequeue(global_queue), (void *) index, "Items came out of order");
+    }
+    cr_assert_not(enqueue(global_queue, NULL), "Enqueued NULL");
+    cr_assert_eq(errno, EINVAL, "errno was not EINVAL");
+}
+
+void *thread_dequeue(void *arg) {
+    return dequeue(global_queue);
+}
+
+Test(queue_suite, 03_wakes_sleeping_consumer, .timeout = 2, .init = queue_init, .fini = queue_fini) {
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, thread_dequeue, NULL);
+    // give the consumer time to fall asleep on the empty queue
+    usleep(50000);
+    int *item = malloc(sizeof(int));
+    *item = 7;
+    enqueue(global_queue, item);
+
+    void *dequeued;
+    pthread_join(consumer, &dequeued);
+    cr_assert_eq(dequeued, item, "The sleeping consumer did not get the item");
+    free(item);
+}
+
+#define STRESS_PRODUCERS 4
+#define STRESS_CONSUMERS 4
+#define STRESS_ITEMS 200000
+
+static uint64_t stress_sum;
+static uint64_t stress_count;
+
+void *thread_produce(void *arg) {
+    uintptr_t first = (uintptr_t) arg;
+    for(uintptr_t index = first; index < first + STRESS_ITEMS; index++) {
+        enqueue(global_queue, (void *) index);
+    }
+    return NULL;
+}
+
+void *thread_consume(void *arg) {
+    while(1) {
+        uintptr_t item = (uintptr_t) dequeue(global_queue);
+        if(item == 0) {
+            return NULL;
+        }
+        __atomic_add_fetch(&stress_sum, item, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stress_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+Test(queue_suite, 04_stress, .timeout = 20, .init = queue_init) {
+    pthread_t producers[STRESS_PRODUCERS];
+    pthread_t consumers[STRESS_CONSUMERS];
+    // far more items than cells, so producers wait for room and consumers for items
+    for(uintptr_t index = 0; index < STRESS_CONSUMERS; index++) {
+        pthread_create(&consumers[index], NULL, thread_consume, NULL);
+    }
+    for(uintptr_t index = 0; index < STRESS_PRODUCERS; index++) {
+        pthread_create(&producers[index], NULL, thread_produce, (void *) (1 + index * STRESS_ITEMS));
+    }
+    for(int index = 0; index < STRESS_PRODUCERS; index++) {
+        pthread_join(producers[index], NULL);
+    }
+    while(__atomic_load_n(&stress_count, __ATOMIC_RELAXED) < STRESS_PRODUCERS * STRESS_ITEMS) {
+        usleep(1000);
+    }
+    // consumers waiting on the empty queue wake up with NULL
+    invalidate_queue(global_queue, queue_keep_function);
+    for(int index = 0; index < STRESS_CONSUMERS; index++) {
+        pthread_join(consumers[index], NULL);
+    }
+
+    uint64_t total = (uint64_t) STRESS_PRODUCERS * STRESS_ITEMS;
+    cr_assert_eq(stress_count, total, "Dequeued %lu items. Expected: %lu", (unsigned long) stress_count, (unsigned long) total);
+    cr_assert_eq(stress_sum, total * (total + 1) / 2, "Items were lost or dequeued twice");
+}
+
+
+scheduler_t *global_scheduler;
+
+void scheduler_init(void) {
+    global_scheduler = create_scheduler(4);
+}
+
+void scheduler_fini(void) {
+    invalidate_scheduler(global_scheduler, queue_keep_function);
+}
+
+Test(queue_suite, 05_round_robin, .timeout = 2, .init = scheduler_init, .fini = scheduler_fini) {
+    for(uintptr_t index = 1; index <= 8; index++) {
+        cr_assert(schedule(global_scheduler, (void *) index), "Could not schedule %lu", (unsigned long) index);
+    }
+    // every worker got two items and takes its own first
+    for(uint32_t worker = 0; worker < 4; worker++) {
+        cr_assert_eq(next_item(global_scheduler, worker), (void *) (uintptr_t) (worker + 1), "Worker %u did not get its own item", worker);
+    }
+    // worker 0 is out of items and steals from the next worker that has one
+    cr_assert_eq(next_item(global_scheduler, 0), (void *) 5, "Worker 0 did not take its second item");
+    cr_assert_eq(next_item(global_scheduler, 0), (void *) 6, "Worker 0 did not steal from worker 1");
+    cr_assert_eq(create_scheduler(0), NULL, "Created a scheduler without workers");
 }
 
+void *thread_next_item(void *arg) {
+    return next_item(global_scheduler, (uint32_t) (uintptr_t) arg);
+}
+
+Test(queue_suite, 06_idle_worker_steals, .timeout = 2, .init = scheduler_init, .fini = scheduler_fini) {
+    pthread_t idle;
+    pthread_create(&idle, NULL, thread_next_item, (void *) 3);
+    usleep(50000);
+    // the item goes to worker 0, which is busy, so the sleeping worker 3 has to steal it
+    schedule(global_scheduler, (void *) 42);
+
+    void *stolen;
+    pthread_join(idle, &stolen);
+    cr_assert_eq(stolen, (void *) 42, "The idle worker did not steal the item");
+}
+
+#define STEAL_WORKERS 4
+
+static uint64_t steal_count[STEAL_WORKERS];
+
+void *thread_worker(void *arg) {
+    uint32_t worker = (uint32_t) (uintptr_t) arg;
+    while(next_item(global_scheduler, worker) != NULL) {
+        __atomic_add_fetch(&steal_count[worker], 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void *thread_schedule(void *arg) {
+    for(uintptr_t index = 1; index <= STRESS_ITEMS; index++) {
+        schedule(global_scheduler, (void *) index);
+    }
+    return NULL;
+}
+
+Test(queue_suite, 07_scheduler_stress, .timeout = 20, .init = scheduler_init) {
+    pthread_t workers[STEAL_WORKERS];
+    pthread_t producers[STRESS_PRODUCERS];
+    for(uintptr_t index = 0; index < STEAL_WORKERS; index++) {
+        pthread_create(&workers[index], NULL, thread_worker, (void *) index);
+    }
+    for(int index = 0; index < STRESS_PRODUCERS; index++) {
+        pthread_create(&producers[index], NULL, thread_schedule, NULL);
+    }
+    for(int index = 0; index < STRESS_PRODUCERS; index++) {
+        pthread_join(producers[index], NULL);
+    }
+
+    uint64_t total = (uint64_t) STRESS_PRODUCERS * STRESS_ITEMS;
+    uint64_t taken = 0;
+    while(taken < total) {
+        usleep(1000);
+        taken = 0;
+        for(int index = 0; index < STEAL_WORKERS; index++) {
+            taken += __atomic_load_n(&steal_count[index], __ATOMIC_RELAXED);
+        }
+    }
+    invalidate_scheduler(global_scheduler, queue_keep_function);
+    for(int index = 0; index < STEAL_WORKERS; index++) {
+        pthread_join(workers[index], NULL);
+    }
+    cr_assert_eq(taken, total, "Workers took %lu items. Expected: %lu", (unsigned long) taken, (unsigned long) total);
+}
+
+Test(queue_suite, 08_batches, .timeout = 2, .init = queue_init, .fini = queue_fini) {
+    void *items[100];
+    for(uintptr_t index = 0; index < 100; index++) {
+        items[index] = (void *) (index + 1);
+    }
+    // start close to the end of the ring so the batch wraps around it
+    for(int index = 0; index < QUEUE_CAPACITY - 30; index++) {
+        enqueue(global_queue, (void *) 1);
+        dequeue(global_queue);
+    }
+    cr_assert(enqueue_batch(global_queue, items, 100), "Could not enqueue the batch");
+
+    void *out[64];
+    size_t taken = dequeue_batch(global_queue, out, 64);
+    cr_assert_eq(taken, 64, "Took %lu items. Expected: 64", (unsigned long) taken);
+    taken += dequeue_batch(global_queue, out + 0, 64);
+    cr_assert_eq(taken, 100, "Took %lu items. Expected: 100", (unsigned long) taken);
+    for(uintptr_t index = 0; index < 36; index++) {
+        cr_assert_eq(out[index], (void *) (index + 65), "Items came out of order");
+    }
+
+    void *with_null[2] = {(void *) 1, NULL};
+    cr_assert_not(enqueue_batch(global_queue, with_null, 2), "Enqueued a batch holding NULL");
+    cr_assert_eq(errno, EINVAL, "errno was not EINVAL");
+}
+
+Test(queue_suite, 09_schedule_batch, .timeout = 2, .init = scheduler_init, .fini = scheduler_fini) {
+    void *items[10];
+    for(uintptr_t index = 0; index < 10; index++) {
+        items[index] = (void *) (index + 1);
+    }
+    cr_assert(schedule_batch(global_scheduler, items, 10), "Could not schedule the batch");
+
+    // dealt round-robin, worker 1 got the 2nd, 6th and 10th item
+    void *out[8];
+    size_t taken = next_items(global_scheduler, 1, out, 8);
+    cr_assert_eq(taken, 3, "Worker 1 took %lu items. Expected: 3", (unsigned long) taken);
+    cr_assert(out[0] == (void *) 2 && out[1] == (void *) 6 && out[2] == (void *) 10, "Worker 1 got the wrong items");
+
+    // worker 1 is out of items and steals all of worker 2's
+    taken = next_items(global_scheduler, 1, out, 8);
+    cr_assert_eq(taken, 2, "Worker 1 stole %lu items. Expected: 2", (unsigned long) taken);
+    cr_assert(out[0] == (void *) 3 && out[1] == (void *) 7, "Worker 1 stole the wrong items");
+}
+
+void *thread_next_items(void *arg) {
+    void **out = arg;
+    return (void *) next_items(global_scheduler, 0, out, 8);
+}
+
+Test(queue_suite, 10_batch_wakes_sleeping_worker, .timeout = 2, .init = scheduler_init, .fini = scheduler_fini) {
+    void *out[8];
+    pthread_t idle;
+    pthread_create(&idle, NULL, thread_next_items, out);
+    usleep(50000);
+    void *items[4] = {(void *) 1, (void *) 2, (void *) 3, (void *) 4};
+    schedule_batch(global_scheduler, items, 4);
+
+    void *taken;
+    pthread_join(idle, &taken);
+    cr_assert((uintptr_t) taken >= 1, "The sleeping worker took no items");
+}
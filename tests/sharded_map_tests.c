@@ -0,0 +1,198 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "debug.h"
+#include "sharded_map.h"
+#define NUM_THREADS 100
+#define NUM_SHARDS 8
+#define MAP_KEY(kbase, klen) (map_key_t) {.key_base = kbase, .key_len = klen}
+#define MAP_VAL(vbase, vlen) (map_val_t) {.val_base = vbase, .val_len = vlen}
+
+static sharded_map_t *sharded_map;
+
+/* Used in item destruction */
+static void sharded_free_function(map_key_t key, map_val_t val) {
+    free(key.key_base);
+    free(val.val_base);
+}
+
+static uint32_t sharded_hash(map_key_t map_key) {
+    const uint8_t *key = map_key.key_base;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < map_key.key_len; i++) {
+        hash ^= key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int hash_calls;
+
+static uint32_t counted_hash(map_key_t map_key) {
+    __atomic_add_fetch(&hash_calls, 1, __ATOMIC_RELAXED);
+    return sharded_hash(map_key);
+}
+
+static void sharded_init(void) {
+    sharded_map = create_sharded_map(NUM_THREADS * 2, NUM_SHARDS - 1, sharded_hash, sharded_free_function, GROUP_PROBING);
+}
+
+static void sharded_fini(void) {
+    invalidate_sharded_map(sharded_map);
+}
+
+static int sharded_size(void) {
+    int size = 0;
+    for (uint32_t s = 0; s < sharded_map->num_shards; s++) {
+        size += sharded_map->shards[s]->size;
+    }
+    return size;
+}
+
+static void *sharded_thread_put(void *arg) {
+    int index = *(int *) arg;
+    int *key_ptr = malloc(sizeof(int));
+    int *val_ptr = malloc(sizeof(int));
+    *key_ptr = index;
+    *val_ptr = index * 2;
+
+    sharded_put(sharded_map, MAP_KEY(key_ptr, sizeof(int)), MAP_VAL(val_ptr, sizeof(int)), false);
+    return NULL;
+}
+
+Test(sharded_suite, 00_creation, .timeout = 2, .init = sharded_init, .fini = sharded_fini) {
+    cr_assert_not_null(sharded_map, "Map returned was NULL");
+    cr_assert_eq(sharded_map->num_shards, NUM_SHARDS, "Had %u shards. Expected %d", sharded_map->num_shards, NUM_SHARDS);
+    cr_assert_eq(sharded_map->shards[0]->capacity, NUM_THREADS * 2 / NUM_SHARDS, "Shards don't split the capacity");
+}
+
+Test(sharded_suite, 01_multithreaded, .timeout = 2, .init = sharded_init, .fini = sharded_fini) {
+    pthread_t thread_ids[NUM_THREADS];
+    int indexes[NUM_THREADS];
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        indexes[index] = index;
+        if(pthread_create(&thread_ids[index], NULL, sharded_thread_put, &indexes[index]) != 0)
+            exit(EXIT_FAILURE);
+    }
+    for(int index = 0; index < NUM_THREADS; index++) {
+        pthread_join(thread_ids[index], NULL);
+    }
+
+    int stored = 0;
+    for(int index = 0; index < NUM_THREADS; index++) {
+        map_val_t val = sharded_get(sharded_map, MAP_KEY(&index, sizeof(int)));
+        if (val.val_base != NULL) {
+            cr_assert_eq(*(int *) val.val_base, index * 2, "Wrong value for key %d", index);
+            stored++;
+        }
+    }
+    cr_assert_eq(stored, sharded_size(), "Found %d keys but the shards hold %d", stored, sharded_size());
+    cr_assert_eq(stored, NUM_THREADS, "Found %d keys. Expected %d", stored, NUM_THREADS);
+}
+
+Test(sharded_suite, 02_batch, .timeout = 2, .init = sharded_init, .fini = sharded_fini) {
+    map_key_t keys[NUM_THREADS * 3];
+    map_val_t vals[NUM_THREADS * 3];
+
+    // more pairs than the map holds, so full shards reject some of them
+    for(int index = 0; index < NUM_THREADS * 3; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 3;
+        keys[index] = MAP_KEY(key_ptr, sizeof(int));
+        vals[index] = MAP_VAL(val_ptr, sizeof(int));
+    }
+
+    size_t inserted = sharded_put_batch(sharded_map, keys, vals, NUM_THREADS * 3, false);
+    cr_assert_eq(inserted, NUM_THREADS * 2, "Inserted %zu pairs. Expected %d", inserted, NUM_THREADS * 2);
+    cr_assert_eq(sharded_size(), NUM_THREADS * 2, "Had %d items in map. Expected %d", sharded_size(), NUM_THREADS * 2);
+
+    // the inserted pairs were moved in front of the rejected ones
+    map_val_t found[NUM_THREADS * 3];
+    size_t hits = sharded_get_batch(sharded_map, keys, found, NUM_THREADS * 3);
+    cr_assert_eq(hits, inserted, "Found %zu keys. Expected %zu", hits, inserted);
+    for(size_t index = 0; index < NUM_THREADS * 3; index++) {
+        int key = *(int *) keys[index].key_base;
+        if (index < inserted) {
+            cr_assert_not_null(found[index].val_base, "Inserted key %d was not found", key);
+            cr_assert_eq(*(int *) found[index].val_base, key * 3, "Wrong value for key %d", key);
+        } else {
+            cr_assert_null(found[index].val_base, "Rejected key %d was found", key);
+            free(keys[index].key_base);
+            free(vals[index].val_base);
+        }
+    }
+}
+
+Test(sharded_suite, 03_batch_invalid_pair, .timeout = 2, .init = sharded_init, .fini = sharded_fini) {
+    map_key_t keys[NUM_THREADS];
+    map_val_t vals[NUM_THREADS];
+    int invalid = NUM_THREADS / 2;
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index * 3;
+        keys[index] = MAP_KEY(key_ptr, sizeof(int));
+        vals[index] = MAP_VAL(val_ptr, index == invalid ? 0 : sizeof(int));
+    }
+
+    size_t inserted = sharded_put_batch(sharded_map, keys, vals, NUM_THREADS, false);
+    cr_assert_lt(inserted, NUM_THREADS, "Inserted a pair without a value");
+    cr_assert_eq(sharded_size(), inserted, "Had %d items in map. Reported %zu", sharded_size(), inserted);
+
+    // the pairs reported as inserted are in the map and every other one, the invalid one among them, isn't
+    map_val_t found[NUM_THREADS];
+    sharded_get_batch(sharded_map, keys, found, NUM_THREADS);
+    for(size_t index = 0; index < NUM_THREADS; index++) {
+        int key = *(int *) keys[index].key_base;
+        if (index < inserted) {
+            cr_assert_neq(key, invalid, "The invalid pair was reported as inserted");
+            cr_assert_not_null(found[index].val_base, "Inserted key %d was not found", key);
+        } else {
+            cr_assert_null(found[index].val_base, "Rejected key %d was found", key);
+            free(keys[index].key_base);
+            free(vals[index].val_base);
+        }
+    }
+}
+
+Test(sharded_suite, 04_hash_once, .timeout = 2, .fini = sharded_fini) {
+    sharded_map = create_sharded_map(NUM_THREADS * 2, NUM_SHARDS, counted_hash, sharded_free_function, GROUP_PROBING);
+    map_key_t keys[NUM_THREADS];
+    map_val_t vals[NUM_THREADS];
+
+    for(int index = 0; index < NUM_THREADS; index++) {
+        int *key_ptr = malloc(sizeof(int));
+        int *val_ptr = malloc(sizeof(int));
+        *key_ptr = index;
+        *val_ptr = index;
+        keys[index] = MAP_KEY(key_ptr, sizeof(int));
+        vals[index] = MAP_VAL(val_ptr, sizeof(int));
+    }
+
+    // the shard is picked with the same hash the segment probes with
+    hash_calls = 0;
+    cr_assert(sharded_put(sharded_map, keys[0], vals[0], false), "Could not put a key");
+    cr_assert_eq(hash_calls, 1, "A put hashed its key %d times", hash_calls);
+    cr_assert_not_null(sharded_get(sharded_map, keys[0]).val_base, "The key was not found");
+    cr_assert_eq(hash_calls, 2, "A get hashed its key %d times", hash_calls - 1);
+
+    hash_calls = 0;
+    size_t inserted = sharded_put_batch(sharded_map, keys + 1, vals + 1, NUM_THREADS - 1, false);
+    cr_assert_eq(inserted, NUM_THREADS - 1, "Inserted %zu pairs. Expected %d", inserted, NUM_THREADS - 1);
+    cr_assert_eq(hash_calls, NUM_THREADS - 1, "A batch of %d keys was hashed %d times", NUM_THREADS - 1, hash_calls);
+
+    hash_calls = 0;
+    map_val_t found[NUM_THREADS];
+    cr_assert_eq(sharded_get_batch(sharded_map, keys, found, NUM_THREADS), NUM_THREADS, "Not every key was found");
+    cr_assert_eq(hash_calls, NUM_THREADS, "A batch of %d keys was hashed %d times", NUM_THREADS, hash_calls);
+    cr_assert(sharded_delete(sharded_map, keys[0]).tombstone, "Could not delete a key");
+    cr_assert_eq(hash_calls, NUM_THREADS + 1, "A delete hashed its key %d times", hash_calls - NUM_THREADS);
+}
@@ -0,0 +1,195 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "debug.h"
+#include "slab.h"
+#include "hugepage.h"
+#define NUM_THREADS 8
+#define NUM_CHUNKS 2000
+
+Test(slab_suite, 00_size_classes, .timeout = 2) {
+    cr_assert_null(slab_alloc(0), "Allocated an empty chunk");
+    cr_assert_null(slab_alloc(slab_max_size() + 1), "Allocated a chunk larger than the largest class");
+
+    // every class is at most a quarter larger than the one below it, plus rounding
+    for (size_t size = 1; size <= slab_max_size(); size += 37) {
+        char *chunk = slab_alloc(size);
+        cr_assert_not_null(chunk, "Could not allocate %zu bytes", size);
+        size_t chunk_size = slab_size(chunk);
+        cr_assert(chunk_size >= size && chunk_size <= (size < SLAB_MIN_CHUNK ? SLAB_MIN_CHUNK : size * 5 / 4 + 16),
+                  "%zu bytes got a chunk of %zu", size, chunk_size);
+        memset(chunk, 0xAB, size);
+        slab_free(chunk);
+    }
+    cr_assert_eq(slab_size(slab_alloc(slab_max_size())), slab_max_size(), "The largest class is not the largest size");
+}
+
+Test(slab_suite, 01_reuse, .timeout = 2) {
+    void *first = slab_alloc(100);
+    slab_free(first);
+    void *second = slab_alloc(90);
+    cr_assert_eq(first, second, "A freed chunk of the same class was not reused");
+    slab_free(second);
+}
+
+static void *slab_thread(void *arg) {
+    uintptr_t id = (uintptr_t) arg;
+    char *chunks[NUM_CHUNKS];
+    size_t sizes[NUM_CHUNKS];
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < NUM_CHUNKS; i++) {
+            sizes[i] = 1 + (i * 131 + id * 17 + round) % slab_max_size();
+            chunks[i] = slab_alloc(sizes[i]);
+            if (chunks[i] == NULL) {
+                return (void *) 1;
+            }
+            memset(chunks[i], (int) id, sizes[i]);
+        }
+        // a chunk handed to two threads at once would be overwritten by the other one
+        for (int i = 0; i < NUM_CHUNKS; i++) {
+            for (size_t b = 0; b < sizes[i]; b++) {
+                if (chunks[i][b] != (char) id) {
+                    return (void *) 1;
+                }
+            }
+            slab_free(chunks[i]);
+        }
+    }
+    return NULL;
+}
+
+Test(slab_suite, 02_multithreaded, .timeout = 10) {
+    pthread_t threads[NUM_THREADS];
+    for (uintptr_t i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, slab_thread, (void *) (i + 1));
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        void *failed;
+        pthread_join(threads[i], &failed);
+        cr_assert_null(failed, "Thread %d saw a chunk that another thread was using", i);
+    }
+}
+
+Test(slab_suite, 03_huge_pages, .timeout = 2) {
+    set_huge_pages(true);
+    // more chunks of the largest class than one slab page holds, so at least one page is cut from a huge page
+    size_t num_chunks = SLAB_PAGE_SIZE / slab_max_size() + 1;
+    char *chunks[num_chunks];
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i] = slab_alloc(slab_max_size());
+        cr_assert_not_null(chunks[i], "Could not allocate chunk %zu", i);
+        memset(chunks[i], (int) i, slab_max_size());
+    }
+    set_huge_pages(false);
+
+    huge_page_stats_t stats = huge_page_stats();
+    cr_assert_geq(stats.hugetlb_bytes + stats.transparent_bytes + stats.small_bytes, HUGE_PAGE_SIZE,
+                  "No huge page was mapped for the slabs");
+    for (size_t i = 0; i < num_chunks; i++) {
+        cr_assert_eq(chunks[i][slab_max_size() - 1], (char) i, "Chunk %zu was overwritten", i);
+        slab_free(chunks[i]);
+    }
+}
+
+Test(slab_suite, 04_pages_move_between_classes, .timeout = 2) {
+    // the other tests leave at most one empty page in every class they used
+    uint64_t before = slab_footprint();
+
+    // fill a few pages with small chunks
+    size_t small_chunks = 4 * (SLAB_PAGE_SIZE / SLAB_MIN_CHUNK);
+    char **chunks = malloc(small_chunks * sizeof(char *));
+    for (size_t i = 0; i < small_chunks; i++) {
+        chunks[i] = slab_alloc(SLAB_MIN_CHUNK);
+        cr_assert_not_null(chunks[i], "Could not allocate small chunk %zu", i);
+    }
+    uint64_t filled = slab_footprint();
+    cr_assert_geq(filled, before + 3 * SLAB_PAGE_SIZE, "%lu bytes of pages hold four pages of chunks", (unsigned long) filled);
+    uintptr_t last_page = (uintptr_t) chunks[small_chunks - 1] & ~(uintptr_t) (SLAB_PAGE_SIZE - 1);
+
+    for (size_t i = 0; i < small_chunks; i++) {
+        slab_free(chunks[i]);
+    }
+    cr_assert(slab_footprint() <= before + SLAB_PAGE_SIZE, "The small class kept more than one emptied page");
+
+    // the same bytes in the largest class fit in the pages the small chunks gave up
+    size_t large_chunks = small_chunks * SLAB_MIN_CHUNK / slab_max_size();
+    bool reused = false;
+    for (size_t i = 0; i < large_chunks; i++) {
+        chunks[i] = slab_alloc(slab_max_size());
+        cr_assert_not_null(chunks[i], "Could not allocate large chunk %zu", i);
+        reused |= ((uintptr_t) chunks[i] & ~(uintptr_t) (SLAB_PAGE_SIZE - 1)) == last_page;
+    }
+    cr_assert(reused, "The large chunks did not reuse a page of the small ones");
+    cr_assert(slab_footprint() <= filled + SLAB_PAGE_SIZE, "The footprint grew to %lu bytes, from %lu",
+              (unsigned long) slab_footprint(), (unsigned long) filled);
+
+    for (size_t i = 0; i < large_chunks; i++) {
+        slab_free(chunks[i]);
+    }
+    free(chunks);
+}
+
+Test(slab_suite, 05_churn_at_page_boundary, .timeout = 2) {
+    // one chunk more than a page of the class holds, so the last one is alone on a second page
+    size_t size = 3000;
+    char *probe = slab_alloc(size);
+    // chunks start after the cache line that heads every page
+    size_t num_chunks = (SLAB_PAGE_SIZE - 64) / slab_size(probe) + 1;
+    slab_free(probe);
+    char **chunks = malloc(num_chunks * sizeof(char *));
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i] = slab_alloc(size);
+        cr_assert_not_null(chunks[i], "Could not allocate chunk %zu", i);
+    }
+
+    // the page emptied by the free is kept by its class, so the same chunk comes back
+    uint64_t footprint = slab_footprint();
+    char *last = chunks[num_chunks - 1];
+    for (int round = 0; round < 100; round++) {
+        slab_free(chunks[num_chunks - 1]);
+        cr_assert_eq(slab_footprint(), footprint, "Round %d gave the emptied page up", round);
+        chunks[num_chunks - 1] = slab_alloc(size);
+        cr_assert_eq(chunks[num_chunks - 1], last, "Round %d got another chunk", round);
+        cr_assert_eq(slab_footprint(), footprint, "Round %d moved a page in or out of the class", round);
+    }
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        slab_free(chunks[i]);
+    }
+    free(chunks);
+}
+
+static void *cache_thread(void *arg) {
+    char **chunks = arg;
+    slab_use_cache(slab_create_cache());
+    chunks[1] = slab_alloc(100);
+    chunks[2] = slab_alloc(100);
+    slab_free(chunks[2]);
+    // the chunk just freed is reused by the thread's own class
+    chunks[3] = slab_alloc(100);
+    return NULL;
+}
+
+Test(slab_suite, 06_thread_cache, .timeout = 2) {
+    char *chunks[4];
+    chunks[0] = slab_alloc(100);
+    pthread_t thread;
+    pthread_create(&thread, NULL, cache_thread, chunks);
+    pthread_join(thread, NULL);
+
+    for (int i = 1; i < 4; i++) {
+        cr_assert_not_null(chunks[i], "Could not allocate chunk %d from the thread's cache", i);
+    }
+    uintptr_t shared_page = (uintptr_t) chunks[0] & ~(uintptr_t) (SLAB_PAGE_SIZE - 1);
+    uintptr_t own_page = (uintptr_t) chunks[1] & ~(uintptr_t) (SLAB_PAGE_SIZE - 1);
+    cr_assert_neq(own_page, shared_page, "The thread's cache shared a page with the shared classes");
+    cr_assert_eq(chunks[3], chunks[2], "The thread's cache did not reuse its freed chunk");
+    cr_assert_eq(slab_size(chunks[1]), slab_size(chunks[0]), "The thread's cache has other size classes");
+
+    // the thread stopped allocating, so its chunks can be freed here
+    slab_free(chunks[1]);
+    slab_free(chunks[3]);
+    slab_free(chunks[0]);
+}
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "debug.h"
+#include "topology.h"
+
+/* The first CPU the tests may run on */
+static int first_allowed_cpu(void) {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu_allowed(cpu)) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static void *report_cpu(void *arg) {
+    *(int *) arg = sched_getcpu();
+    return NULL;
+}
+
+Test(topology_suite, 00_parse_cpu_list, .timeout = 2) {
+    int cpus[MAX_CPUS];
+    int expected[] = {0, 1, 2, 3, 8, 10, 11, 8};
+    int count = parse_cpu_list("0-3,8,10-11,8", cpus, MAX_CPUS);
+    cr_assert_eq(count, 8, "Parsed %d CPUs. Expected 8", count);
+    for (int i = 0; i < count; i++) {
+        cr_assert_eq(cpus[i], expected[i], "CPU %d was %d. Expected %d", i, cpus[i], expected[i]);
+    }
+    cr_assert_eq(parse_cpu_list("5", cpus, MAX_CPUS), 1, "Could not parse a single CPU");
+    cr_assert_eq(cpus[0], 5, "Parsed CPU %d. Expected 5", cpus[0]);
+}
+
+Test(topology_suite, 01_malformed_lists, .timeout = 2) {
+    int cpus[4];
+    const char *lists[] = {"", "a", "1,", ",1", "3-1", "1-", "-1", "1;2", "0-4", "1024"};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        errno = 0;
+        cr_assert_eq(parse_cpu_list(lists[i], cpus, 4), -1, "Parsed \"%s\"", lists[i]);
+        cr_assert_eq(errno, EINVAL, "errno was not EINVAL for \"%s\"", lists[i]);
+    }
+}
+
+Test(topology_suite, 02_pinned_thread, .timeout = 2) {
+    int cpu = first_allowed_cpu();
+    cr_assert_geq(cpu, 0, "The process may not run on any CPU");
+
+    int ran_on = -1;
+    pthread_t thread;
+    cr_assert_eq(create_pinned_thread(&thread, cpu, report_cpu, &ran_on), 0, "Could not start a thread on CPU %d", cpu);
+    pthread_join(thread, NULL);
+    cr_assert_eq(ran_on, cpu, "The thread ran on CPU %d. Expected %d", ran_on, cpu);
+
+    cr_assert_neq(create_pinned_thread(&thread, CPU_SETSIZE, report_cpu, &ran_on), 0, "Started a thread on a CPU that doesn't exist");
+}
+
+Test(topology_suite, 03_bind_memory, .timeout = 2) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char *page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    cr_assert_neq(page, MAP_FAILED, "Could not map a page");
+
+    errno = 0;
+    cr_assert_not(bind_memory(page, page_size, -1), "Bound memory to no node");
+    cr_assert_eq(errno, EINVAL, "errno was not EINVAL");
+    cr_assert_not(bind_memory(page, page_size, MAX_NUMA_NODES), "Bound memory past the last node");
+
+    int node = cpu_node(first_allowed_cpu());
+    if (node >= 0) {
+        cr_assert(bind_memory(page, page_size, node), "Could not bind memory to node %d: %s", node, strerror(errno));
+    }
+    page[0] = 1;
+    munmap(page, page_size);
+    cr_assert_geq(num_numa_nodes(), 1, "The host has no NUMA node");
+}